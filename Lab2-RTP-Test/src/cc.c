@@ -0,0 +1,156 @@
+#include <math.h>
+#include <string.h>
+#include "cc.h"
+
+#define CC_INIT_CWND 4      // Initial window in pkts
+#define CC_MIN_SSTHRESH 2
+
+#define CUBIC_C 0.4         // Scaling constant in pkts/s^3
+#define CUBIC_BETA 0.7      // Multiplicative decrease factor
+
+static void clamp(rtp_cc_t* cc){
+    if(cc->cwnd > cc->max_cwnd)
+        cc->cwnd = cc->max_cwnd;
+    if(cc->cwnd < 1)
+        cc->cwnd = 1;
+}
+
+// No congestion control: the whole window is always usable.
+static void none_init(rtp_cc_t* cc){
+    cc->cwnd = cc->max_cwnd;
+    cc->ssthresh = cc->max_cwnd;
+}
+
+static void none_ack(rtp_cc_t* cc, uint32_t acked, uint64_t now_us, uint64_t srtt){
+}
+
+static void none_event(rtp_cc_t* cc, uint64_t now_us){
+}
+
+const rtp_cc_ops_t rtp_cc_none = {"none", none_init, none_ack, none_event, none_event};
+
+// NewReno AIMD: slow start, then one pkt per RTT, halve on loss.
+static void reno_init(rtp_cc_t* cc){
+    cc->cwnd = CC_INIT_CWND;
+    cc->ssthresh = cc->max_cwnd;
+}
+
+static void reno_ack(rtp_cc_t* cc, uint32_t acked, uint64_t now_us, uint64_t srtt){
+    if(cc->cwnd < cc->ssthresh)
+        cc->cwnd += acked;
+    else
+        cc->cwnd += (double)acked / cc->cwnd;
+}
+
+static void reno_loss(rtp_cc_t* cc, uint64_t now_us){
+    cc->ssthresh = cc->cwnd / 2 > CC_MIN_SSTHRESH ? cc->cwnd / 2 : CC_MIN_SSTHRESH;
+    cc->cwnd = cc->ssthresh;
+}
+
+static void reno_timeout(rtp_cc_t* cc, uint64_t now_us){
+    reno_loss(cc, now_us);
+    cc->cwnd = 1;
+}
+
+const rtp_cc_ops_t rtp_cc_newreno = {"newreno", reno_init, reno_ack, reno_loss, reno_timeout};
+
+// CUBIC (RFC 8312): after a loss cwnd follows a cubic of time since the loss,
+// flat around the window where the loss happened.
+static void cubic_init(rtp_cc_t* cc){
+    reno_init(cc);
+    cc->w_max = 0;
+    cc->epoch = 0;
+}
+
+static void cubic_ack(rtp_cc_t* cc, uint32_t acked, uint64_t now_us, uint64_t srtt){
+    if(cc->cwnd < cc->ssthresh){
+        cc->cwnd += acked;
+        return;
+    }
+    if(cc->epoch == 0){
+        cc->epoch = now_us;
+        cc->w_est = cc->cwnd;
+        if(cc->cwnd < cc->w_max){
+            cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+            cc->origin = cc->w_max;
+        }
+        else{
+            cc->k = 0;
+            cc->origin = cc->cwnd;
+        }
+    }
+
+    // Aim at the cubic one RTT ahead.
+    double t = (double)(now_us - cc->epoch + srtt) / 1e6 - cc->k;
+    double target = cc->origin + CUBIC_C * t * t * t;
+    if(target > cc->cwnd)
+        cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+    else
+        cc->cwnd += 0.01 * acked / cc->cwnd;
+
+    // Never grow slower than Reno would.
+    cc->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->cwnd;
+    if(cc->w_est > cc->cwnd)
+        cc->cwnd = cc->w_est;
+}
+
+static void cubic_loss(rtp_cc_t* cc, uint64_t now_us){
+    // Fast convergence: release bandwidth when losing below the last plateau.
+    if(cc->cwnd < cc->w_max)
+        cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    else
+        cc->w_max = cc->cwnd;
+    cc->ssthresh = cc->cwnd * CUBIC_BETA > CC_MIN_SSTHRESH ? cc->cwnd * CUBIC_BETA : CC_MIN_SSTHRESH;
+    cc->cwnd = cc->ssthresh;
+    cc->epoch = 0;
+}
+
+static void cubic_timeout(rtp_cc_t* cc, uint64_t now_us){
+    cubic_loss(cc, now_us);
+    cc->cwnd = 1;
+}
+
+const rtp_cc_ops_t rtp_cc_cubic = {"cubic", cubic_init, cubic_ack, cubic_loss, cubic_timeout};
+
+const rtp_cc_ops_t* rtp_ccFind(const char* name){
+    const rtp_cc_ops_t* all[] = {&rtp_cc_none, &rtp_cc_newreno, &rtp_cc_cubic};
+    for(int i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        if(strcmp(all[i]->name, name) == 0)
+            return all[i];
+    return NULL;
+}
+
+void rtp_ccInit(rtp_cc_t* cc, const rtp_cc_ops_t* ops, uint32_t max_cwnd){
+    memset(cc, 0, sizeof(rtp_cc_t));
+    cc->ops = ops;
+    cc->max_cwnd = max_cwnd;
+    ops->init(cc);
+    clamp(cc);
+}
+
+void rtp_ccAck(rtp_cc_t* cc, uint32_t acked, uint64_t now_us, uint64_t srtt){
+    if(acked == 0)
+        return;
+    cc->ops->on_ack(cc, acked, now_us, srtt);
+    clamp(cc);
+}
+
+void rtp_ccLoss(rtp_cc_t* cc, uint32_t seq, uint32_t seq_next, uint64_t now_us){
+    if((int32_t)(seq - cc->recover) < 0)
+        return;
+    cc->recover = seq_next;
+    cc->losses++;
+    cc->ops->on_loss(cc, now_us);
+    clamp(cc);
+}
+
+void rtp_ccTimeout(rtp_cc_t* cc, uint32_t seq_next, uint64_t now_us){
+    cc->recover = seq_next;
+    cc->timeouts++;
+    cc->ops->on_timeout(cc, now_us);
+    clamp(cc);
+}
+
+uint32_t rtp_ccWindow(const rtp_cc_t* cc){
+    return (uint32_t)cc->cwnd;
+}
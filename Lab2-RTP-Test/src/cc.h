@@ -0,0 +1,87 @@
+#ifndef CC_H
+#define CC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct RTP_cc rtp_cc_t;
+
+// One congestion control algorithm. Windows are counted in pkts.
+typedef struct RTP_cc_ops{
+    const char* name;
+    void (*init)(rtp_cc_t* cc);
+    // acked pkts newly acknowledged, srtt in us (0 before any sample)
+    void (*on_ack)(rtp_cc_t* cc, uint32_t acked, uint64_t now_us, uint64_t srtt);
+    // A pkt was lost while others still got through
+    void (*on_loss)(rtp_cc_t* cc, uint64_t now_us);
+    // Retransmission timeout, the path may be gone
+    void (*on_timeout)(rtp_cc_t* cc, uint64_t now_us);
+} rtp_cc_ops_t;
+
+// Congestion state, readable by callers for comparing algorithms.
+struct RTP_cc{
+    const rtp_cc_ops_t* ops;
+    double cwnd;           // Congestion window
+    double ssthresh;       // Slow start threshold
+    uint32_t max_cwnd;     // cwnd never exceeds the window
+    uint32_t recover;      // Losses below this seq belong to the last reduction
+    uint32_t losses;       // Window reductions on loss
+    uint32_t timeouts;     // Window collapses on timeout
+    // CUBIC only
+    double w_max;          // cwnd before the last reduction
+    double w_est;          // Reno-friendly estimate
+    double k;              // Seconds from epoch to w_max
+    double origin;         // Plateau of the cubic curve
+    uint64_t epoch;        // Start of the current growth epoch in us, 0 if none
+};
+
+extern const rtp_cc_ops_t rtp_cc_none;
+extern const rtp_cc_ops_t rtp_cc_newreno;
+extern const rtp_cc_ops_t rtp_cc_cubic;
+
+/**
+ * @brief Look up an algorithm by name
+ * @param name "none", "newreno" or "cubic"
+ * @return The algorithm, NULL if unknown
+*/
+const rtp_cc_ops_t* rtp_ccFind(const char* name);
+
+/**
+ * @brief Start congestion control from its initial window
+ * @param cc Congestion state
+ * @param ops Algorithm
+ * @param max_cwnd Upper bound of cwnd, the sliding window size
+*/
+void rtp_ccInit(rtp_cc_t* cc, const rtp_cc_ops_t* ops, uint32_t max_cwnd);
+
+/**
+ * @brief Grow cwnd for newly acknowledged pkts
+*/
+void rtp_ccAck(rtp_cc_t* cc, uint32_t acked, uint64_t now_us, uint64_t srtt);
+
+/**
+ * @brief Report loss of pkt seq, reducing cwnd at most once per window of data
+ * @param seq Lost pkt
+ * @param seq_next Next pkt to be sent, losses below it do not reduce cwnd again
+*/
+void rtp_ccLoss(rtp_cc_t* cc, uint32_t seq, uint32_t seq_next, uint64_t now_us);
+
+/**
+ * @brief Report a retransmission timeout
+ * @param seq_next Next pkt to be sent
+*/
+void rtp_ccTimeout(rtp_cc_t* cc, uint32_t seq_next, uint64_t now_us);
+
+/**
+ * @brief Number of pkts allowed in flight
+*/
+uint32_t rtp_ccWindow(const rtp_cc_t* cc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
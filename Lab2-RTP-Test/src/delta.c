@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "delta.h"
+#include "util.h"
+
+#define DELTA_MAX_LITERAL (1 << 20)   // Longest literal op, so a read never scans far without output
+
+struct RTP_delta{
+    rtp_signature_t* sigs;
+    uint32_t blocks;
+    uint32_t block;
+    uint32_t* head;        // First block of each weak checksum bucket, UINT32_MAX if empty
+    uint32_t* next;        // Next block of the same bucket
+    uint32_t mask;
+    const uint8_t* data;
+    size_t size;
+    size_t pos;            // Start of the window rolled over the new file
+    size_t literal;        // Start of the bytes not covered by any op yet
+    uint32_t a, b;         // Sums of the window, valid if rolled
+    bool rolled;
+    uint32_t run_first;    // Blocks matched back to back, not written yet
+    uint32_t run_count;
+    uint8_t op[9];         // Op being written
+    uint32_t op_length;
+    uint32_t op_written;
+    size_t literal_next;   // Literal bytes of the op being written
+    size_t literal_end;
+};
+
+static uint64_t read64(const uint8_t* p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t mix64(uint64_t v){
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ULL;
+    v ^= v >> 33;
+    return v;
+}
+
+static uint64_t strong_hash(const uint8_t* data, size_t length){
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ length;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)){
+        h ^= mix64(read64(data + i));
+        h = (h << 27 | h >> 37) * 0x94d049bb133111ebULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    h ^= mix64(tail);
+    return mix64(h);
+}
+
+/**
+ * @brief Sums of the weak checksum over length bytes.
+*/
+static void weak_sums(const uint8_t* data, size_t length, uint32_t* a, uint32_t* b){
+    uint32_t sa = 0, sb = 0;
+    for(size_t i = 0; i < length; i++){
+        sa += data[i];
+        sb += sa;
+    }
+    *a = sa;
+    *b = sb;
+}
+
+static uint32_t weak_of(uint32_t a, uint32_t b){
+    return (a & 0xFFFF) | b << 16;
+}
+
+uint32_t rtp_deltaBlock(uint64_t size){
+    uint64_t block = (uint64_t)sqrt((double)size) & ~(uint64_t)7;
+    if(block < RTP_DELTA_MIN_BLOCK)
+        block = RTP_DELTA_MIN_BLOCK;
+    if(block > RTP_DELTA_MAX_BLOCK)
+        block = RTP_DELTA_MAX_BLOCK;
+    return block;
+}
+
+void rtp_deltaSignature(const char* data, size_t length, rtp_signature_t* sig){
+    uint32_t a, b;
+    weak_sums((const uint8_t*)data, length, &a, &b);
+    sig->weak = weak_of(a, b);
+    sig->strong = strong_hash((const uint8_t*)data, length);
+}
+
+rtp_delta_t* rtp_createDelta(rtp_signature_t* sigs, uint32_t blocks, uint32_t block, const char* data, size_t size){
+    rtp_delta_t* delta = calloc(1, sizeof(rtp_delta_t));
+    delta->sigs = sigs;
+    delta->blocks = blocks;
+    delta->block = block;
+    uint32_t buckets = 1;
+    while(buckets < blocks * 2 && buckets < (1u << 30))
+        buckets <<= 1;
+    delta->mask = buckets - 1;
+    delta->head = malloc(buckets * sizeof(uint32_t));
+    memset(delta->head, 0xFF, buckets * sizeof(uint32_t));
+    delta->next = malloc((blocks ? blocks : 1) * sizeof(uint32_t));
+    // Insert backwards so each bucket lists its blocks in order.
+    for(uint32_t k = blocks; k-- > 0;){
+        uint32_t h = mix64(sigs[k].weak) & delta->mask;
+        delta->next[k] = delta->head[h];
+        delta->head[h] = k;
+    }
+    delta->data = (const uint8_t*)data;
+    delta->size = size;
+    return delta;
+}
+
+void rtp_freeDelta(rtp_delta_t* delta){
+    if(!delta)
+        return;
+    free(delta->sigs);
+    free(delta->head);
+    free(delta->next);
+    free(delta);
+}
+
+/**
+ * @brief Whether block k of the old file matches the window at pos.
+*/
+static bool block_matches(rtp_delta_t* d, uint32_t k, uint32_t weak, uint64_t* strong, bool* hashed){
+    if(d->sigs[k].weak != weak)
+        return false;
+    if(!*hashed){
+        *strong = strong_hash(d->data + d->pos, d->block);
+        *hashed = true;
+    }
+    return d->sigs[k].strong == *strong;
+}
+
+/**
+ * @brief Find a block of the old file matching the window, preferring the one that extends the run.
+ * @return The block, UINT32_MAX if none
+*/
+static uint32_t find_block(rtp_delta_t* d){
+    uint32_t weak = weak_of(d->a, d->b);
+    uint64_t strong = 0;
+    bool hashed = false;
+    uint32_t follow = d->run_first + d->run_count;
+    if(d->run_count && d->literal == d->pos && follow < d->blocks && block_matches(d, follow, weak, &strong, &hashed))
+        return follow;
+    for(uint32_t k = d->head[mix64(weak) & d->mask]; k != UINT32_MAX; k = d->next[k])
+        if(block_matches(d, k, weak, &strong, &hashed))
+            return k;
+    return UINT32_MAX;
+}
+
+static void put_op(rtp_delta_t* d, uint8_t tag, uint32_t x, uint32_t y, uint32_t length){
+    d->op[0] = tag;
+    memcpy(d->op + 1, &x, sizeof(x));
+    memcpy(d->op + 5, &y, sizeof(y));
+    d->op_length = length;
+    d->op_written = 0;
+}
+
+static bool flush_run(rtp_delta_t* d){
+    if(!d->run_count)
+        return false;
+    put_op(d, RTP_DELTA_COPY, d->run_first, d->run_count, 9);
+    d->run_count = 0;
+    return true;
+}
+
+static void flush_literal(rtp_delta_t* d, size_t end){
+    put_op(d, RTP_DELTA_LITERAL, end - d->literal, 0, 5);
+    d->literal_next = d->literal;
+    d->literal_end = end;
+    d->literal = end;
+}
+
+/**
+ * @brief Scan the new file up to the next op.
+ * @return false at the end of the delta
+*/
+static bool next_op(rtp_delta_t* d){
+    while(d->blocks && d->pos + d->block <= d->size){
+        if(!d->rolled){
+            weak_sums(d->data + d->pos, d->block, &d->a, &d->b);
+            d->rolled = true;
+        }
+        uint32_t k = find_block(d);
+        if(k != UINT32_MAX){
+            // Bytes before the match go out first, then the run it cannot extend.
+            if(d->literal < d->pos){
+                if(flush_run(d))
+                    return true;
+                flush_literal(d, d->pos);
+                return true;
+            }
+            if(d->run_count && k != d->run_first + d->run_count){
+                flush_run(d);
+                return true;
+            }
+            if(!d->run_count)
+                d->run_first = k;
+            d->run_count++;
+            d->pos += d->block;
+            d->literal = d->pos;
+            d->rolled = false;
+            continue;
+        }
+        if(d->pos - d->literal >= DELTA_MAX_LITERAL){
+            if(flush_run(d))
+                return true;
+            flush_literal(d, d->pos);
+            return true;
+        }
+        // Roll the window one byte on.
+        uint32_t out = d->data[d->pos];
+        if(d->pos + d->block < d->size){
+            d->a += d->data[d->pos + d->block] - out;
+            d->b += d->a - d->block * out;
+        }
+        else
+            d->rolled = false;
+        d->pos++;
+    }
+    if(flush_run(d))
+        return true;
+    if(d->literal < d->size){
+        size_t end = d->size - d->literal > DELTA_MAX_LITERAL ? d->literal + DELTA_MAX_LITERAL : d->size;
+        flush_literal(d, end);
+        if(d->pos < end)
+            d->pos = end;
+        return true;
+    }
+    return false;
+}
+
+size_t rtp_deltaRead(rtp_delta_t* d, char* out, size_t size){
+    size_t n = 0;
+    while(n < size){
+        if(d->op_written < d->op_length){
+            size_t take = d->op_length - d->op_written;
+            if(take > size - n)
+                take = size - n;
+            memcpy(out + n, d->op + d->op_written, take);
+            d->op_written += take;
+            n += take;
+            continue;
+        }
+        if(d->literal_next < d->literal_end){
+            size_t take = d->literal_end - d->literal_next;
+            if(take > size - n)
+                take = size - n;
+            memcpy(out + n, d->data + d->literal_next, take);
+            d->literal_next += take;
+            n += take;
+            continue;
+        }
+        if(!next_op(d))
+            break;
+    }
+    return n;
+}
+
+int rtp_undeltaInit(rtp_undelta_t* undelta, int basis, uint32_t block){
+    memset(undelta, 0, sizeof(rtp_undelta_t));
+    off_t size = lseek(basis, 0, SEEK_END);
+    if(size < 0 || block == 0 || (uint64_t)size / block > UINT32_MAX)
+        return -1;
+    undelta->basis = basis;
+    undelta->block = block;
+    undelta->blocks = size / block;
+    undelta->buf = malloc(block);
+    return 0;
+}
+
+void rtp_undeltaFree(rtp_undelta_t* undelta){
+    free(undelta->buf);
+    undelta->buf = NULL;
+}
+
+ssize_t rtp_undeltaApply(rtp_undelta_t* u, const char* data, size_t length, FILE* out, uint32_t* crc){
+    ssize_t written = 0;
+    while(length){
+        if(u->literal){
+            size_t take = length < u->literal ? length : u->literal;
+            if(fwrite(data, 1, take, out) != take)
+                return -1;
+            if(crc)
+                crc32(data, take, crc);
+            u->literal -= take;
+            data += take;
+            length -= take;
+            written += take;
+            continue;
+        }
+        u->head[u->head_length++] = *data++;
+        length--;
+        uint32_t need = u->head[0] == RTP_DELTA_LITERAL ? 5 : u->head[0] == RTP_DELTA_COPY ? 9 : 0;
+        if(!need)
+            return -1;
+        if(u->head_length < need)
+            continue;
+        u->head_length = 0;
+        uint32_t x, y;
+        memcpy(&x, u->head + 1, sizeof(x));
+        if(u->head[0] == RTP_DELTA_LITERAL){
+            u->literal = x;
+            continue;
+        }
+        memcpy(&y, u->head + 5, sizeof(y));
+        if(x > u->blocks || y > u->blocks - x)
+            return -1;
+        for(uint32_t k = x; k < x + y; k++){
+            if(pread(u->basis, u->buf, u->block, (off_t)k * u->block) != (ssize_t)u->block
+                || fwrite(u->buf, 1, u->block, out) != u->block)
+                return -1;
+            if(crc)
+                crc32(u->buf, u->block, crc);
+            written += u->block;
+        }
+    }
+    return written;
+}
+
+bool rtp_undeltaDone(const rtp_undelta_t* undelta){
+    return undelta->head_length == 0 && undelta->literal == 0;
+}
@@ -0,0 +1,92 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RTP_DELTA_MIN_BLOCK 1024    // Smallest block of signatures
+#define RTP_DELTA_MAX_BLOCK 65536   // Largest block of signatures
+
+// A delta is a stream of ops, each a tag byte and little-endian fields:
+// RTP_DELTA_LITERAL, uint32 length, then length bytes of the new file;
+// RTP_DELTA_COPY, uint32 first, uint32 count: blocks [first, first + count) of the old file.
+#define RTP_DELTA_LITERAL 1
+#define RTP_DELTA_COPY    2
+
+// Signature of one block of the old file.
+typedef struct __attribute__ ((__packed__)) RTP_signature {
+    uint32_t weak;      // Rolling checksum, sums of bytes and of their running sums, 16 bits each
+    uint64_t strong;    // 64-bit hash, guards against accidental matches of weak, not crafted ones
+} rtp_signature_t;
+
+typedef struct RTP_delta rtp_delta_t;
+
+// Rebuilds a new file from a delta and the old file.
+typedef struct RTP_undelta{
+    int basis;             // Old file
+    uint32_t block;
+    uint32_t blocks;       // Full blocks of the old file, the only ones a delta copies
+    char* buf;             // One block read from the old file
+    uint8_t head[9];       // Op being collected
+    uint32_t head_length;
+    uint32_t literal;      // Literal bytes of the current op still to come
+} rtp_undelta_t;
+
+/**
+ * @brief Block size for an old file of size bytes: about its square root, so signatures and literals stay small
+*/
+uint32_t rtp_deltaBlock(uint64_t size);
+
+/**
+ * @brief Signature of one block
+*/
+void rtp_deltaSignature(const char* data, size_t length, rtp_signature_t* sig);
+
+/**
+ * @brief Start a delta of a new file against the signatures of the old one
+ * @param sigs Signatures of the full blocks of the old file, owned by the delta from now on
+ * @param data New file, must stay valid until the delta is freed
+ * @return The delta, free it with rtp_freeDelta
+*/
+rtp_delta_t* rtp_createDelta(rtp_signature_t* sigs, uint32_t blocks, uint32_t block, const char* data, size_t size);
+
+void rtp_freeDelta(rtp_delta_t* delta);
+
+/**
+ * @brief Take the next bytes of the delta, ops may be cut anywhere between two reads
+ * @return Bytes written to out, 0 at the end of the delta
+*/
+size_t rtp_deltaRead(rtp_delta_t* delta, char* out, size_t size);
+
+/**
+ * @brief Start rebuilding from the old file basis with blocks of block bytes
+ * @return -1 means failure, 0 means success
+*/
+int rtp_undeltaInit(rtp_undelta_t* undelta, int basis, uint32_t block);
+
+void rtp_undeltaFree(rtp_undelta_t* undelta);
+
+/**
+ * @brief Apply the next bytes of a delta, writing the new file to out
+ * @param crc CRC-32 continued over the bytes written, NULL for none
+ * @return Bytes of the new file written, -1 if the delta is malformed or writing failed
+*/
+ssize_t rtp_undeltaApply(rtp_undelta_t* undelta, const char* data, size_t length, FILE* out, uint32_t* crc);
+
+/**
+ * @brief Whether the delta applied so far ends between two ops
+*/
+bool rtp_undeltaDone(const rtp_undelta_t* undelta);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
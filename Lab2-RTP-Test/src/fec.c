@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+
+#define FEC_ADAPT_PKTS 512     // Pkts between two adaptations of the group
+
+void rtp_fecInit(rtp_fec_t* fec, uint32_t group, uint32_t payload_size, uint32_t window_size){
+    memset(fec, 0, sizeof(rtp_fec_t));
+    fec->max_group = window_size / 2 < RTP_FEC_MAX_GROUP ? window_size / 2 : RTP_FEC_MAX_GROUP;
+    if(fec->max_group < RTP_FEC_MIN_GROUP)
+        fec->max_group = RTP_FEC_MIN_GROUP;
+    fec->adaptive = group == 0;
+    fec->group = group ? group : RTP_FEC_GROUP;
+    if(fec->group < RTP_FEC_MIN_GROUP)
+        fec->group = RTP_FEC_MIN_GROUP;
+    if(fec->group > fec->max_group)
+        fec->group = fec->max_group;
+    fec->parity = calloc(payload_size, 1);
+}
+
+void rtp_fecFree(rtp_fec_t* fec){
+    free(fec->parity);
+    fec->parity = NULL;
+}
+
+void rtp_fecXor(char* dst, const char* src, size_t length){
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)){
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for(; i < length; i++)
+        dst[i] ^= src[i];
+}
+
+/**
+ * @brief Size the group of an adaptive encoder by the loss rate since the last adaptation.
+*/
+static void adapt(rtp_fec_t* fec){
+    fec->sent++;
+    if(!fec->adaptive || fec->sent < FEC_ADAPT_PKTS)
+        return;
+    // One parity pkt repairs one loss per group: aim at half a loss per group.
+    uint32_t group = fec->max_group;
+    if(fec->lost * 2 * fec->max_group > fec->sent)
+        group = fec->sent / (2 * fec->lost);
+    if(group < RTP_FEC_MIN_GROUP)
+        group = RTP_FEC_MIN_GROUP;
+    fec->group = group;
+    fec->sent = 0;
+    fec->lost = 0;
+}
+
+void rtp_fecAdd(rtp_fec_t* fec, uint32_t seq, const char* data, size_t length){
+    adapt(fec);
+    if(fec->count == 0)
+        fec->first = seq;
+    rtp_fecXor(fec->parity, data, length);
+    fec->length ^= length;
+    if(length > fec->size)
+        fec->size = length;
+    fec->count++;
+}
+
+bool rtp_fecFull(const rtp_fec_t* fec){
+    return fec->count >= fec->group;
+}
+
+size_t rtp_fecTake(rtp_fec_t* fec, char* payload, uint32_t* first){
+    if(fec->count == 0)
+        return 0;
+    rtp_parity_t header = {fec->count, fec->length};
+    memcpy(payload, &header, sizeof(header));
+    memcpy(payload + sizeof(header), fec->parity, fec->size);
+    memset(fec->parity, 0, fec->size);
+    size_t length = sizeof(header) + fec->size;
+    *first = fec->first;
+    fec->count = 0;
+    fec->length = 0;
+    fec->size = 0;
+    return length;
+}
+
+void rtp_fecLoss(rtp_fec_t* fec){
+    fec->lost++;
+}
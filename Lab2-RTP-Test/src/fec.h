@@ -0,0 +1,80 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RTP_FEC_MIN_GROUP 2     // Fewest DATA pkts covered by one parity pkt
+#define RTP_FEC_MAX_GROUP 64    // Most DATA pkts covered by one parity pkt
+#define RTP_FEC_GROUP 16        // Group of an adaptive encoder before the first loss estimate
+
+// Payload of an RTP_FEC pkt, followed by the parity bytes. Its seq_num is the first pkt of the group.
+typedef struct __attribute__ ((__packed__)) RTP_parity {
+    uint16_t count;     // Consecutive DATA pkts covered
+    uint16_t length;    // XOR of their payload lengths
+} rtp_parity_t;
+
+// Parity of groups of consecutive DATA pkts: the XOR of their payloads, zero padded to the longest.
+// Any one pkt of a group can be rebuilt from the parity and the others.
+typedef struct RTP_fec{
+    uint32_t group;        // Pkts per parity pkt
+    uint32_t max_group;    // Upper bound of group, so a group fits the receive window
+    bool adaptive;         // group follows the loss rate
+    uint32_t first;        // seq_num of the first pkt summed
+    uint32_t count;        // Pkts summed
+    uint16_t length;       // XOR of their payload lengths
+    uint32_t size;         // Longest payload summed
+    char* parity;
+    uint32_t sent;         // Pkts summed since group was last adapted
+    uint32_t lost;         // Losses seen meanwhile, repaired or not
+} rtp_fec_t;
+
+/**
+ * @brief Start an encoder
+ * @param group DATA pkts per parity pkt, 0 to adapt it to the loss rate
+ * @param payload_size Payload of full DATA pkts
+ * @param window_size Receive window, groups never exceed half of it
+*/
+void rtp_fecInit(rtp_fec_t* fec, uint32_t group, uint32_t payload_size, uint32_t window_size);
+
+void rtp_fecFree(rtp_fec_t* fec);
+
+/**
+ * @brief Add the payload of DATA pkt seq, sent for the first time, to the group
+ * Pkts must be added in seq_num order without gaps. An adaptive encoder adapts its group every so many pkts.
+*/
+void rtp_fecAdd(rtp_fec_t* fec, uint32_t seq, const char* data, size_t length);
+
+/**
+ * @brief Whether the group is complete and its parity pkt should be sent
+*/
+bool rtp_fecFull(const rtp_fec_t* fec);
+
+/**
+ * @brief Write the parity pkt payload of the pkts summed so far and start a new group
+ * @param payload Room for sizeof(rtp_parity_t) + payload_size bytes
+ * @param first Set to the first seq_num of the group
+ * @return Payload length, 0 if no pkt was summed
+*/
+size_t rtp_fecTake(rtp_fec_t* fec, char* payload, uint32_t* first);
+
+/**
+ * @brief Count a lost DATA pkt, whether the receiver repaired it or it has to be resent
+*/
+void rtp_fecLoss(rtp_fec_t* fec);
+
+/**
+ * @brief dst ^= src over length bytes
+*/
+void rtp_fecXor(char* dst, const char* src, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,153 @@
+#include <string.h>
+#include <stdbool.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4         // Shortest match, the length a token counts from
+#define LZ_LAST_LITERALS 5     // Bytes at the end always left as literals
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_SHIFT 5        // Every 32 misses in a row the search step grows by one byte
+
+static uint32_t read32(const uint8_t* p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v){
+    return (v * 2654435761u) >> (32 - RTP_LZ_HASH_BITS);
+}
+
+/**
+ * @brief Bytes of the length extension after a token nibble of 15.
+*/
+static size_t extension_size(size_t length){
+    return length < 15 ? 0 : (length - 15) / 255 + 1;
+}
+
+static uint8_t* write_extension(uint8_t* out, size_t length){
+    if(length < 15)
+        return out;
+    for(length -= 15; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+/**
+ * @brief Append one sequence: literals, then a match unless match is 0.
+ * @return End of output, NULL if it does not fit before end
+*/
+static uint8_t* write_sequence(uint8_t* out, const uint8_t* end, const uint8_t* literals, size_t literal_length, size_t offset, size_t match){
+    size_t size = 1 + extension_size(literal_length) + literal_length;
+    if(match)
+        size += 2 + extension_size(match - LZ_MIN_MATCH);
+    if(size > (size_t)(end - out))
+        return NULL;
+    size_t code = match ? match - LZ_MIN_MATCH : 0;
+    *out++ = (literal_length < 15 ? literal_length : 15) << 4 | (code < 15 ? code : 15);
+    out = write_extension(out, literal_length);
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if(!match)
+        return out;
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    return write_extension(out, code);
+}
+
+size_t rtp_lzCompress(rtp_lz_t* lz, const char* src, size_t length, char* dst, size_t capacity){
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    const uint8_t* out_end = out + capacity;
+    size_t anchor = 0;
+    size_t i = 0;
+    uint32_t misses = 0;
+    while(i + LZ_MIN_MATCH + LZ_LAST_LITERALS <= length){
+        uint32_t sequence = read32(in + i);
+        uint32_t h = hash32(sequence);
+        size_t ref = lz->table[h];
+        lz->table[h] = i;
+        if(ref >= i || i - ref > LZ_MAX_OFFSET || read32(in + ref) != sequence){
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+
+        // Grow the match both ways, the last literals stay out of it.
+        while(i > anchor && ref > 0 && in[i - 1] == in[ref - 1]){
+            i--;
+            ref--;
+        }
+        size_t match = LZ_MIN_MATCH;
+        while(i + match < length - LZ_LAST_LITERALS && in[i + match] == in[ref + match])
+            match++;
+        out = write_sequence(out, out_end, in + anchor, i - anchor, i - ref, match);
+        if(!out)
+            return 0;
+        i += match;
+        anchor = i;
+        if(i - 2 + LZ_MIN_MATCH <= length)
+            lz->table[hash32(read32(in + i - 2))] = i - 2;
+    }
+    out = write_sequence(out, out_end, in + anchor, length - anchor, 0, 0);
+    if(!out)
+        return 0;
+    return out - (uint8_t*)dst;
+}
+
+/**
+ * @brief Add the length extension after a token nibble of 15.
+ * @return false if src ends inside it
+*/
+static bool read_extension(const uint8_t** in, const uint8_t* end, size_t* length){
+    if(*length < 15)
+        return true;
+    uint8_t byte;
+    do{
+        if(*in == end)
+            return false;
+        byte = *(*in)++;
+        *length += byte;
+    }while(byte == 255);
+    return true;
+}
+
+ssize_t rtp_lzDecompress(const char* src, size_t length, char* dst, size_t capacity){
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* in_end = in + length;
+    uint8_t* out = (uint8_t*)dst;
+    const uint8_t* out_end = out + capacity;
+    while(in < in_end){
+        uint8_t token = *in++;
+        size_t literal_length = token >> 4;
+        if(!read_extension(&in, in_end, &literal_length)
+            || literal_length > (size_t)(in_end - in) || literal_length > (size_t)(out_end - out))
+            return -1;
+        memcpy(out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        // The last sequence has no match.
+        if(in == in_end)
+            break;
+
+        if(in_end - in < 2)
+            return -1;
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match = token & 15;
+        if(!read_extension(&in, in_end, &match))
+            return -1;
+        match += LZ_MIN_MATCH;
+        if(offset == 0 || offset > (size_t)(out - (uint8_t*)dst) || match > (size_t)(out_end - out))
+            return -1;
+        // A match may overlap the bytes it produces, repeating a short run.
+        const uint8_t* ref = out - offset;
+        if(offset >= match)
+            memcpy(out, ref, match);
+        else
+            for(size_t k = 0; k < match; k++)
+                out[k] = ref[k];
+        out += match;
+    }
+    return out - (uint8_t*)dst;
+}
@@ -0,0 +1,41 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RTP_LZ_HASH_BITS 12     // Match finder table of 4096 positions
+
+// Match finder of a compressor, kept between calls so it never has to be cleared.
+// Positions left by earlier inputs are only candidates, every match is checked against the input.
+typedef struct RTP_lz{
+    uint16_t table[1 << RTP_LZ_HASH_BITS];  // Last position of each hashed 4-byte sequence
+} rtp_lz_t;
+
+/**
+ * @brief Compress one buffer in the LZ4 block format: sequences of literals and a match at most 65535 bytes back.
+ * Data that barely compresses is skipped over ever faster, so incompressible input costs little.
+ * @param lz Match finder, zero it before the first call
+ * @param src Input of at most 65535 bytes
+ * @param capacity Room of dst, the compressed size has to stay below it to be worth sending
+ * @return Compressed length, 0 if it does not fit capacity
+*/
+size_t rtp_lzCompress(rtp_lz_t* lz, const char* src, size_t length, char* dst, size_t capacity);
+
+/**
+ * @brief Decompress what rtp_lzCompress produced, checking every length and offset against the buffers.
+ * @param capacity Room of dst
+ * @return Decompressed length, -1 if src is malformed or does not fit capacity
+*/
+ssize_t rtp_lzDecompress(const char* src, size_t length, char* dst, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdbool.h>
+#include "pace.h"
+
+#define PACE_QUANTUM 1000      // us of sending at rate the bucket holds, matching timer resolution
+#define PACE_BURST_PKTS 2      // The bucket holds at least this many full pkts
+#define PACE_PKT_BYTES 1472    // Full pkt size assumed for the bucket depth
+#define PACE_GAIN_SS 2.0       // Headroom in slow start, where cwnd doubles every RTT
+#define PACE_GAIN_CA 1.25      // Headroom in congestion avoidance
+
+static void refill(rtp_pacer_t* pacer, uint64_t now_us){
+    if(now_us > pacer->stamp){
+        pacer->tokens += (double)(now_us - pacer->stamp) * pacer->rate / 1e6;
+        if(pacer->tokens > pacer->burst)
+            pacer->tokens = pacer->burst;
+    }
+    pacer->stamp = now_us;
+}
+
+void rtp_pacerInit(rtp_pacer_t* pacer, uint64_t rate, uint64_t now_us){
+    pacer->rate = 0;
+    pacer->next_tx = now_us;
+    rtp_pacerSetRate(pacer, rate, now_us);
+}
+
+void rtp_pacerSetRate(rtp_pacer_t* pacer, uint64_t rate, uint64_t now_us){
+    // Pacing that starts now starts with a full bucket.
+    bool started = pacer->rate == 0;
+    if(!started)
+        refill(pacer, now_us);
+    pacer->rate = rate;
+    pacer->burst = rate * PACE_QUANTUM / 1000000;
+    if(pacer->burst < PACE_BURST_PKTS * PACE_PKT_BYTES)
+        pacer->burst = PACE_BURST_PKTS * PACE_PKT_BYTES;
+    if(started){
+        pacer->tokens = pacer->burst;
+        pacer->stamp = now_us;
+    }
+    if(pacer->tokens > pacer->burst)
+        pacer->tokens = pacer->burst;
+}
+
+uint64_t rtp_pacerRateOf(const rtp_cc_t* cc, uint32_t pkt_bytes, uint64_t srtt){
+    if(srtt == 0)
+        return 0;
+    double gain = cc->cwnd < cc->ssthresh ? PACE_GAIN_SS : PACE_GAIN_CA;
+    return (uint64_t)(gain * cc->cwnd * pkt_bytes * 1e6 / srtt);
+}
+
+uint64_t rtp_pacerDelay(rtp_pacer_t* pacer, uint64_t now_us){
+    if(pacer->rate == 0)
+        return 0;
+    refill(pacer, now_us);
+    if(pacer->tokens > 0)
+        return 0;
+    return (uint64_t)(-pacer->tokens * 1e6 / pacer->rate) + 1;
+}
+
+void rtp_pacerSpend(rtp_pacer_t* pacer, uint32_t bytes, uint64_t now_us){
+    if(pacer->rate == 0)
+        return;
+    refill(pacer, now_us);
+    pacer->tokens -= bytes;
+}
+
+uint64_t rtp_pacerDepart(rtp_pacer_t* pacer, uint32_t bytes, uint64_t now_us){
+    if(pacer->rate == 0)
+        return now_us;
+    if(pacer->next_tx < now_us)
+        pacer->next_tx = now_us;
+    uint64_t depart = (uint64_t)pacer->next_tx;
+    pacer->next_tx += (double)bytes * 1e6 / pacer->rate;
+    return depart;
+}
@@ -0,0 +1,61 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdint.h>
+#include "cc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Token bucket spreading pkts of a window over time instead of sending them back to back.
+// Tokens are bytes, refilled at rate and capped at burst.
+typedef struct RTP_pacer{
+    uint64_t rate;         // Bytes per second, 0 means not pacing
+    uint64_t burst;        // Bucket depth in bytes
+    double tokens;         // Bytes allowed to leave now, negative after overdrawn
+    uint64_t stamp;        // Time of the last refill in us
+    double next_tx;        // Departure time of the next pkt handed to the kernel in us
+} rtp_pacer_t;
+
+/**
+ * @brief Start a pacer with a full bucket
+ * @param rate Bytes per second, 0 to send without pacing
+*/
+void rtp_pacerInit(rtp_pacer_t* pacer, uint64_t rate, uint64_t now_us);
+
+/**
+ * @brief Change the rate, keeping the tokens already earned
+*/
+void rtp_pacerSetRate(rtp_pacer_t* pacer, uint64_t rate, uint64_t now_us);
+
+/**
+ * @brief Rate that spreads cwnd over one RTT, with headroom so pacing never caps growth
+ * @param pkt_bytes Bytes of one full pkt on the wire
+ * @param srtt Smoothed RTT in us
+ * @return Bytes per second, 0 before any RTT sample
+*/
+uint64_t rtp_pacerRateOf(const rtp_cc_t* cc, uint32_t pkt_bytes, uint64_t srtt);
+
+/**
+ * @brief Time until the next pkt may leave
+ * @return us to wait, 0 if a pkt may leave now
+*/
+uint64_t rtp_pacerDelay(rtp_pacer_t* pacer, uint64_t now_us);
+
+/**
+ * @brief Take bytes of a pkt leaving now out of the bucket, which may go below zero
+*/
+void rtp_pacerSpend(rtp_pacer_t* pacer, uint32_t bytes, uint64_t now_us);
+
+/**
+ * @brief Departure time of a pkt the kernel sends for us (SO_TXTIME), one after another at rate
+ * @return Departure time in us, now_us if not pacing or already late
+*/
+uint64_t rtp_pacerDepart(rtp_pacer_t* pacer, uint32_t bytes, uint64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,104 +3,573 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/filter.h>
 #include "rtp.h"
+#include "util.h"
 #include "receiver_def.h"
 
-int recvfd;
-struct sockaddr_in addr;
-rtp_receiver_t* receiver_control = NULL;
+#define PREALLOC_SIZE (8 << 20)  // Bytes preallocated at once for direct placement
+#define QUICKACK_PKTS 16         // Pkts acknowledged one by one at connection start
+#define SERVER_TICK 1000         // Timer resolution of the server in us
+#define SERVER_RCVBUF (8 << 20)  // Socket receive buffer shared by all sessions
+#define CHECKPOINT_MIN (1 << 20)   // Fewest in-order bytes between two checkpoints
+#define CHECKPOINT_MAX (64 << 20)  // Most in-order bytes between two checkpoints
+#define CHECKPOINT_MAGIC 0x43505452u  // "RTPC"
+#define CHECKPOINT_SUFFIX ".ckpt"  // Checkpoint of a file is kept next to it under this suffix
+#define REPLACE_SUFFIX ".rtptmp"   // New version of a file offered for deltas, renamed over it once complete
+
+// Where received data goes: in-order writes through a stream, direct
+// placement of every pkt at its file offset through a file descriptor,
+// or in-order delivery to the read buffer of rtp_read.
+typedef struct file_sink{
+    FILE* stream;          // Buffered sink, NULL for direct placement
+    int fd;                // Direct placement sink
+    off_t base;            // File offset of pkt seq_next
+    off_t allocated;       // End of preallocated space
+    uint32_t seq_max;      // Largest seq_num placed plus one
+    uint32_t short_count;  // Placed pkts in the window shorter than the full payload
+    off_t recv_byte;       // Bytes received, from the start of the file when resumed
+    off_t limit;           // File size known ahead, 0 if unknown
+    bool truncate;         // Cut the file at the end of data on close, false for all stripes but the last
+    bool memory;           // In-order data goes to the read buffer of rtp_read instead of a file
+    bool kept;             // Opened without truncating to resume, a stream is cut at the end of data on close
+} file_sink_t;
+
+// Progress of a resumable transfer, kept in <file>.ckpt while the file is received.
+typedef struct __attribute__ ((__packed__)) checkpoint{
+    uint32_t magic;        // CHECKPOINT_MAGIC
+    uint64_t file;         // Identity of the file, as given by its sender
+    uint64_t total;        // File size
+    uint64_t done;         // Bytes from the start of the file written and synced
+    uint32_t crc;          // CRC32 of the fields before
+} checkpoint_t;
+
+// Receiving from one sender, set up from an rtp_session_t or by the server for each peer.
+typedef struct recv_session{
+    int fd;                // Socket, shared by all sessions of a server
+    struct sockaddr_in addr;  // Sender's address
+    socklen_t addrlen;
+    rtp_receiver_t* control;
+    file_sink_t sink;
+    bool opt;              // false to ACK the next expected pkt, true to ACK every received pkt
+    uint32_t ack_every;    // ACK at least every ack_every in-order pkts
+    uint32_t ack_delay;    // Longest delay of a pending ACK in us
+    rtp_options_t options; // Options agreed with the sender
+    bool resume;           // Offer senders to resume from a checkpoint, and keep one
+    checkpoint_t saved;    // Checkpoint left by an interrupted transfer to the file, magic is 0 if none
+    int checkpoint_fd;     // Checkpoint being kept, open once RTP_OPT_RESUME is agreed
+    off_t checkpoint_next; // In-order bytes at which the next checkpoint is taken
+    bool finished;         // END received after all data, unlike a sender gone silent
+    bool corrupt;          // The digest END carried does not match the data written
+    bool delta;            // Offer the old version of the file for senders to send a delta against
+    char* replace;         // File received into and renamed over filename once finished, NULL to receive in place
+    rtp_undelta_t* undelta;  // Rebuilds the file from the old version once RTP_OPT_DELTA is agreed, NULL otherwise
+    // Server mode only
+    bool used;             // Slot holds a session
+    bool touched;          // ACKs were queued while handling the current batch
+    uint32_t conn;         // seq_num of START, tells a new connection from the same address
+    uint32_t hash_next;    // Next session in the same hash bucket, or free slot
+    uint64_t last_active;  // Monotonic time of the last pkt in us
+    bool opened;           // Sink opened, on the first DATA or END so options can choose the file; always for recv_message
+    char* filename;
+    const char* dir;       // Directory of received files
+} recv_session_t;
+
+// Servers sharing one port, each run by a thread pinned to its own core.
+struct RTP_shards{
+    uint32_t count;
+    rtp_server_t** servers;  // Shard i owns the i-th socket of the SO_REUSEPORT group
+    pthread_t* threads;
+    bool running;
+    bool steered;          // Steering program attached, otherwise the kernel hashes the 4-tuple
+};
+
+struct RTP_server{
+    int fd;                // Socket all sessions share
+    int epfd;
+    int stopfd;            // eventfd written by stopReceiverServer
+    char* dir;             // Directory of received files
+    uint32_t window_size;
+    uint32_t max_payload;  // Largest payload of its senders, room of every pkt buffer
+    uint32_t max_sessions;
+    uint64_t idle_us;      // Sessions silent this long are evicted
+    bool opt;              // How to acknowledge senders without SACK, as in recv_message
+    bool direct_write;     // Receiver settings when the server was created
+    bool resume;
+    uint32_t ack_every;
+    uint32_t ack_delay;
+    recv_session_t* sessions;  // Session table, indexed by slot
+    uint32_t* buckets;     // Hash of peer address to first slot, RTP_WHEEL_NONE if empty
+    uint32_t bucket_mask;
+    uint32_t free_slot;    // First free slot, linked through hash_next
+    uint32_t* touched;     // Slots with ACKs queued in the current batch
+    uint32_t touched_count;
+    rtp_wheel_t* timer;    // Pending ACK and idle timeout of every session, indexed by slot
+    rtp_batch_t* recv_batch;
+    struct sockaddr_in* from;  // Sender of each datagram in recv_batch
+    rtp_server_cb done;
+    void* arg;
+};
+
+static rtp_session_t* receiver_session = NULL;  // Session of initReceiver and recvMessage
+static bool direct_write = false;
+static uint32_t ack_every = RTP_ACK_EVERY;
+static uint32_t ack_delay = RTP_ACK_DELAY;
+static uint32_t max_payload = PAYLOAD_SIZE;
+static bool offload = true;
+static bool resume = false;
+static bool delta = false;
+
+void setReceiverDirectWrite(int enable){
+    direct_write = enable != 0;
+}
+
+void setReceiverAckPolicy(uint32_t every, uint32_t delay_us){
+    ack_every = every ? every : 1;
+    ack_delay = delay_us;
+}
+
+void setReceiverMaxPayload(uint32_t size){
+    max_payload = size;
+}
+
+void setReceiverOffload(int enable){
+    offload = enable != 0;
+}
+
+void setReceiverResume(int enable){
+    resume = enable != 0;
+}
+
+void setReceiverDelta(int enable){
+    delta = enable != 0;
+}
+
+/**
+ * @brief Largest payload to take from senders: size, no less than PAYLOAD_SIZE and no more than fits a datagram.
+*/
+static uint32_t payload_limit(uint32_t size){
+    if(size < PAYLOAD_SIZE)
+        return PAYLOAD_SIZE;
+    return size < RTP_MAX_PAYLOAD ? size : RTP_MAX_PAYLOAD;
+}
+
+/**
+ * @brief Allocate receiver control for a window.
+ * @param max_payload Payload room of pkt buffers, the largest payload senders may negotiate
+ * @param recv_batch Whether to post spare pkt buffers of its own, the server shares one batch instead
+ * @return A pointer to receiver control
+*/
+static rtp_receiver_t* create_control(uint32_t window_size, uint32_t max_payload, bool recv_batch){
+    rtp_receiver_t* control = malloc(sizeof(rtp_receiver_t));
+    control->window_size = window_size;
+    control->seq_next = 0;
+    control->seq_high = 0;
+    control->caps = 0;
+    control->payload_size = PAYLOAD_SIZE;
+    control->max_payload = max_payload;
+    control->ack_pending = 0;
+    control->ack_deadline = 0;
+    control->read_buf = NULL;
+    control->read_size = 0;
+    control->read_begin = 0;
+    control->read_end = 0;
+    control->read_eof = false;
+    control->fec_seen = false;
+    control->fec_spare = NULL;
+    control->lz_spare = NULL;
+    control->digest = 0;
+    control->digest_length = 0;
+    control->recv_buf = calloc(window_size, sizeof(char*));
+    control->recv_length = calloc(window_size, sizeof(size_t));
+    control->recv_crc = calloc(window_size, sizeof(uint32_t));
+    control->recv_map = calloc(rtp_bitmapWords(window_size), sizeof(uint64_t));
+
+    // Initialize batches of spare pkt buffers and of ACKs.
+    control->recv_batch = NULL;
+    if(recv_batch){
+        control->recv_batch = rtp_createBatch(RTP_BATCH_SIZE);
+        for(int i=0; i < RTP_BATCH_SIZE; ++i)
+            rtp_batchPush(control->recv_batch, malloc(RTP_PKT_ROOM(max_payload)), RTP_PKT_ROOM(max_payload));
+    }
+    control->ack_batch = rtp_createBatch(RTP_BATCH_SIZE);
+    control->ack_buf = malloc(RTP_BATCH_SIZE * RTP_ACK_SIZE);
+    return control;
+}
+
+/**
+ * @brief Answer START, with rtp_hello_t when extensions were announced.
+ * @return -1 means failure, 0 means success
+*/
+static int send_start_ack(recv_session_t* s, uint32_t seq){
+    if(!s->control->caps)
+        return rtp_sendctl(s->fd, RTP_ACK, seq, (struct sockaddr*)&s->addr, s->addrlen);
+    rtp_hello_t hello = {s->control->caps, s->control->max_payload};
+    return rtp_sendctlPayload(s->fd, RTP_ACK, seq, &hello, sizeof(hello), (struct sockaddr*)&s->addr, s->addrlen);
+}
+
+/**
+ * @brief Agree on extensions if the sender marked its START.
+ * @param caps Extensions this receiver supports
+*/
+static void accept_start(rtp_receiver_t* control, uint32_t seq, uint32_t caps){
+    if((seq & RTP_HELLO_MASK) == RTP_HELLO_MAGIC)
+        control->caps = caps;
+}
+
+/**
+ * @brief Name of the checkpoint kept next to a received file.
+ * @note Remember to free the returned name
+*/
+static char* checkpoint_name(const char* filename){
+    size_t size = strlen(filename) + sizeof(CHECKPOINT_SUFFIX);
+    char* name = malloc(size);
+    snprintf(name, size, "%s%s", filename, CHECKPOINT_SUFFIX);
+    return name;
+}
+
+/**
+ * @brief Take the checkpoint of s->filename into s->saved and remove it.
+ * A transfer that does not resume overwrites the file, its old checkpoint must not outlive that.
+*/
+static void load_checkpoint(recv_session_t* s){
+    memset(&s->saved, 0, sizeof(s->saved));
+    char* name = checkpoint_name(s->filename);
+    int fd = open(name, O_RDONLY);
+    if(fd != -1){
+        checkpoint_t saved;
+        if(read(fd, &saved, sizeof(saved)) == sizeof(saved) && saved.magic == CHECKPOINT_MAGIC
+            && saved.crc == compute_checksum(&saved, offsetof(checkpoint_t, crc)) && saved.done <= saved.total)
+            s->saved = saved;
+        close(fd);
+        unlink(name);
+    }
+    free(name);
+}
+
+/**
+ * @brief Record that the first done bytes of the file are on disk and schedule the next checkpoint.
+ * The checkpoint is rewritten in place, its CRC tells a torn write.
+ * @return -1 means failure, 0 means success
+*/
+static int write_checkpoint(recv_session_t* s, off_t done){
+    checkpoint_t checkpoint = {CHECKPOINT_MAGIC, s->options.file, s->options.total, done, 0};
+    checkpoint.crc = compute_checksum(&checkpoint, offsetof(checkpoint_t, crc));
+    if(pwrite(s->checkpoint_fd, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint)){
+        perror("[Receiver] Checkpoint failure");
+        return -1;
+    }
+    // Sync less often as the file grows, losing at most 1/16 of it.
+    off_t step = done / 16;
+    if(step < CHECKPOINT_MIN)
+        step = CHECKPOINT_MIN;
+    if(step > CHECKPOINT_MAX)
+        step = CHECKPOINT_MAX;
+    s->checkpoint_next = done + step;
+    return 0;
+}
+
+/**
+ * @brief Bytes from the start of the file written in order.
+*/
+static off_t sink_done(recv_session_t* s){
+    return s->sink.stream ? s->sink.recv_byte : s->sink.base;
+}
+
+/**
+ * @brief Bytes received as the int the API reports, INT_MAX from 2 GiB on.
+*/
+static int recv_result(off_t recv_byte){
+    return recv_byte > INT_MAX ? INT_MAX : (int)recv_byte;
+}
+
+/**
+ * @brief Sync the data written in order, then checkpoint how far it reaches.
+ * @return -1 means failure, 0 means success
+*/
+static int save_checkpoint(recv_session_t* s){
+    file_sink_t* sink = &s->sink;
+    if((sink->stream && fflush(sink->stream) != 0) || fdatasync(sink->stream ? fileno(sink->stream) : sink->fd) == -1){
+        perror("[Receiver] Sync failure");
+        return -1;
+    }
+    return write_checkpoint(s, sink_done(s));
+}
+
+/**
+ * @brief Go on writing the file after its first offset bytes.
+ * @return -1 means failure, 0 means success
+*/
+static int sink_resume(recv_session_t* s, off_t offset){
+    file_sink_t* sink = &s->sink;
+    sink->recv_byte = offset;
+    if(sink->stream)
+        return fseeko(sink->stream, offset, SEEK_SET);
+    sink->base = offset;
+    return 0;
+}
+
+/**
+ * @brief Agree to receive the file the sender identified resumably, from the checkpoint of an earlier transfer
+ * of the same file if its data is still there. Server sessions name the file after its identity, so a new
+ * connection finds it again. Without a checkpoint to keep, the transfer is not resumable.
+*/
+static void start_resume(recv_session_t* s, const rtp_options_t* request){
+    if(s->dir){
+        size_t size = strlen(s->dir) + 24;
+        char* filename = malloc(size);
+        snprintf(filename, size, "%s/%016llx", s->dir, (unsigned long long)request->file);
+        free(s->filename);
+        s->filename = filename;
+        load_checkpoint(s);
+    }
+    off_t resume = 0;
+    struct stat st;
+    if(s->saved.magic && s->saved.file == request->file && s->saved.total == request->total
+        && stat(s->filename, &st) == 0 && st.st_size >= (off_t)s->saved.done)
+        resume = s->saved.done;
+
+    char* name = checkpoint_name(s->filename);
+    s->checkpoint_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    free(name);
+    if(s->checkpoint_fd == -1){
+        perror("[Receiver] Checkpoint failure");
+        return;
+    }
+    s->options.flags |= RTP_OPT_RESUME;
+    s->options.file = request->file;
+    s->options.total = request->total;
+    s->options.resume = resume;
+    write_checkpoint(s, resume);
+    if(s->opened)
+        sink_resume(s, resume);
+}
+
+/**
+ * @brief Keep the checkpoint of an unfinished transfer up to date, remove it once the file is complete.
+*/
+static void finish_checkpoint(recv_session_t* s){
+    if(!(s->options.flags & RTP_OPT_RESUME))
+        return;
+    if(!s->finished && s->opened)
+        save_checkpoint(s);
+    close(s->checkpoint_fd);
+    if(s->finished){
+        char* name = checkpoint_name(s->filename);
+        unlink(name);
+        free(name);
+    }
+}
+
+/**
+ * @brief Agree to receive a delta against the old version of the file, which then has to hold a full block.
+ * The delta is applied in order, so a sink opened for direct placement turns into a stream.
+*/
+static void start_delta(recv_session_t* s){
+    int basis = open(s->filename, O_RDONLY);
+    if(basis == -1)
+        return;
+    struct stat st;
+    uint32_t block = fstat(basis, &st) == 0 ? rtp_deltaBlock(st.st_size) : 0;
+    if(!block || st.st_size < block || (!s->sink.stream && !(s->sink.stream = fdopen(s->sink.fd, "wb")))){
+        close(basis);
+        return;
+    }
+    s->undelta = malloc(sizeof(rtp_undelta_t));
+    if(rtp_undeltaInit(s->undelta, basis, block) == -1){
+        free(s->undelta);
+        s->undelta = NULL;
+        close(basis);
+        return;
+    }
+    s->options.flags |= RTP_OPT_DELTA;
+    s->options.basis = st.st_size;
+    s->options.block = block;
+}
+
+/**
+ * @brief Answer an RTP_SIG request with the signatures of the blocks asked for, as many per pkt as fit a payload.
+ * @return -1 means failure, 0 means success
+*/
+static int send_signatures(recv_session_t* s, rtp_packet_t* pkt){
+    rtp_undelta_t* undelta = s->undelta;
+    rtp_sig_request_t request;
+    if(!undelta || pkt->rtp.length < sizeof(request) || pkt->rtp.seq_num >= undelta->blocks)
+        return 0;
+    memcpy(&request, pkt->payload, sizeof(request));
+    uint32_t first = pkt->rtp.seq_num;
+    uint32_t end = request.count < undelta->blocks - first ? first + request.count : undelta->blocks;
+    uint32_t per = s->control->payload_size / sizeof(rtp_signature_t);
+    rtp_packet_t* answer = malloc(sizeof(rtp_header_t) + per * sizeof(rtp_signature_t));
+    int state = 0;
+    for(uint32_t block = first; block < end && state == 0; block += per){
+        uint32_t count = end - block < per ? end - block : per;
+        for(uint32_t i = 0; i < count; i++){
+            rtp_signature_t sig;
+            if(pread(undelta->basis, undelta->buf, undelta->block, (off_t)(block + i) * undelta->block) != (ssize_t)undelta->block){
+                perror("[Receiver] Read failure");
+                state = -1;
+                break;
+            }
+            rtp_deltaSignature(undelta->buf, undelta->block, &sig);
+            memcpy(answer->payload + i * sizeof(sig), &sig, sizeof(sig));
+        }
+        uint16_t length = count * sizeof(rtp_signature_t);
+        rtp_frame(answer, RTP_SIG, length, block);
+        if(state == 0 && sendto(s->fd, answer, sizeof(rtp_header_t) + length, 0, (struct sockaddr*)&s->addr, s->addrlen) == -1)
+            state = -1;
+    }
+    free(answer);
+    return state;
+}
+
+/**
+ * @brief Put the new version of a file in place of the old one once it is complete, otherwise leave the old one alone.
+ * @param state State the transfer ended in, 1 if it ended
+ * @return state, -1 if the file could not be put in place
+*/
+static int finish_replace(recv_session_t* s, int state){
+    if(s->corrupt)
+        state = -1;
+    if(s->undelta){
+        if(state == 1 && !rtp_undeltaDone(s->undelta))
+            state = -1;
+        close(s->undelta->basis);
+        rtp_undeltaFree(s->undelta);
+        free(s->undelta);
+    }
+    if(!s->replace)
+        return state;
+    if(state != 1 || !s->finished)
+        state = -1;
+    else if(rename(s->replace, s->filename) == -1){
+        perror("[Receiver] Rename failure");
+        state = -1;
+    }
+    if(state == -1)
+        unlink(s->replace);
+    free(s->replace);
+    return state;
+}
+
+/**
+ * @brief Answer a START carrying rtp_options_t with the options agreed.
+ * Options only change before any data arrived, a resent request gets the same answer.
+ * Options the request leaves out keep their values, a request padded beyond rtp_options_t is a path MTU probe.
+ * @return -1 means failure, 0 means success
+*/
+static int accept_options(recv_session_t* s, rtp_packet_t* pkt){
+    rtp_receiver_t* control = s->control;
+    if(!(control->caps & RTP_CAP_OPTIONS))
+        return 0;
+    if(control->seq_high == 0){
+        rtp_options_t request;
+        memset(&request, 0, sizeof(request));
+        memcpy(&request, pkt->payload, pkt->rtp.length < sizeof(request) ? pkt->rtp.length : sizeof(request));
+        if((request.flags & RTP_OPT_STRIPE) && (control->caps & RTP_CAP_STRIPE)
+            && request.stripe < request.stripes && request.offset <= request.total){
+            s->options.flags |= RTP_OPT_STRIPE;
+            s->options.transfer = request.transfer;
+            s->options.offset = request.offset;
+            s->options.total = request.total;
+            s->options.stripe = request.stripe;
+            s->options.stripes = request.stripes;
+        }
+        if((request.flags & RTP_OPT_PAYLOAD) && request.payload){
+            control->payload_size = request.payload < control->max_payload ? request.payload : control->max_payload;
+            s->options.flags |= RTP_OPT_PAYLOAD;
+            s->options.payload = control->payload_size;
+        }
+        // Stripes of one file are not resumed.
+        if((request.flags & RTP_OPT_RESUME) && request.file && s->resume && !s->sink.memory
+            && !(s->options.flags & (RTP_OPT_STRIPE | RTP_OPT_RESUME)))
+            start_resume(s, &request);
+        if((request.flags & RTP_OPT_DELTA) && s->delta && !s->undelta
+            && !(s->options.flags & (RTP_OPT_STRIPE | RTP_OPT_RESUME)))
+            start_delta(s);
+    }
+    return rtp_sendctlPayload(s->fd, RTP_ACK, pkt->rtp.seq_num, &s->options, sizeof(s->options), (struct sockaddr*)&s->addr, s->addrlen);
+}
+
+int rtp_sessionAccept(rtp_session_t* session, uint16_t port){
+    if(session->fd != -1)
+        return -1;
 
-int initReceiver(uint16_t port, uint32_t window_size){
     // Create a socket.
-    recvfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if(recvfd == -1){
+    session->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(session->fd == -1){
         perror("[Receiver] Socket failure");
         return -1;
     }
 
-    // Initialize server control.
-    receiver_control = malloc(sizeof(rtp_receiver_t));
-    receiver_control->window_size = window_size;
-    receiver_control->seq_next = 0;
-    receiver_control->recv_buf = malloc(window_size * sizeof(char*));
-    receiver_control->recv_length = malloc(window_size * sizeof(size_t));
-    receiver_control->recv_ack = malloc(window_size * sizeof(size_t));
-    for(int i=0; i < window_size; ++i){
-        receiver_control->recv_length[i] = 0;
-        receiver_control->recv_ack[i] = 0;
-        receiver_control->recv_buf[i] = malloc(PAYLOAD_SIZE);
-        memset(receiver_control->recv_buf[i], 0, PAYLOAD_SIZE);
-    } 
-
     // Initialize sockaddr.
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
+    struct sockaddr_in local;
+    bzero(&local, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(port);
 
-    if(bind(recvfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
-        rtp_freeReceiverControl(receiver_control);
+    if(bind(session->fd, (struct sockaddr *)&local, sizeof(local)) == -1){
         perror("[Receiver] Bind failure");
         return -1;
     }
 
+    // Room for a window of large pkts.
+    uint32_t max = payload_limit(session->payload_size);
+    if(max > PAYLOAD_SIZE){
+        int rcvbuf = session->window_size * (sizeof(rtp_header_t) + max);
+        setsockopt(session->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
     // Wait for START
     fd_set wait_fd;
     FD_ZERO(&wait_fd);
-    FD_SET(recvfd, &wait_fd);
+    FD_SET(session->fd, &wait_fd);
     struct timeval timeout = {10, 0}; // 10s
-    int res = select(recvfd + 1, &wait_fd, NULL, NULL, &timeout);
-    if(res == -1){
-        rtp_freeReceiverControl(receiver_control);
+    int res = select(session->fd + 1, &wait_fd, NULL, NULL, &timeout);
+    if(res == -1)
         return -1;
-    }
     else if(res == 0){
         // Timeout
-        rtp_freeReceiverControl(receiver_control);
-        close(recvfd);
         return -1;
     }
-    else if(FD_ISSET(recvfd, &wait_fd)){
+    else if(FD_ISSET(session->fd, &wait_fd)){
         // Receive START and check its checksum.
-        socklen_t addrlen = sizeof(addr);
-        rtp_packet_t* recv_ack = rtp_recvfrom(recvfd, (struct sockaddr*)&addr, &addrlen);
-        if(!recv_ack){
-            rtp_freeReceiverControl(receiver_control);
-            close(recvfd);
+        socklen_t addrlen = sizeof(session->addr);
+        rtp_packet_t recv_ack;
+        if(rtp_recv(session->fd, &recv_ack, sizeof(recv_ack), (struct sockaddr*)&session->addr, &addrlen) == -1)
             return -1;
-        }
-        else if(recv_ack->rtp.type == RTP_START){
-            // Send ACK.
-            rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, recv_ack->rtp.seq_num, NULL);
-            ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-            if(send_length != sizeof(rtp_header_t)){
-                free(pkt);
-                free(recv_ack);
-                rtp_freeReceiverControl(receiver_control);
+        else if(recv_ack.rtp.type == RTP_START){
+            // Send ACK, announcing extensions to a sender that marked its START.
+            session->receiver = create_control(session->window_size, max, true);
+            if(session->offload)
+                rtp_enableGRO(session->fd, session->receiver->recv_batch);
+            accept_start(session->receiver, recv_ack.rtp.seq_num, RTP_CAPS & ~RTP_CAP_STRIPE);
+            recv_session_t start = {.fd = session->fd, .addr = session->addr, .addrlen = addrlen, .control = session->receiver};
+            if(send_start_ack(&start, recv_ack.rtp.seq_num) == -1){
                 perror("[Receiver] Start ACK send failure");
                 return -1;
             }
-            free(recv_ack);
-            free(pkt);
             return 0;
         }
-        else if(recv_ack->rtp.type == RTP_END){
+        else if(recv_ack.rtp.type == RTP_END){
             // Send ACK.
-            // rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, receiver_control->seq_next, NULL);
-            rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, recv_ack->rtp.seq_num, NULL);
-            ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-            if(send_length != sizeof(rtp_header_t))
+            if(rtp_sendctl(session->fd, RTP_ACK, recv_ack.rtp.seq_num, (struct sockaddr*)&session->addr, addrlen) == -1)
                 perror("[Receiver] End ACK send failure");
-            free(pkt);
-            free(recv_ack);
-            rtp_freeReceiverControl(receiver_control);
             return -1;
         }
         else{
-            free(recv_ack);
-            rtp_freeReceiverControl(receiver_control);
             perror("[Receiver] Type failure");
             return -1;
         }
@@ -108,312 +577,1116 @@ int initReceiver(uint16_t port, uint32_t window_size){
     return -1;
 }
 
-int recvMessage(char* filename){
-    // Open file whose name is filename.
-    FILE* recv_file = fopen(filename, "wb");
-    if(!recv_file){
-        perror("[Receiver] Open file failure");
+int initReceiver(uint16_t port, uint32_t window_size){
+    receiver_session = rtp_createSession(window_size);
+    receiver_session->payload_size = max_payload;
+    receiver_session->offload = offload;
+    if(rtp_sessionAccept(receiver_session, port) == -1){
+        rtp_sessionClose(receiver_session);
+        receiver_session = NULL;
         return -1;
     }
+    return 0;
+}
 
-    int recv_byte = 0;
+/**
+ * @brief Send every ACK queued in ack_batch with one syscall.
+ * @return -1 means failure, 0 means success
+*/
+static int flush_acks(recv_session_t* s){
+    if(rtp_sendBatch(s->fd, s->control->ack_batch, (struct sockaddr*)&s->addr, s->addrlen) == -1){
+        perror("[Receiver] Send failure");
+        return -1;
+    }
+    return 0;
+}
 
-    // Wait for data.
-    fd_set wait_fd;
-    while(true){
-        FD_ZERO(&wait_fd);
-        FD_SET(recvfd, &wait_fd);
-        struct timeval timeout = {10, 0}; // 10s
-        int res = select(recvfd + 1, &wait_fd, NULL, NULL, &timeout);
-        if(res == -1){
-            fclose(recv_file);
-            return -1;
+/**
+ * @brief Queue an ACK pkt with sequence number seq for the sender.
+ * @return -1 means failure, 0 means success
+*/
+static int send_ack(recv_session_t* s, uint32_t seq){
+    rtp_batch_t* batch = s->control->ack_batch;
+    if(batch->count == batch->capacity && flush_acks(s) == -1)
+        return -1;
+    rtp_packet_t* ack = (rtp_packet_t*)(s->control->ack_buf + batch->count * RTP_ACK_SIZE);
+    rtp_frame(ack, RTP_ACK, 0, seq);
+    rtp_batchPush(batch, ack, sizeof(rtp_header_t));
+    return 0;
+}
+
+/**
+ * @brief Queue a SACK: seq_next as cumulative ACK and a bitmap of pkts received beyond it.
+ * Bit i stands for seq_next + 1 + i, trailing zero bytes are left out.
+ * @return -1 means failure, 0 means success
+*/
+static int send_sack(recv_session_t* s){
+    rtp_receiver_t* control = s->control;
+    rtp_batch_t* batch = control->ack_batch;
+    if(batch->count == batch->capacity && flush_acks(s) == -1)
+        return -1;
+    rtp_packet_t* ack = (rtp_packet_t*)(control->ack_buf + batch->count * RTP_ACK_SIZE);
+    uint8_t* bitmap = (uint8_t*)ack->payload;
+    uint32_t seq_next = control->seq_next;
+    uint32_t bits = 0;
+    if(control->seq_high > seq_next + 1)
+        bits = control->seq_high - seq_next - 1;
+    if(bits > RTP_SACK_BYTES * 8)
+        bits = RTP_SACK_BYTES * 8;
+    uint16_t length = (bits + 7) / 8;
+    memset(bitmap, 0, length);
+    for(uint32_t i = 0; i < bits; i++)
+        if(rtp_testBit(control->recv_map, rtp_slot(seq_next + 1 + i, control->window_size)))
+            bitmap[i >> 3] |= 1 << (i & 7);
+    while(length > 0 && bitmap[length - 1] == 0)
+        length--;
+    rtp_frame(ack, RTP_ACK, length, seq_next);
+    rtp_batchPush(batch, ack, sizeof(rtp_header_t) + length);
+    return 0;
+}
+
+/**
+ * @brief Open file to write received data.
+ * @param keep Keep what the file holds for a transfer to resume, it is cut at the end of data on close instead
+ * @return -1 means failure, 0 means success
+*/
+static int sink_open(file_sink_t* sink, const char* filename, bool direct, bool keep){
+    memset(sink, 0, sizeof(file_sink_t));
+    sink->truncate = true;
+    sink->kept = keep;
+    sink->fd = open(filename, O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC), 0666);
+    if(sink->fd == -1 || direct)
+        return sink->fd == -1 ? -1 : 0;
+    sink->stream = fdopen(sink->fd, "wb");
+    if(!sink->stream){
+        close(sink->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open the file shared by all stripes of a transfer to place one stripe.
+ * @return -1 means failure, 0 means success
+*/
+static int sink_open_stripe(file_sink_t* sink, const char* filename, const rtp_options_t* options){
+    memset(sink, 0, sizeof(file_sink_t));
+    sink->base = options->offset;
+    sink->limit = options->total;
+    sink->truncate = options->stripe + 1 == options->stripes;
+    sink->fd = open(filename, O_WRONLY | O_CREAT, 0666);
+    return sink->fd == -1 ? -1 : 0;
+}
+
+/**
+ * @brief File offset of pkt seq inside the window.
+ * Pkts not received yet are taken as full.
+*/
+static off_t sink_offset(recv_session_t* s, uint32_t seq){
+    rtp_receiver_t* control = s->control;
+    off_t offset = s->sink.base + (off_t)(seq - control->seq_next) * control->payload_size;
+    for(uint32_t i = control->seq_next; s->sink.short_count && i < seq; i++){
+        uint32_t slot = rtp_slot(i, control->window_size);
+        if(rtp_testBit(control->recv_map, slot))
+            offset -= control->payload_size - control->recv_length[slot];
+    }
+    return offset;
+}
+
+static void sink_close(recv_session_t* s){
+    file_sink_t* sink = &s->sink;
+    if(sink->stream){
+        if(sink->kept && (fflush(sink->stream) != 0 || ftruncate(fileno(sink->stream), ftello(sink->stream)) == -1))
+            perror("[Receiver] Truncate failure");
+        fclose(sink->stream);
+        return;
+    }
+    if(!sink->truncate){
+        close(sink->fd);
+        return;
+    }
+    // Cut off space preallocated or left behind by moved pkts.
+    off_t end = sink->base;
+    if(sink->seq_max > s->control->seq_next){
+        uint32_t last = sink->seq_max - 1;
+        end = sink_offset(s, last) + s->control->recv_length[rtp_slot(last, s->control->window_size)];
+    }
+    if(ftruncate(sink->fd, end) == -1)
+        perror("[Receiver] Truncate failure");
+    close(sink->fd);
+}
+
+/**
+ * @brief Write pkt seq straight to its offset in the file.
+ * Offsets assume full pkts ahead of seq. A short pkt in the middle pulls the placed pkts behind it forward,
+ * which only happens at the few places the sender could not fill a pkt.
+ * @return -1 means failure, 0 means success
+*/
+static int sink_place(recv_session_t* s, uint32_t seq, rtp_packet_t* pkt){
+    rtp_receiver_t* control = s->control;
+    file_sink_t* sink = &s->sink;
+    size_t length = pkt->rtp.length;
+    size_t payload = control->payload_size;
+    off_t offset = sink_offset(s, seq);
+    if(offset + payload > sink->allocated){
+        // Reserve space ahead in large extents to keep the file contiguous.
+        off_t size = PREALLOC_SIZE;
+        if(size < (off_t)control->window_size * payload)
+            size = (off_t)control->window_size * payload;
+        if(sink->limit && size > sink->limit - offset)
+            size = sink->limit > offset ? sink->limit - offset : payload;
+        if(fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+            sink->allocated = offset + size;
+    }
+
+    if(pwrite(sink->fd, pkt->payload, length, offset) != (ssize_t)length){
+        perror("[Receiver] Write failure");
+        return -1;
+    }
+
+    if(length < payload){
+        // Move placed pkts behind seq to close the gap.
+        char* buf = malloc(payload);
+        off_t from = offset + payload;
+        off_t to = offset + length;
+        for(uint32_t i = seq + 1; i < sink->seq_max; i++){
+            uint32_t slot = rtp_slot(i, control->window_size);
+            size_t size = payload;
+            if(rtp_testBit(control->recv_map, slot)){
+                size = control->recv_length[slot];
+                if(pread(sink->fd, buf, size, from) != (ssize_t)size || pwrite(sink->fd, buf, size, to) != (ssize_t)size){
+                    perror("[Receiver] Move failure");
+                    free(buf);
+                    return -1;
+                }
+            }
+            from += size;
+            to += size;
         }
-        else if(res == 0){
-            fclose(recv_file);
-            return recv_byte;
+        free(buf);
+        sink->short_count++;
+    }
+    if(seq + 1 > sink->seq_max)
+        sink->seq_max = seq + 1;
+    sink->recv_byte += length;
+    return 0;
+}
+
+/**
+ * @brief Append in-order data to the read buffer, reusing the room of bytes already read.
+*/
+static void sink_deliver(rtp_receiver_t* control, const char* data, size_t length){
+    if(control->read_end + length > control->read_size){
+        memmove(control->read_buf, control->read_buf + control->read_begin, control->read_end - control->read_begin);
+        control->read_end -= control->read_begin;
+        control->read_begin = 0;
+    }
+    if(control->read_end + length > control->read_size){
+        size_t size = control->read_size ? control->read_size * 2 : (size_t)control->window_size * control->payload_size;
+        while(size < control->read_end + length)
+            size *= 2;
+        control->read_buf = realloc(control->read_buf, size);
+        control->read_size = size;
+    }
+    memcpy(control->read_buf + control->read_end, data, length);
+    control->read_end += length;
+}
+
+/**
+ * @brief Queue the cumulative ACK, with the bitmap if SACK was agreed, and clear pending state.
+ * @return -1 means failure, 0 means success
+*/
+static int send_pending(recv_session_t* s){
+    s->control->ack_pending = 0;
+    s->control->ack_deadline = 0;
+    if(s->control->caps & RTP_CAP_SACK)
+        return send_sack(s);
+    return send_ack(s, s->control->seq_next);
+}
+
+/**
+ * @brief Acknowledge data pkt seq, coalescing ACKs of in-order pkts.
+ * ACK at once when seq is out of order, fills a gap or leaves one behind, and for the first pkts,
+ * so the sender sees losses and ramps up as fast as without coalescing.
+ * @param seq Pkt just handled
+ * @param seq_next seq_next before handling seq
+ * @return -1 means failure, 0 means success
+*/
+static int ack_pkt(recv_session_t* s, uint32_t seq, uint32_t seq_next){
+    rtp_receiver_t* control = s->control;
+    // Without SACK the optimized sender needs one ACK per pkt.
+    if(s->opt && !(control->caps & RTP_CAP_SACK))
+        return send_ack(s, seq);
+
+    bool in_order = seq == seq_next && control->seq_next == seq_next + 1
+        && control->seq_high == control->seq_next;
+    control->ack_pending++;
+    if(!in_order || control->seq_next <= QUICKACK_PKTS || control->ack_pending >= s->ack_every)
+        return send_pending(s);
+    if(!control->ack_deadline)
+        control->ack_deadline = mono_us() + s->ack_delay;
+    return 0;
+}
+
+/**
+ * @brief Take DATA pkt, no longer than the payload agreed, into the window and write out the in-order prefix.
+ * @param buf Buffer holding pkt, swapped for a spare one when pkt is cached
+ * @return -1 means failure, 0 means success
+*/
+static int accept_data(recv_session_t* s, rtp_packet_t* recv_pkt, void** buf){
+    rtp_receiver_t* control = s->control;
+    uint32_t seq = recv_pkt->rtp.seq_num;
+    uint32_t slot = rtp_slot(seq, control->window_size);
+    if(seq >= control->seq_next && !rtp_testBit(control->recv_map, slot)){
+        bool direct = !s->sink.stream && !s->sink.memory;
+        // Place data at once, only remember that it arrived.
+        if(direct && sink_place(s, seq, recv_pkt) == -1)
+            return -1;
+        if(!direct || control->fec_seen){
+            // Cache data by swapping the spare buffer into its slot.
+            char* spare = control->recv_buf[slot];
+            if(!spare)
+                spare = malloc(RTP_PKT_ROOM(control->max_payload));
+            *buf = spare;
+            control->recv_buf[slot] = (char*)recv_pkt;
         }
-        else if(FD_ISSET(recvfd, &wait_fd)){
-            // Receive data pkt.
-            socklen_t addrlen = sizeof(addr);
-            rtp_packet_t* recv_pkt = rtp_recvfrom(recvfd, (struct sockaddr*)&addr, &addrlen);
-            if(!recv_pkt)
-                continue;
-            else{
-                if(recv_pkt->rtp.type == RTP_START || recv_pkt->rtp.type == RTP_END){
-                    rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, recv_pkt->rtp.seq_num, NULL);
-                    ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                    if(send_length != sizeof(rtp_header_t)){
-                        free(pkt);
-                        free(recv_pkt);
-                        perror("[Receiver] Send failure");
-                        return -1;
-                    }
-                    free(pkt);
-
-                    if(recv_pkt->rtp.type == RTP_END && recv_pkt->rtp.seq_num == receiver_control->seq_next){
-                        fclose(recv_file);
-                        free(recv_pkt);
-                        return recv_byte;
-                    }
-                    else
-                        free(recv_pkt);
+        control->recv_length[slot] = recv_pkt->rtp.length;
+        control->recv_crc[slot] = recv_pkt->rtp.checksum;
+        rtp_setBit(control->recv_map, slot);
+        if(seq + 1 > control->seq_high)
+            control->seq_high = seq + 1;
+
+        // Write in-order prefix to file and update seq_next.
+        while(true){
+            slot = rtp_slot(control->seq_next, control->window_size);
+            if(!rtp_testBit(control->recv_map, slot))
+                break;
+            if(!s->undelta){
+                control->digest = crc32_combine(control->digest, control->recv_crc[slot], control->recv_length[slot]);
+                control->digest_length += control->recv_length[slot];
+            }
+            if(s->sink.memory){
+                rtp_packet_t* pkt = (rtp_packet_t*)control->recv_buf[slot];
+                sink_deliver(control, pkt->payload, control->recv_length[slot]);
+                s->sink.recv_byte += control->recv_length[slot];
+            }
+            else if(s->undelta){
+                rtp_packet_t* pkt = (rtp_packet_t*)control->recv_buf[slot];
+                ssize_t write_byte = rtp_undeltaApply(s->undelta, pkt->payload, control->recv_length[slot], s->sink.stream, &control->digest);
+                if(write_byte == -1){
+                    perror("[Receiver] Delta failure");
+                    return -1;
                 }
-                else if(recv_pkt->rtp.type == RTP_DATA){
-                    if(recv_pkt->rtp.seq_num > receiver_control->seq_next){
-                        if(recv_pkt->rtp.seq_num >= receiver_control->seq_next + receiver_control->window_size){
-                            free(recv_pkt);
-                            continue;
-                        }
-
-                        // Cache data.
-                        if(recv_pkt->rtp.length == 0)
-                            continue;
-                        int ack_num = recv_pkt->rtp.seq_num - receiver_control->seq_next;
-                        receiver_control->recv_ack[ack_num] = 1;
-                        receiver_control->recv_length[ack_num] = recv_pkt->rtp.length;
-                        memcpy(receiver_control->recv_buf[ack_num], recv_pkt->payload, recv_pkt->rtp.length);
-
-                        // Send ACK.
-                        rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, receiver_control->seq_next, NULL);
-                        ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                        if(send_length != sizeof(rtp_header_t)){
-                            free(pkt);
-                            free(recv_pkt);
-                            perror("[Receiver] Send failure");
-                            return -1;
-                        }
-                        free(recv_pkt);
-                        free(pkt);
-                    }
-                    else if(recv_pkt->rtp.seq_num == receiver_control->seq_next){
-                        // Cache data.
-                        if(recv_pkt->rtp.length == 0)
-                            continue;
-                        int ack_num = 0;
-                        receiver_control->recv_ack[ack_num] = 1;
-                        receiver_control->recv_length[ack_num] = recv_pkt->rtp.length;
-                        memcpy(receiver_control->recv_buf[ack_num], recv_pkt->payload, recv_pkt->rtp.length);
-
-                        // Update seq_next.
-                        int slide_step = 0;
-                        for(slide_step = 0; slide_step < receiver_control->window_size; slide_step++){
-                            if(receiver_control->recv_ack[slide_step] == 0)
-                                break;
-                        }
-                        receiver_control->seq_next += slide_step;
-                        
-                        // Write to file.
-                        for(int i = 0; i < slide_step; i++){
-                            size_t write_byte = fwrite(receiver_control->recv_buf[i], 1, receiver_control->recv_length[i], recv_file);
-                            if(write_byte != receiver_control->recv_length[i]){
-                                free(recv_pkt);
-                                perror("[Receiver] Write failure");
-                                return -1;
-                            }
-                            recv_byte += write_byte;
-                        }
-                        
-                        // Update sliding window.
-                        for(int i = slide_step; i < receiver_control->window_size; i++){
-                            memset(receiver_control->recv_buf[i - slide_step], 0, PAYLOAD_SIZE);
-                            memcpy(receiver_control->recv_buf[i - slide_step], receiver_control->recv_buf[i], receiver_control->recv_length[i]);
-                            receiver_control->recv_length[i - slide_step] = receiver_control->recv_length[i];
-                            receiver_control->recv_ack[i - slide_step] = receiver_control->recv_ack[i];
-                        }
-                        for(int i = 0; i < slide_step; i++){
-                            int j = receiver_control->window_size - 1 - i;
-                            memset(receiver_control->recv_buf[j], 0, PAYLOAD_SIZE);
-                            receiver_control->recv_length[j] = 0;
-                            receiver_control->recv_ack[j] = 0;
-                        }
-
-                        // Send ACK.
-                        rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, receiver_control->seq_next, NULL);
-                        ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                        if(send_length != sizeof(rtp_header_t)){
-                            free(pkt);
-                            free(recv_pkt);
-                            perror("[Receiver] Send failure");
-                            return -1;
-                        }
-                        free(recv_pkt);
-                        free(pkt);
-                    }
-                    else{
-                        // Send ACK.
-                        rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, receiver_control->seq_next, NULL);
-                        ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                        if(send_length != sizeof(rtp_header_t)){
-                            free(pkt);
-                            free(recv_pkt);
-                            perror("[Receiver] Send failure");
-                            return -1;
-                        }
-                        free(recv_pkt);
-                        free(pkt);
-                    }
+                s->sink.recv_byte += write_byte;
+                control->digest_length += write_byte;
+            }
+            else if(s->sink.stream){
+                rtp_packet_t* pkt = (rtp_packet_t*)control->recv_buf[slot];
+                size_t write_byte = fwrite(pkt->payload, 1, control->recv_length[slot], s->sink.stream);
+                if(write_byte != control->recv_length[slot]){
+                    perror("[Receiver] Write failure");
+                    return -1;
                 }
+                s->sink.recv_byte += write_byte;
+            }
+            else{
+                s->sink.base += control->recv_length[slot];
+                if(control->recv_length[slot] < control->payload_size)
+                    s->sink.short_count--;
             }
+            control->recv_length[slot] = 0;
+            rtp_clearBit(control->recv_map, slot);
+            control->seq_next++;
         }
+        if((s->options.flags & RTP_OPT_RESUME) && sink_done(s) >= s->checkpoint_next && save_checkpoint(s) == -1)
+            return -1;
     }
-    return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Rebuild the only pkt of a parity group that is missing, as if it had arrived.
+ * Pkts of the group already written out are still in their slots unless a later pkt took the slot.
+ * @return -1 means failure, 0 otherwise
+*/
+static int repair_pkt(recv_session_t* s, rtp_packet_t* fec){
+    rtp_receiver_t* control = s->control;
+    control->fec_seen = true;
+    rtp_parity_t parity;
+    if(fec->rtp.length < sizeof(parity))
+        return 0;
+    memcpy(&parity, fec->payload, sizeof(parity));
+    uint32_t first = fec->rtp.seq_num;
+    uint32_t end = first + parity.count;
+    size_t length = fec->rtp.length - sizeof(parity);
+    if(parity.count == 0 || parity.count > control->window_size || end <= control->seq_next
+        || end > control->seq_next + control->window_size || length > control->max_payload)
+        return 0;
+
+    uint32_t missing = UINT32_MAX;
+    for(uint32_t seq = first > control->seq_next ? first : control->seq_next; seq < end; seq++)
+        if(!rtp_testBit(control->recv_map, rtp_slot(seq, control->window_size))){
+            if(missing != UINT32_MAX)
+                return 0;
+            missing = seq;
+        }
+    if(missing == UINT32_MAX)
+        return 0;
+
+    if(!control->fec_spare)
+        control->fec_spare = malloc(RTP_PKT_ROOM(control->max_payload));
+    rtp_packet_t* pkt = (rtp_packet_t*)control->fec_spare;
+    memcpy(pkt->payload, fec->payload + sizeof(parity), length);
+    uint16_t size = parity.length;
+    for(uint32_t seq = first; seq < end; seq++){
+        if(seq == missing)
+            continue;
+        rtp_packet_t* data = (rtp_packet_t*)control->recv_buf[rtp_slot(seq, control->window_size)];
+        if(!data || data->rtp.seq_num != seq || data->rtp.type != RTP_DATA || data->rtp.length > length)
+            return 0;
+        rtp_fecXor(pkt->payload, data->payload, data->rtp.length);
+        size ^= data->rtp.length;
+    }
+    if(size == 0 || size > length || size > control->payload_size)
+        return 0;
+    rtp_frame(pkt, RTP_DATA, size, missing);
+    // As rtp_verify leaves it, the checksum field holds the CRC of the payload.
+    pkt->rtp.checksum = compute_checksum(pkt->payload, size);
+
+    uint32_t seq_next = control->seq_next;
+    void* buf = pkt;
+    if(accept_data(s, pkt, &buf) == -1)
+        return -1;
+    control->fec_spare = buf;
+    return ack_pkt(s, missing, seq_next);
+}
+
+/**
+ * @brief Decompress an RTP_LZ pkt and take it as the DATA pkt it was made from.
+ * Pkts already received are only acknowledged again, without decompressing them.
+ * @return -1 means failure, 0 otherwise
+*/
+static int inflate_pkt(recv_session_t* s, rtp_packet_t* lz){
+    rtp_receiver_t* control = s->control;
+    uint32_t seq = lz->rtp.seq_num;
+    uint32_t seq_next = control->seq_next;
+    if(seq >= control->seq_next + control->window_size)
+        return 0;
+    if(seq >= control->seq_next && !rtp_testBit(control->recv_map, rtp_slot(seq, control->window_size))){
+        if(!control->lz_spare)
+            control->lz_spare = malloc(RTP_PKT_ROOM(control->max_payload));
+        rtp_packet_t* pkt = (rtp_packet_t*)control->lz_spare;
+        ssize_t length = rtp_lzDecompress(lz->payload, lz->rtp.length, pkt->payload, control->payload_size);
+        // Drop a pkt that does not decompress, the sender resends it.
+        if(length <= 0)
+            return 0;
+        // Verified already, the header only has to look like the DATA pkt, whose payload CRC rtp_verify would leave.
+        pkt->rtp.type = RTP_DATA;
+        pkt->rtp.length = length;
+        pkt->rtp.seq_num = seq;
+        pkt->rtp.checksum = compute_checksum(pkt->payload, length);
+        void* buf = pkt;
+        if(accept_data(s, pkt, &buf) == -1)
+            return -1;
+        control->lz_spare = buf;
+    }
+    return ack_pkt(s, seq, seq_next);
+}
+
+/**
+ * @brief Check the digest an END carries against the data written in order, an END without one passes.
+*/
+static bool digest_matches(const rtp_receiver_t* control, const rtp_packet_t* end){
+    rtp_digest_t digest;
+    if(end->rtp.length < sizeof(digest))
+        return true;
+    memcpy(&digest, end->payload, sizeof(digest));
+    if(digest.crc == control->digest && digest.length == control->digest_length)
+        return true;
+    fprintf(stderr, "[Receiver] Digest mismatch: %08x over %llu bytes sent, %08x over %llu bytes written\n", digest.crc,
+        (unsigned long long)digest.length, control->digest, (unsigned long long)control->digest_length);
+    return false;
+}
+
+/**
+ * @brief Handle the index-th pkt drained into batch, already verified.
+ * @param s Session the pkt belongs to
+ * @param batch Batch holding the pkt, its buffer may be swapped for a spare one
+ * @param index Index of pkt in batch
+ * @return -1 means failure, 1 means END received, 0 otherwise
+*/
+static int handle_pkt(recv_session_t* s, rtp_batch_t* batch, uint32_t index){
+    rtp_receiver_t* control = s->control;
+    rtp_packet_t* recv_pkt = (rtp_packet_t*)rtp_batchBuffer(batch, index);
+
+    uint32_t seq = recv_pkt->rtp.seq_num;
+    uint32_t seq_next = control->seq_next;
+    if(recv_pkt->rtp.type == RTP_START){
+        if(recv_pkt->rtp.length > 0)
+            return accept_options(s, recv_pkt);
+        // START resent because its ACK got lost.
+        return send_start_ack(s, seq);
+    }
+    else if(recv_pkt->rtp.type == RTP_END){
+        if(send_ack(s, seq) == -1)
+            return -1;
+        if(seq == control->seq_next){
+            s->finished = true;
+            s->corrupt = !digest_matches(control, recv_pkt);
+            return 1;
+        }
+        return 0;
+    }
+    else if(recv_pkt->rtp.type == RTP_FEC)
+        return repair_pkt(s, recv_pkt);
+    else if(recv_pkt->rtp.type == RTP_LZ)
+        return inflate_pkt(s, recv_pkt);
+    else if(recv_pkt->rtp.type == RTP_SIG)
+        return send_signatures(s, recv_pkt);
+    else if(recv_pkt->rtp.type != RTP_DATA || recv_pkt->rtp.length == 0)
+        return 0;
+
+    // Drop pkt beyond the window or longer than the payload agreed without ACK, so the sender resends it.
+    if(seq >= control->seq_next + control->window_size || recv_pkt->rtp.length > control->payload_size)
+        return 0;
+    if(accept_data(s, recv_pkt, &batch->iovs[index * RTP_BATCH_IOV].iov_base) == -1)
+        return -1;
+    return ack_pkt(s, seq, seq_next);
+}
+
+/**
+ * @brief Wait for pkts of s and handle one batch of them, or send the pending ACK when it is due.
+ * @return -1 means failure, 1 means END received or the sender went silent for 10s, 0 otherwise
+*/
+static int recv_round(recv_session_t* s){
+    rtp_receiver_t* control = s->control;
+    rtp_batch_t* batch = control->recv_batch;
+    fd_set wait_fd;
+    FD_ZERO(&wait_fd);
+    FD_SET(s->fd, &wait_fd);
+    struct timeval timeout = {10, 0}; // 10s
+    // Segments of a coalesced datagram may be left over, the socket need not be readable for them.
+    bool pending = rtp_batchPending(batch);
+    if(pending)
+        timeout.tv_sec = 0;
+    else if(control->ack_deadline){
+        // Wake up for the pending ACK.
+        uint64_t now = mono_us();
+        uint64_t wait = control->ack_deadline > now ? control->ack_deadline - now : 0;
+        timeout.tv_sec = wait / 1000000;
+        timeout.tv_usec = wait % 1000000;
+    }
+    int res = select(s->fd + 1, &wait_fd, NULL, NULL, &timeout);
+    if(res == -1)
+        return -1;
+    else if(res == 0 && !pending && control->ack_pending){
+        if(send_pending(s) == -1 || flush_acks(s) == -1)
+            return -1;
+        return 0;
+    }
+    else if(res == 0 && !pending)
+        return 1;
+
+    // Drain queued data pkts.
+    s->addrlen = sizeof(s->addr);
+    int recv_num = rtp_recvBatch(s->fd, batch, (struct sockaddr*)&s->addr, &s->addrlen);
+    if(recv_num == -1)
+        return -1;
+    int state = 0;
+    for(int i = 0; i < recv_num && state == 0; i++)
+        if(rtp_batchVerify(batch, i) != -1)
+            state = handle_pkt(s, batch, i);
+    if(state == -1)
+        return -1;
+    // Pkts arriving more often than ack_delay keep select from timing out, the deadline still holds.
+    if(control->ack_pending && control->ack_deadline <= mono_us() && send_pending(s) == -1)
+        return -1;
+    if(flush_acks(s) == -1)
+        return -1;
+    return state;
+}
+
+/**
+ * @brief Shared receiving loop of RTP and optimized RTP.
+ * @param session Session with an accepted connection
+ * @param filename Name of file to write received data
+ * @param opt false to ACK the next expected pkt, true to ACK every received pkt
+ * @return Bytes received, -1 means failure
+*/
+static int recv_message(rtp_session_t* session, const char* filename, bool opt){
+    rtp_receiver_t* control = session->receiver;
+    recv_session_t s = {.fd = session->fd, .addr = session->addr, .addrlen = sizeof(session->addr), .control = control,
+        .opt = opt, .ack_every = session->ack_every, .ack_delay = session->ack_delay, .resume = session->resume,
+        .delta = session->delta && !session->resume, .opened = true, .filename = (char*)filename};
+
+    // Open file whose name is filename, kept until the sender tells whether it resumes.
+    // An old version offered for deltas stays as it is until the new one is complete.
+    if(s.resume)
+        load_checkpoint(&s);
+    struct stat st;
+    s.delta = s.delta && stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+    if(s.delta){
+        size_t size = strlen(filename) + sizeof(REPLACE_SUFFIX);
+        s.replace = malloc(size);
+        snprintf(s.replace, size, "%s%s", filename, REPLACE_SUFFIX);
+    }
+    if(sink_open(&s.sink, s.replace ? s.replace : filename, session->direct_write, s.resume) == -1){
+        perror("[Receiver] Open file failure");
+        free(s.replace);
+        return -1;
+    }
+
+    // Wait for data.
+    int state;
+    while((state = recv_round(&s)) == 0);
+    finish_checkpoint(&s);
+    sink_close(&s);
+    state = finish_replace(&s, state);
+    if(s.corrupt)
+        return RTP_RECV_CORRUPT;
+    return state == 1 ? recv_result(s.sink.recv_byte) : -1;
+}
+
+ssize_t rtp_readv(rtp_session_t* session, const struct iovec* iov, int iovcnt){
+    rtp_receiver_t* control = session->receiver;
+    if(!control)
+        return -1;
+    // Streams are acknowledged as by recvMessageOpt, data goes to the read buffer of control.
+    recv_session_t s = {.fd = session->fd, .addr = session->addr, .addrlen = sizeof(session->addr), .control = control,
+        .opt = true, .ack_every = session->ack_every, .ack_delay = session->ack_delay};
+    s.sink.memory = true;
+    while(control->read_begin == control->read_end && !control->read_eof){
+        int state = recv_round(&s);
+        if(state == -1)
+            return -1;
+        control->read_eof = state == 1;
+        if(s.corrupt)
+            return -1;
+    }
+    // The reader may not come back soon, ACK what it got now.
+    if(control->ack_pending && (send_pending(&s) == -1 || flush_acks(&s) == -1))
+        return -1;
+
+    ssize_t read_byte = 0;
+    for(int i = 0; i < iovcnt && control->read_begin < control->read_end; i++){
+        size_t length = control->read_end - control->read_begin;
+        if(length > iov[i].iov_len)
+            length = iov[i].iov_len;
+        memcpy(iov[i].iov_base, control->read_buf + control->read_begin, length);
+        control->read_begin += length;
+        read_byte += length;
+    }
+    return read_byte;
+}
+
+ssize_t rtp_read(rtp_session_t* session, void* buf, size_t len){
+    struct iovec iov = {buf, len};
+    return rtp_readv(session, &iov, 1);
+}
+
+int rtp_sessionRecv(rtp_session_t* session, const char* filename, int opt){
+    if(!session->receiver)
+        return -1;
+    return recv_message(session, filename, opt != 0);
+}
+
+/**
+ * @brief Apply receiver settings to the session of initReceiver.
+*/
+static rtp_session_t* legacy_session(){
+    receiver_session->direct_write = direct_write;
+    receiver_session->resume = resume;
+    receiver_session->delta = delta;
+    receiver_session->ack_every = ack_every;
+    receiver_session->ack_delay = ack_delay;
+    return receiver_session;
+}
+
+int recvMessage(char* filename){
+    return recv_message(legacy_session(), filename, false);
 }
 
 void terminateReceiver(){
-    rtp_freeReceiverControl(receiver_control);
-    close(recvfd);
+    rtp_sessionClose(receiver_session);
+    receiver_session = NULL;
     return;
 }
 
 int recvMessageOpt(char* filename){
-    // Open file whose name is filename.
-    FILE* recv_file = fopen(filename, "wb");
-    if(!recv_file){
+    return recv_message(legacy_session(), filename, true);
+}
+
+static uint32_t peer_hash(rtp_server_t* server, const struct sockaddr_in* peer){
+    uint32_t key = peer->sin_addr.s_addr ^ ((uint32_t)peer->sin_port << 16 | peer->sin_port);
+    return (key * 2654435761u >> 7) & server->bucket_mask;
+}
+
+static recv_session_t* find_session(rtp_server_t* server, const struct sockaddr_in* peer){
+    uint32_t slot = server->buckets[peer_hash(server, peer)];
+    while(slot != RTP_WHEEL_NONE){
+        recv_session_t* s = &server->sessions[slot];
+        if(s->addr.sin_addr.s_addr == peer->sin_addr.s_addr && s->addr.sin_port == peer->sin_port)
+            return s;
+        slot = s->hash_next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start a session for a peer whose START was just received.
+ * @return The session, NULL if the table is full
+*/
+static recv_session_t* open_session(rtp_server_t* server, const struct sockaddr_in* peer, uint32_t conn){
+    uint32_t slot = server->free_slot;
+    if(slot == RTP_WHEEL_NONE)
+        return NULL;
+    recv_session_t* s = &server->sessions[slot];
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peer->sin_addr, ip, sizeof(ip));
+    size_t size = strlen(server->dir) + INET_ADDRSTRLEN + 24;
+    char* filename = malloc(size);
+    snprintf(filename, size, "%s/%s_%u_%08x", server->dir, ip, ntohs(peer->sin_port), conn);
+
+    server->free_slot = s->hash_next;
+    s->fd = server->fd;
+    s->addr = *peer;
+    s->addrlen = sizeof(s->addr);
+    s->control = create_control(server->window_size, server->max_payload, false);
+    accept_start(s->control, conn, RTP_CAPS);
+    memset(&s->options, 0, sizeof(s->options));
+    s->opened = false;
+    s->finished = false;
+    s->resume = server->resume;
+    s->dir = server->dir;
+    s->opt = server->opt;
+    s->ack_every = server->ack_every;
+    s->ack_delay = server->ack_delay;
+    s->used = true;
+    s->touched = false;
+    s->conn = conn;
+    s->filename = filename;
+    s->last_active = mono_us();
+    uint32_t bucket = peer_hash(server, peer);
+    s->hash_next = server->buckets[bucket];
+    server->buckets[bucket] = slot;
+    rtp_wheelSchedule(server->timer, slot, s->last_active + server->idle_us);
+    return s;
+}
+
+/**
+ * @brief Open the file of a session once its options are settled.
+ * Stripes of one transfer all go to dir/<transfer id>, resumable transfers to dir/<file id>, others to a file of their own.
+ * @return -1 means failure, 0 means success
+*/
+static int open_sink(rtp_server_t* server, recv_session_t* s){
+    int state;
+    if(s->options.flags & RTP_OPT_STRIPE){
+        size_t size = strlen(server->dir) + 24;
+        char* filename = malloc(size);
+        snprintf(filename, size, "%s/%016llx", server->dir, (unsigned long long)s->options.transfer);
+        free(s->filename);
+        s->filename = filename;
+        state = sink_open_stripe(&s->sink, filename, &s->options);
+    }
+    else{
+        bool resumed = s->options.flags & RTP_OPT_RESUME;
+        state = sink_open(&s->sink, s->filename, server->direct_write, resumed);
+        if(state == 0 && resumed)
+            state = sink_resume(s, s->options.resume);
+    }
+    if(state == -1){
         perror("[Receiver] Open file failure");
         return -1;
     }
+    s->opened = true;
+    return 0;
+}
+
+/**
+ * @brief End a session, report it and free its slot.
+ * @param bytes Bytes received, -1 if the session failed or was evicted
+*/
+static void close_session(rtp_server_t* server, recv_session_t* s, int bytes){
+    uint32_t slot = s - server->sessions;
+    if(s->touched){
+        flush_acks(s);
+        s->touched = false;
+    }
+    finish_checkpoint(s);
+    if(s->opened)
+        sink_close(s);
+    if(server->done)
+        server->done(s->filename, &s->addr, bytes, server->arg);
 
-    int recv_byte = 0;
+    // Unlink from its hash bucket.
+    uint32_t* link = &server->buckets[peer_hash(server, &s->addr)];
+    while(*link != slot)
+        link = &server->sessions[*link].hash_next;
+    *link = s->hash_next;
 
-    // Wait for data.
-    fd_set wait_fd;
+    rtp_wheelCancel(server->timer, slot);
+    rtp_freeReceiverControl(s->control);
+    free(s->filename);
+    s->control = NULL;
+    s->filename = NULL;
+    s->used = false;
+    s->hash_next = server->free_slot;
+    server->free_slot = slot;
+}
+
+/**
+ * @brief Arm the timer of a session for its pending ACK or idle timeout, whichever comes first.
+*/
+static void schedule_session(rtp_server_t* server, recv_session_t* s){
+    uint64_t expire = s->last_active + server->idle_us;
+    if(s->control->ack_deadline && s->control->ack_deadline < expire)
+        expire = s->control->ack_deadline;
+    rtp_wheelSchedule(server->timer, s - server->sessions, expire);
+}
+
+static void on_session_timer(uint32_t slot, void* arg){
+    rtp_server_t* server = arg;
+    recv_session_t* s = &server->sessions[slot];
+    uint64_t now = mono_us();
+    if(now - s->last_active >= server->idle_us){
+        close_session(server, s, -1);
+        return;
+    }
+    if(s->control->ack_pending && s->control->ack_deadline <= now){
+        if(send_pending(s) == -1 || flush_acks(s) == -1){
+            close_session(server, s, -1);
+            return;
+        }
+    }
+    schedule_session(server, s);
+}
+
+/**
+ * @brief Dispatch the index-th datagram of recv_batch to the session of its sender.
+*/
+static void dispatch_pkt(rtp_server_t* server, uint32_t index, uint64_t now){
+    rtp_batch_t* batch = server->recv_batch;
+    if(rtp_batchVerify(batch, index) == -1)
+        return;
+    rtp_packet_t* pkt = (rtp_packet_t*)rtp_batchBuffer(batch, index);
+    struct sockaddr_in* peer = &server->from[index];
+    recv_session_t* s = find_session(server, peer);
+
+    if(pkt->rtp.type == RTP_START){
+        // A new START from a known address means the old connection is gone.
+        if(s && s->conn != pkt->rtp.seq_num){
+            close_session(server, s, -1);
+            s = NULL;
+        }
+        if(!s && !(s = open_session(server, peer, pkt->rtp.seq_num)))
+            return;
+    }
+    else if(!s){
+        // END resent after its session finished: its ACK got lost.
+        if(pkt->rtp.type == RTP_END)
+            rtp_sendctl(server->fd, RTP_ACK, pkt->rtp.seq_num, (struct sockaddr*)peer, sizeof(*peer));
+        return;
+    }
+
+    // Any pkt that may carry data opens the sink, a parity pkt can rebuild the first one.
+    bool data = pkt->rtp.type == RTP_DATA || pkt->rtp.type == RTP_LZ || pkt->rtp.type == RTP_FEC;
+    if(!s->opened && (data || pkt->rtp.type == RTP_END) && open_sink(server, s) == -1){
+        close_session(server, s, -1);
+        return;
+    }
+    s->last_active = now;
+    if(!s->touched){
+        s->touched = true;
+        server->touched[server->touched_count++] = s - server->sessions;
+    }
+    int state = handle_pkt(s, batch, index);
+    if(state == -1)
+        close_session(server, s, -1);
+    else if(state == 1)
+        close_session(server, s, s->corrupt ? RTP_RECV_CORRUPT : recv_result(s->sink.recv_byte));
+}
+
+/**
+ * @brief Create a server, see createReceiverServer.
+ * @param reuseport Whether to join the SO_REUSEPORT group of the port, one per shard
+ * @return The server, NULL on failure
+*/
+static rtp_server_t* create_server(uint16_t port, bool reuseport, uint32_t window_size, uint32_t max_sessions, uint32_t idle_ms, const char* dir, int opt){
+    rtp_server_t* server = calloc(1, sizeof(rtp_server_t));
+    server->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    server->epfd = epoll_create1(0);
+    server->stopfd = eventfd(0, EFD_NONBLOCK);
+    if(server->fd == -1 || server->epfd == -1 || server->stopfd == -1){
+        perror("[Receiver] Server socket failure");
+        freeReceiverServer(server);
+        return NULL;
+    }
+
+    // Room for bursts from many senders at once.
+    int rcvbuf = SERVER_RCVBUF;
+    setsockopt(server->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    int one = 1;
+    if(reuseport && setsockopt(server->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1){
+        perror("[Receiver] Reuseport failure");
+        freeReceiverServer(server);
+        return NULL;
+    }
+    struct sockaddr_in local;
+    bzero(&local, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(port);
+    if(bind(server->fd, (struct sockaddr*)&local, sizeof(local)) == -1){
+        perror("[Receiver] Bind failure");
+        freeReceiverServer(server);
+        return NULL;
+    }
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.fd = server->fd;
+    epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->fd, &event);
+    event.data.fd = server->stopfd;
+    epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->stopfd, &event);
+
+    server->dir = strdup(dir);
+    server->window_size = window_size;
+    server->max_payload = payload_limit(max_payload);
+    server->max_sessions = max_sessions;
+    server->idle_us = (uint64_t)idle_ms * 1000;
+    server->opt = opt != 0;
+    server->direct_write = direct_write;
+    server->resume = resume;
+    server->ack_every = ack_every;
+    server->ack_delay = ack_delay;
+
+    // Session table, every slot starts on the free list.
+    server->sessions = calloc(max_sessions, sizeof(recv_session_t));
+    for(uint32_t i = 0; i < max_sessions; i++)
+        server->sessions[i].hash_next = i + 1 < max_sessions ? i + 1 : RTP_WHEEL_NONE;
+    server->free_slot = max_sessions ? 0 : RTP_WHEEL_NONE;
+    uint32_t buckets = 1;
+    while(buckets < 2 * max_sessions)
+        buckets <<= 1;
+    server->buckets = malloc(buckets * sizeof(uint32_t));
+    memset(server->buckets, 0xff, buckets * sizeof(uint32_t));
+    server->bucket_mask = buckets - 1;
+    server->touched = malloc(RTP_BATCH_SIZE * sizeof(uint32_t));
+    server->timer = rtp_createWheel(max_sessions, SERVER_TICK, mono_us());
+
+    server->recv_batch = rtp_createBatch(RTP_BATCH_SIZE);
+    for(int i = 0; i < RTP_BATCH_SIZE; i++)
+        rtp_batchPush(server->recv_batch, malloc(RTP_PKT_ROOM(server->max_payload)), RTP_PKT_ROOM(server->max_payload));
+    server->from = calloc(RTP_BATCH_SIZE, sizeof(struct sockaddr_in));
+    if(offload)
+        rtp_enableGRO(server->fd, server->recv_batch);
+    return server;
+}
+
+rtp_server_t* createReceiverServer(uint16_t port, uint32_t window_size, uint32_t max_sessions, uint32_t idle_ms, const char* dir, int opt){
+    return create_server(port, false, window_size, max_sessions, idle_ms, dir, opt);
+}
+
+void setReceiverServerCallback(rtp_server_t* server, rtp_server_cb done, void* arg){
+    server->done = done;
+    server->arg = arg;
+}
+
+int runReceiverServer(rtp_server_t* server){
+    struct epoll_event events[2];
     while(true){
-        FD_ZERO(&wait_fd);
-        FD_SET(recvfd, &wait_fd);
-        struct timeval timeout = {10, 0}; // 10s
-        int res = select(recvfd + 1, &wait_fd, NULL, NULL, &timeout);
-        if(res == -1){
-            fclose(recv_file);
+        // Fire pending ACKs and evict idle sessions.
+        uint64_t now = mono_us();
+        rtp_wheelAdvance(server->timer, now, on_session_timer, server);
+        uint64_t wait = rtp_wheelTimeout(server->timer, now);
+        int timeout = wait == UINT64_MAX ? -1 : (int)((wait + 999) / 1000);
+        // Segments of a coalesced datagram may be left over, epoll does not report them.
+        bool readable = rtp_batchPending(server->recv_batch);
+        if(readable)
+            timeout = 0;
+
+        int n = epoll_wait(server->epfd, events, 2, timeout);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            perror("[Receiver] Epoll failure");
             return -1;
         }
-        else if(res == 0){
-            fclose(recv_file);
-            return recv_byte;
+        for(int i = 0; i < n; i++){
+            if(events[i].data.fd == server->stopfd){
+                uint64_t count;
+                if(read(server->stopfd, &count, sizeof(count)) == -1)
+                    perror("[Receiver] Stop failure");
+                return 0;
+            }
+            readable = true;
         }
-        else if(FD_ISSET(recvfd, &wait_fd)){
-            // Receive data pkt.
-            socklen_t addrlen = sizeof(addr);
-            rtp_packet_t* recv_pkt = rtp_recvfrom(recvfd, (struct sockaddr*)&addr, &addrlen);
-            if(!recv_pkt)
+        if(!readable)
+            continue;
+
+        // One batch per wake-up keeps timers firing under load, epoll reports the rest again.
+        int recv_num = rtp_recvBatchFrom(server->fd, server->recv_batch, server->from);
+        if(recv_num == -1)
+            return -1;
+        now = mono_us();
+        for(int j = 0; j < recv_num; j++)
+            dispatch_pkt(server, j, now);
+
+        // Send ACKs of every session touched by this batch.
+        for(uint32_t j = 0; j < server->touched_count; j++){
+            recv_session_t* s = &server->sessions[server->touched[j]];
+            if(!s->touched)
                 continue;
-            else{
-                if(recv_pkt->rtp.type == RTP_START || recv_pkt->rtp.type == RTP_END){
-                    rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, recv_pkt->rtp.seq_num, NULL);
-                    ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                    if(send_length != sizeof(rtp_header_t)){
-                        free(pkt);
-                        free(recv_pkt);
-                        perror("[Receiver] Send failure");
-                        return -1;
-                    }
-                    free(pkt);
-
-                    if(recv_pkt->rtp.type == RTP_END && recv_pkt->rtp.seq_num == receiver_control->seq_next){
-                        fclose(recv_file);
-                        free(recv_pkt);
-                        return recv_byte;
-                    }
-                    else
-                        free(recv_pkt);
-                }
-                else if(recv_pkt->rtp.type == RTP_DATA){
-                    if(recv_pkt->rtp.seq_num > receiver_control->seq_next){
-                        if(recv_pkt->rtp.seq_num > receiver_control->seq_next + receiver_control->window_size){
-                            free(recv_pkt);
-                            continue;
-                        }
-
-                        // Cache data.
-                        if(recv_pkt->rtp.length == 0)
-                            continue;
-                        int ack_num = recv_pkt->rtp.seq_num - receiver_control->seq_next;
-                        receiver_control->recv_ack[ack_num] = 1;
-                        receiver_control->recv_length[ack_num] = recv_pkt->rtp.length;
-                        memcpy(receiver_control->recv_buf[ack_num], recv_pkt->payload, recv_pkt->rtp.length);
-
-                        // Send ACK.
-                        rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, recv_pkt->rtp.seq_num, NULL);
-                        ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                        if(send_length != sizeof(rtp_header_t)){
-                            free(pkt);
-                            free(recv_pkt);
-                            perror("[Receiver] Send failure");
-                            return -1;
-                        }
-                        free(recv_pkt);
-                        free(pkt);
-                    }
-                    else if(recv_pkt->rtp.seq_num == receiver_control->seq_next){
-                        // Cache data.
-                        if(recv_pkt->rtp.length == 0)
-                            continue;
-                        int ack_num = 0;
-                        receiver_control->recv_ack[ack_num] = 1;
-                        receiver_control->recv_length[ack_num] = recv_pkt->rtp.length;
-                        memcpy(receiver_control->recv_buf[ack_num], recv_pkt->payload, recv_pkt->rtp.length);
-
-                        // Update seq_next.
-                        int slide_step = 0;
-                        for(slide_step = 0; slide_step < receiver_control->window_size; slide_step++){
-                            if(receiver_control->recv_ack[slide_step] == 0)
-                                break;
-                        }
-                        receiver_control->seq_next += slide_step;
-                        
-                        // Write to file.
-                        for(int i = 0; i < slide_step; i++){
-                            size_t write_byte = fwrite(receiver_control->recv_buf[i], 1, receiver_control->recv_length[i], recv_file);
-                            if(write_byte != receiver_control->recv_length[i]){
-                                free(recv_pkt);
-                                perror("[Receiver] Write failure");
-                                return -1;
-                            }
-                            recv_byte += write_byte;
-                        }
-                        
-                        // Update sliding window.
-                        for(int i = slide_step; i < receiver_control->window_size; i++){
-                            memset(receiver_control->recv_buf[i - slide_step], 0, PAYLOAD_SIZE);
-                            memcpy(receiver_control->recv_buf[i - slide_step], receiver_control->recv_buf[i], receiver_control->recv_length[i]);
-                            receiver_control->recv_length[i - slide_step] = receiver_control->recv_length[i];
-                            receiver_control->recv_ack[i - slide_step] = receiver_control->recv_ack[i];
-                        }
-                        for(int i = 0; i < slide_step; i++){
-                            int j = receiver_control->window_size - 1 - i;
-                            memset(receiver_control->recv_buf[j], 0, PAYLOAD_SIZE);
-                            receiver_control->recv_length[j] = 0;
-                            receiver_control->recv_ack[j] = 0;
-                        }
-
-                        // Send ACK.
-                        rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, recv_pkt->rtp.seq_num, NULL);
-                        ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                        if(send_length != sizeof(rtp_header_t)){
-                            free(pkt);
-                            free(recv_pkt);
-                            perror("[Receiver] Send failure");
-                            return -1;
-                        }
-                        free(recv_pkt);
-                        free(pkt);
-                    }
-                    else{
-                        // Send ACK.
-                        rtp_packet_t* pkt = rtp_packet(RTP_ACK, 0, recv_pkt->rtp.seq_num, NULL);
-                        ssize_t send_length = sendto(recvfd, (void*)pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)&addr, addrlen);
-                        if(send_length != sizeof(rtp_header_t)){
-                            free(pkt);
-                            free(recv_pkt);
-                            perror("[Receiver] Send failure");
-                            return -1;
-                        }
-                        free(recv_pkt);
-                        free(pkt);
-                    }
-                }
+            s->touched = false;
+            if(flush_acks(s) == -1)
+                close_session(server, s, -1);
+            else
+                schedule_session(server, s);
+        }
+        server->touched_count = 0;
+    }
+}
+
+void stopReceiverServer(rtp_server_t* server){
+    uint64_t one = 1;
+    if(write(server->stopfd, &one, sizeof(one)) == -1)
+        perror("[Receiver] Stop failure");
+}
+
+void freeReceiverServer(rtp_server_t* server){
+    if(!server)
+        return;
+    for(uint32_t i = 0; server->sessions && i < server->max_sessions; i++)
+        if(server->sessions[i].used)
+            close_session(server, &server->sessions[i], -1);
+    if(server->recv_batch){
+        for(uint32_t i = 0; i < server->recv_batch->count; i++)
+            free(rtp_batchBuffer(server->recv_batch, i));
+        rtp_freeBatch(server->recv_batch);
+    }
+    rtp_freeWheel(server->timer);
+    free(server->from);
+    free(server->touched);
+    free(server->buckets);
+    free(server->sessions);
+    free(server->dir);
+    if(server->fd != -1)
+        close(server->fd);
+    if(server->epfd != -1)
+        close(server->epfd);
+    if(server->stopfd != -1)
+        close(server->stopfd);
+    free(server);
+}
+
+/**
+ * @brief Attach a classic BPF program to the SO_REUSEPORT group of fd,
+ * sending every datagram to socket (source IP ^ source port) % count.
+ * IP options are not expected, the source port is read right after a 20 byte IP header.
+ * @return -1 means failure, 0 means success
+*/
+static int attach_steering(int fd, uint32_t count){
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),   // A = source IP
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),                        // X = A
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 20),   // A = source port
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+rtp_shards_t* createReceiverShards(uint16_t port, uint32_t count, uint32_t window_size, uint32_t max_sessions, uint32_t idle_ms, const char* dir, int opt){
+    if(count == 0)
+        return NULL;
+    rtp_shards_t* shards = calloc(1, sizeof(rtp_shards_t));
+    shards->servers = calloc(count, sizeof(rtp_server_t*));
+    shards->threads = calloc(count, sizeof(pthread_t));
+    // Sockets join the group in bind order, which is the index the program returns.
+    for(; shards->count < count; shards->count++){
+        shards->servers[shards->count] = create_server(port, true, window_size, max_sessions, idle_ms, dir, opt);
+        if(!shards->servers[shards->count]){
+            freeReceiverShards(shards);
+            return NULL;
+        }
+    }
+    if(attach_steering(shards->servers[0]->fd, count) == 0)
+        shards->steered = true;
+    else
+        perror("[Receiver] Steering failure, falling back to kernel hash");
+    return shards;
+}
+
+rtp_server_t* getReceiverShard(rtp_shards_t* shards, uint32_t index){
+    return index < shards->count ? shards->servers[index] : NULL;
+}
+
+uint32_t receiverShardOf(const rtp_shards_t* shards, const struct sockaddr_in* peer){
+    if(!shards->steered)
+        return UINT32_MAX;
+    return (ntohl(peer->sin_addr.s_addr) ^ ntohs(peer->sin_port)) % shards->count;
+}
+
+static void* shard_main(void* arg){
+    runReceiverServer(arg);
+    return NULL;
+}
+
+int startReceiverShards(rtp_shards_t* shards){
+    if(shards->running)
+        return -1;
+    // Spread shards over the cores this process may run on.
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int ncpu = 0;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if(CPU_ISSET(cpu, &allowed))
+                cpus[ncpu++] = cpu;
+
+    for(uint32_t i = 0; i < shards->count; i++){
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(ncpu > 0){
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % ncpu], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        int res = pthread_create(&shards->threads[i], &attr, shard_main, shards->servers[i]);
+        pthread_attr_destroy(&attr);
+        if(res != 0){
+            fprintf(stderr, "[Receiver] Shard thread failure.\n");
+            for(uint32_t j = 0; j < i; j++){
+                stopReceiverServer(shards->servers[j]);
+                pthread_join(shards->threads[j], NULL);
             }
+            return -1;
         }
     }
-    return -1;
-}
\ No newline at end of file
+    shards->running = true;
+    return 0;
+}
+
+void stopReceiverShards(rtp_shards_t* shards){
+    if(!shards->running)
+        return;
+    for(uint32_t i = 0; i < shards->count; i++)
+        stopReceiverServer(shards->servers[i]);
+    for(uint32_t i = 0; i < shards->count; i++)
+        pthread_join(shards->threads[i], NULL);
+    shards->running = false;
+}
+
+void freeReceiverShards(rtp_shards_t* shards){
+    if(!shards)
+        return;
+    stopReceiverShards(shards);
+    for(uint32_t i = 0; i < shards->count; i++)
+        freeReceiverServer(shards->servers[i]);
+    free(shards->servers);
+    free(shards->threads);
+    free(shards);
+}
@@ -3,11 +3,15 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <netinet/in.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// recvMessage等的返回值：发送方在END中附带的整个文件的CRC-32与实际写入的数据不符
+#define RTP_RECV_CORRUPT -2
+
 /**
  * @brief 开启receiver并在所有IP的port端口监听等待连接
  * 
@@ -20,7 +24,7 @@ int initReceiver(uint16_t port, uint32_t window_size);
 /**
  * @brief 用于接收数据并在接收完后断开RTP连接
  * @param filename 用于接收数据的文件名
- * @return >0表示接收完成后到数据的字节数 -1表示出现其他错误
+ * @return >0表示接收完成后到数据的字节数(2 GiB及以上为INT_MAX) RTP_RECV_CORRUPT表示数据与发送方的摘要不符 -1表示出现其他错误
  */
 int recvMessage(char* filename);
 
@@ -29,15 +33,151 @@ int recvMessage(char* filename);
 /**
  * @brief 用于接收数据并在接收完后断开RTP连接 (优化版本的RTP)
  * @param filename 用于接收数据的文件名
- * @return >0表示接收完成后到数据的字节数 -1表示出现其他错误
+ * @return >0表示接收完成后到数据的字节数(2 GiB及以上为INT_MAX) RTP_RECV_CORRUPT表示数据与发送方的摘要不符 -1表示出现其他错误
  */
 int recvMessageOpt(char* filename);
 
+/**
+ * @brief 设置接收数据的写入方式 (在recvMessage/recvMessageOpt之前调用)
+ * 开启后每个校验通过的数据包直接pwrite到它在文件中的偏移处，只用位图记录已收到的包，
+ * 不再缓存乱序数据。偏移按满载包(协商的payload大小，默认PAYLOAD_SIZE字节)推算，遇到中间的短包时再把其后已写入的包前移
+ * @param enable 1表示直接写入，0表示按序缓冲写入(默认)
+ */
+void setReceiverDirectWrite(int enable);
+
+/**
+ * @brief 设置ACK合并策略 (在recvMessage/recvMessageOpt之前调用)
+ * 按序到达的包每every个才回一个累积ACK，未回的ACK最多推迟delay_us微秒；
+ * 乱序、重复、填补空洞的包以及连接开始的若干个包立即回ACK，不影响丢包恢复。
+ * 对方不支持SACK时recvMessageOpt仍然逐包回ACK
+ * @param every 每多少个按序包回一个ACK，1表示逐包回ACK，默认2
+ * @param delay_us ACK最长推迟时间(微秒)，默认1000
+ */
+void setReceiverAckPolicy(uint32_t every, uint32_t delay_us);
+
+/**
+ * @brief 设置发送方最多可以协商的payload大小 (在initReceiver/createReceiverServer之前调用)
+ * 每个接收缓冲区都按这个大小分配，发送方请求更大的payload时按这个大小答复
+ * @param size 字节数，默认PAYLOAD_SIZE(1461)，最大65496
+ */
+void setReceiverMaxPayload(uint32_t size);
+
+/**
+ * @brief 设置是否使用UDP GRO (在initReceiver/createReceiverServer之前调用)，默认开启
+ * 开启后内核把同一流的连续数据包合并上交，一次接收得到多个包，再按原来的包切开处理；内核不支持时按普通数据报接收
+ * @param enable 1表示开启，0表示关闭
+ */
+void setReceiverOffload(int enable);
+
+/**
+ * @brief 设置是否支持断点续传 (在recvMessage/recvMessageOpt/createReceiverServer之前调用)，默认关闭
+ * 开启后发送方请求续传的文件在接收过程中定期落盘(fdatasync)，并在 <文件名>.ckpt 中记录文件标识和已按序写入的字节数，
+ * 传输完成后删除。同一文件的传输中断后重新发送时，从记录处继续写入，已写入的部分不再重传；
+ * 服务器模式下可续传的文件名为 dir/<文件标识十六进制>，以便新连接找到它
+ * @param enable 1表示开启，0表示关闭
+ */
+void setReceiverResume(int enable);
+
+/**
+ * @brief 设置是否支持增量传输 (在recvMessage/recvMessageOpt之前调用)，默认关闭
+ * 开启后若目标文件已存在，新数据写入 <文件名>.rtptmp，发送方可以只发送与旧文件不同的部分，
+ * 其余按块从旧文件复制；收到END后才替换旧文件，中途失败时旧文件保持不变。
+ * 同时开启断点续传时以断点续传为准；服务器模式没有固定的旧文件，不做增量传输
+ * @param enable 1表示开启，0表示关闭
+ */
+void setReceiverDelta(int enable);
+
 /**
  * @brief 用于接收数据失败时断开RTP连接以及关闭UDP socket
  */
 void terminateReceiver();
 
+typedef struct RTP_server rtp_server_t;
+
+/**
+ * @brief 服务器模式下每个会话结束时的回调
+ * @param filename 会话数据写入的文件名
+ * @param peer 发送方地址
+ * @param bytes 接收到的字节数(2 GiB及以上为INT_MAX)，-1表示会话出错或因空闲被淘汰，RTP_RECV_CORRUPT表示数据与发送方的摘要不符
+ * @param arg setReceiverServerCallback传入的参数
+ */
+typedef void (*rtp_server_cb)(const char* filename, const struct sockaddr_in* peer, int bytes, void* arg);
+
+/**
+ * @brief 创建多会话接收服务器，在所有IP的port端口监听
+ * 所有发送方共用一个socket，按发送方地址查找会话，每个会话有自己的窗口和输出文件，
+ * 文件名为 dir/<IP>_<端口>_<START的seq_num十六进制>。同一地址发来新的START时旧会话作废
+ * @param port 监听的port
+ * @param window_size 每个会话的window大小
+ * @param max_sessions 同时进行的会话数上限，超出时新的START被忽略
+ * @param idle_ms 会话超过这么多毫秒没有收到包就被淘汰
+ * @param dir 接收文件所在目录
+ * @param opt 对不支持SACK的发送方如何回ACK，0同recvMessage，1同recvMessageOpt
+ * @return 服务器，NULL表示失败
+ */
+rtp_server_t* createReceiverServer(uint16_t port, uint32_t window_size, uint32_t max_sessions, uint32_t idle_ms, const char* dir, int opt);
+
+/**
+ * @brief 设置会话结束时的回调 (在runReceiverServer之前调用)
+ */
+void setReceiverServerCallback(rtp_server_t* server, rtp_server_cb done, void* arg);
+
+/**
+ * @brief 用epoll循环接收所有会话的数据，直到stopReceiverServer被调用
+ * @return 0表示正常停止，-1表示出现错误
+ */
+int runReceiverServer(rtp_server_t* server);
+
+/**
+ * @brief 让runReceiverServer返回，可以在其他线程调用
+ */
+void stopReceiverServer(rtp_server_t* server);
+
+/**
+ * @brief 关闭服务器，未完成的会话以-1字节报告给回调
+ */
+void freeReceiverServer(rtp_server_t* server);
+
+typedef struct RTP_shards rtp_shards_t;
+
+/**
+ * @brief 创建多核分片接收服务器：count个服务器用SO_REUSEPORT绑定同一个port，
+ * 并挂载BPF程序按(源IP ^ 源端口) % count把数据包分给各分片，同一发送方总是落在同一分片，
+ * 每个分片独占自己会话的状态，热路径上没有锁。挂载失败时退回内核的四元组哈希，同样保证同一发送方不换分片。
+ * 其余参数同createReceiverServer，max_sessions是每个分片的会话数上限
+ * @param count 分片数
+ * @return 分片服务器，NULL表示失败
+ */
+rtp_shards_t* createReceiverShards(uint16_t port, uint32_t count, uint32_t window_size, uint32_t max_sessions, uint32_t idle_ms, const char* dir, int opt);
+
+/**
+ * @brief 获取第index个分片的服务器，可用于setReceiverServerCallback (回调在该分片的线程中执行)
+ * @return 分片的服务器，index越界时为NULL
+ */
+rtp_server_t* getReceiverShard(rtp_shards_t* shards, uint32_t index);
+
+/**
+ * @brief 计算发送方peer的数据包会被分给哪个分片
+ * @return 分片序号，未挂载BPF程序(由内核哈希决定)时为UINT32_MAX
+ */
+uint32_t receiverShardOf(const rtp_shards_t* shards, const struct sockaddr_in* peer);
+
+/**
+ * @brief 为每个分片启动一个线程运行runReceiverServer，线程依次绑定到进程可用的各个CPU核上
+ * @return 0表示启动成功，-1表示失败
+ */
+int startReceiverShards(rtp_shards_t* shards);
+
+/**
+ * @brief 停止所有分片并等待线程退出
+ */
+void stopReceiverShards(rtp_shards_t* shards);
+
+/**
+ * @brief 停止并释放所有分片，未完成的会话以-1字节报告给回调
+ */
+void freeReceiverShards(rtp_shards_t* shards);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,135 +1,319 @@
 #include <sys/select.h>
+#include <errno.h>
 #include <time.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <netinet/udp.h>
 #include "util.h"
 #include "rtp.h"
 
-rtp_packet_t* rtp_packet(uint8_t type, uint16_t length, uint32_t seq_num, char* message){
-    rtp_packet_t* pkt = malloc(sizeof(rtp_header_t) + length);
+void rtp_frame(rtp_packet_t* pkt, uint8_t type, uint16_t length, uint32_t seq_num){
     pkt->rtp.type = type;
     pkt->rtp.length = length;
     pkt->rtp.seq_num = seq_num;
     pkt->rtp.checksum = 0;
+    pkt->rtp.checksum = compute_checksum((void*)pkt, sizeof(rtp_header_t) + length);
+}
+
+uint32_t rtp_frameHeader(rtp_header_t* header, uint8_t type, uint16_t length, uint32_t seq_num, const char* payload){
+    header->type = type;
+    header->length = length;
+    header->seq_num = seq_num;
+    header->checksum = 0;
+    uint32_t payload_crc = compute_checksum(payload, length);
+    header->checksum = crc32_combine(compute_checksum((void*)header, sizeof(rtp_header_t)), payload_crc, length);
+    return payload_crc;
+}
+
+rtp_packet_t* rtp_packet(uint8_t type, uint16_t length, uint32_t seq_num, char* message){
+    rtp_packet_t* pkt = malloc(sizeof(rtp_header_t) + length);
     if(message != NULL){
         memcpy(pkt->payload, message, length);
     }
-    pkt->rtp.checksum = compute_checksum((void*)pkt, sizeof(rtp_header_t) + length);
+    rtp_frame(pkt, type, length, seq_num);
     return pkt;
 }
 
-int rtp_connect(int sockfd, struct sockaddr_in* servaddr, socklen_t* addrlen){
-    // seq_num is a random value for connection.
-    srand(time(NULL));    
-    uint32_t seq = rand();
+int rtp_sendctl(int sockfd, uint8_t type, uint32_t seq_num, const struct sockaddr* to, socklen_t tolen){
+    rtp_packet_t ctl_pkt;
+    rtp_frame(&ctl_pkt, type, 0, seq_num);
+    ssize_t send_length = sendto(sockfd, (void*)&ctl_pkt, sizeof(rtp_header_t), 0, to, tolen);
+    if(send_length != sizeof(rtp_header_t))
+        return -1;
+    return 0;
+}
 
-    // Create a START packet.
-    rtp_packet_t* start_pkt = rtp_packet(RTP_START, 0, seq, NULL);
+void rtp_rtoInit(rtp_rto_t* rto){
+    rto->srtt = 0;
+    rto->rttvar = 0;
+    rto->rto = RTP_RTO_INIT;
+    rto->backoff = 0;
+}
 
-    // Send packet for connection.
-    ssize_t send_length = sendto(sockfd, (void*)start_pkt, sizeof(rtp_header_t), 0, (struct sockaddr*)servaddr, *addrlen);
-    if(send_length != sizeof(rtp_header_t)){
-        free(start_pkt);
-        perror("Start failure");
-        return -1;
+void rtp_rtoSample(rtp_rto_t* rto, uint64_t rtt){
+    if(rto->srtt == 0){
+        rto->srtt = rtt > 0 ? rtt : 1;
+        rto->rttvar = rtt / 2;
+    }
+    else{
+        uint64_t delta = rto->srtt > rtt ? rto->srtt - rtt : rtt - rto->srtt;
+        rto->rttvar = (3 * rto->rttvar + delta) / 4;
+        rto->srtt = (7 * rto->srtt + rtt) / 8;
+        if(rto->srtt == 0)
+            rto->srtt = 1;
     }
+    rto->rto = rto->srtt + 4 * rto->rttvar;
+    if(rto->rto < RTP_RTO_MIN)
+        rto->rto = RTP_RTO_MIN;
+    if(rto->rto > RTP_RTO_MAX)
+        rto->rto = RTP_RTO_MAX;
+    rto->backoff = 0;
+}
 
-    free(start_pkt);
+void rtp_rtoBackoff(rtp_rto_t* rto){
+    if(rtp_rtoTimeout(rto) < RTP_RTO_MAX)
+        rto->backoff++;
+}
 
-    // Check whether ACK time out.
-    struct timeval timeout = {10, 0}; // 10s
-    fd_set wait_fd;
-    FD_ZERO(&wait_fd);
-    FD_SET(sockfd, &wait_fd);
-    int res = select(sockfd + 1, &wait_fd, NULL, NULL, &timeout);
-    if(res == -1)
+uint64_t rtp_rtoTimeout(const rtp_rto_t* rto){
+    uint64_t timeout = rto->rto;
+    for(uint32_t i = 0; i < rto->backoff && timeout < RTP_RTO_MAX; i++)
+        timeout *= 2;
+    return timeout < RTP_RTO_MAX ? timeout : RTP_RTO_MAX;
+}
+
+int rtp_sendctlPayload(int sockfd, uint8_t type, uint32_t seq_num, const void* payload, uint16_t length, const struct sockaddr* to, socklen_t tolen){
+    char buf[RTP_ACK_SIZE] __attribute__((aligned(8)));
+    rtp_packet_t* ctl_pkt = (rtp_packet_t*)buf;
+    if(length > RTP_SACK_BYTES)
         return -1;
-    else if(res == 0){
-        // Handle timeout.
-        fprintf(stderr, "[Sender] ACK timeout.\n");
-        rtp_sendEND(sockfd, (struct sockaddr*)servaddr, addrlen, NULL);
+    memcpy(ctl_pkt->payload, payload, length);
+    rtp_frame(ctl_pkt, type, length, seq_num);
+    ssize_t send_length = sendto(sockfd, buf, sizeof(rtp_header_t) + length, 0, to, tolen);
+    if(send_length != sizeof(rtp_header_t) + length)
         return -1;
-    }
-    else if(FD_ISSET(sockfd, &wait_fd)){
-        // Receive ACK and check its checksum.
-        rtp_packet_t* recv_ack = rtp_recvfrom(sockfd, (struct sockaddr*)servaddr, addrlen);
-        if(!recv_ack){
-            // Handle wrong checksum.
+    return 0;
+}
+
+int rtp_connect(int sockfd, struct sockaddr_in* servaddr, socklen_t* addrlen, rtp_rto_t* rto, rtp_hello_t* hello, uint32_t* conn){
+    // seq_num is a random value for connection, marked to announce the extensions.
+    // rand_r keeps concurrent connects apart, mixing in the clock and this stack frame.
+    unsigned int seed = time(NULL) ^ mono_us() ^ (uintptr_t)&seed;
+    uint32_t seq = ((uint32_t)rand_r(&seed) & ~RTP_HELLO_MASK) | RTP_HELLO_MAGIC;
+    memset(hello, 0, sizeof(rtp_hello_t));
+    *conn = seq;
+
+    uint64_t start = mono_us();
+    uint64_t send_time = 0;
+    int attempts = 0;
+    fd_set wait_fd;
+    while(true){
+        // Send START packet for connection, again after each timeout.
+        uint64_t now = mono_us();
+        if(now - start >= RTP_CONNECT_TIMEOUT){
+            // Handle timeout.
+            fprintf(stderr, "[Sender] ACK timeout.\n");
             rtp_sendEND(sockfd, (struct sockaddr*)servaddr, addrlen, NULL);
             return -1;
         }
-        else if(recv_ack->rtp.type == RTP_ACK){
-            free(recv_ack);
-            return 0;
+        if(attempts > 0)
+            rtp_rtoBackoff(rto);
+        if(rtp_sendctl(sockfd, RTP_START, seq, (struct sockaddr*)servaddr, *addrlen) == -1){
+            perror("Start failure");
+            return -1;
         }
-        else{
-            free(recv_ack);
-            perror("[Sender] Weird failure");
+        send_time = now;
+        attempts++;
+
+        // Check whether ACK time out.
+        uint64_t wait = rtp_rtoTimeout(rto);
+        if(wait > RTP_CONNECT_TIMEOUT - (now - start))
+            wait = RTP_CONNECT_TIMEOUT - (now - start);
+        struct timeval timeout = {wait / 1000000, wait % 1000000};
+        FD_ZERO(&wait_fd);
+        FD_SET(sockfd, &wait_fd);
+        int res = select(sockfd + 1, &wait_fd, NULL, NULL, &timeout);
+        if(res == -1)
             return -1;
+        else if(res == 0)
+            continue;
+        else if(FD_ISSET(sockfd, &wait_fd)){
+            // Receive ACK and check its checksum.
+            char buf[RTP_ACK_SIZE] __attribute__((aligned(8)));
+            rtp_packet_t* recv_ack = (rtp_packet_t*)buf;
+            if(rtp_recv(sockfd, recv_ack, sizeof(buf), (struct sockaddr*)servaddr, addrlen) == -1){
+                // Handle wrong checksum.
+                rtp_sendEND(sockfd, (struct sockaddr*)servaddr, addrlen, NULL);
+                return -1;
+            }
+            else if(recv_ack->rtp.type == RTP_ACK){
+                // Karn's rule: an ACK of a resent START may belong to either copy.
+                if(attempts == 1)
+                    rtp_rtoSample(rto, mono_us() - send_time);
+                // A receiver speaking the extensions says which ones it supports.
+                if(recv_ack->rtp.length >= sizeof(hello->caps)){
+                    memcpy(hello, recv_ack->payload, recv_ack->rtp.length < sizeof(rtp_hello_t) ? recv_ack->rtp.length : sizeof(rtp_hello_t));
+                    hello->caps &= RTP_CAPS;
+                }
+                return 0;
+            }
+            else{
+                perror("[Sender] Weird failure");
+                return -1;
+            }
         }
     }
     return 0;
 }
 
-rtp_packet_t* rtp_recvfrom(int sockfd, struct sockaddr* from, socklen_t* fromlen){
-    rtp_packet_t* recv_pkt = malloc(sizeof(rtp_header_t) + PAYLOAD_SIZE);
-    ssize_t recv_length = recvfrom(sockfd, (void*)recv_pkt, sizeof(rtp_header_t) + PAYLOAD_SIZE, 0, from, fromlen);
-    
+int rtp_negotiate(int sockfd, const struct sockaddr_in* servaddr, uint32_t conn, rtp_rto_t* rto, rtp_options_t* options, uint32_t probe){
+    // The request, zero padded to the probe size.
+    uint32_t length = probe > sizeof(rtp_options_t) ? probe : sizeof(rtp_options_t);
+    rtp_packet_t* request = calloc(1, sizeof(rtp_header_t) + length);
+    memcpy(request->payload, options, sizeof(rtp_options_t));
+    rtp_frame(request, RTP_START, length, conn);
+
+    int retries = probe ? RTP_PROBE_RETRIES : RTP_END_RETRIES;
+    fd_set wait_fd;
+    for(int i = 0; i <= retries; i++){
+        if(i > 0)
+            rtp_rtoBackoff(rto);
+        if(sendto(sockfd, (void*)request, sizeof(rtp_header_t) + length, 0, (struct sockaddr*)servaddr, sizeof(*servaddr)) == -1){
+            // Too large for the local link is the answer to a probe.
+            if(!probe || errno != EMSGSIZE)
+                perror("Options failure");
+            free(request);
+            return -1;
+        }
+        uint64_t deadline = mono_us() + rtp_rtoTimeout(rto);
+        while(true){
+            uint64_t now = mono_us();
+            if(now >= deadline)
+                break;
+            FD_ZERO(&wait_fd);
+            FD_SET(sockfd, &wait_fd);
+            struct timeval timeout = {(deadline - now) / 1000000, (deadline - now) % 1000000};
+            int res = select(sockfd + 1, &wait_fd, NULL, NULL, &timeout);
+            if(res == -1){
+                free(request);
+                return -1;
+            }
+            else if(res == 0)
+                break;
+            char buf[RTP_ACK_SIZE] __attribute__((aligned(8)));
+            rtp_packet_t* recv_ack = (rtp_packet_t*)buf;
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            if(rtp_recv(sockfd, recv_ack, sizeof(buf), (struct sockaddr*)&from, &fromlen) == -1)
+                continue;
+            // A late ACK of the hello is shorter than any options.
+            if(recv_ack->rtp.type != RTP_ACK || recv_ack->rtp.seq_num != conn || recv_ack->rtp.length <= sizeof(rtp_hello_t))
+                continue;
+            memset(options, 0, sizeof(rtp_options_t));
+            memcpy(options, recv_ack->payload, recv_ack->rtp.length < sizeof(rtp_options_t) ? recv_ack->rtp.length : sizeof(rtp_options_t));
+            free(request);
+            return 0;
+        }
+    }
+    free(request);
+    return -1;
+}
+
+uint64_t rtp_fileIdentity(const struct stat* st){
+    // FNV-1a, any change to the file gives it a new identity, so stale data is never resumed.
+    uint64_t fields[] = {st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+    const unsigned char* bytes = (const unsigned char*)fields;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < sizeof(fields); i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash ? hash : 1;
+}
+
+ssize_t rtp_recv(int sockfd, rtp_packet_t* pkt, size_t size, struct sockaddr* from, socklen_t* fromlen){
+    ssize_t recv_length = recvfrom(sockfd, (void*)pkt, size, 0, from, fromlen);
     if(recv_length == -1){
-        free(recv_pkt);
         perror("Receive failure");
-        return NULL;
+        return -1;
     }
-    uint32_t checksum = recv_pkt->rtp.checksum;
-    recv_pkt->rtp.checksum = 0;
-    if(checksum != compute_checksum((void*)recv_pkt, recv_length)){
+    return rtp_verify(pkt, recv_length);
+}
+
+ssize_t rtp_verify(rtp_packet_t* pkt, ssize_t recv_length){
+    if(recv_length < (ssize_t)sizeof(rtp_header_t) || recv_length != sizeof(rtp_header_t) + pkt->rtp.length)
+        return -1;
+    uint32_t checksum = pkt->rtp.checksum;
+    pkt->rtp.checksum = 0;
+    uint32_t payload_crc = compute_checksum(pkt->payload, pkt->rtp.length);
+    if(checksum != crc32_combine(compute_checksum((void*)pkt, sizeof(rtp_header_t)), payload_crc, pkt->rtp.length))
         // Handle wrong checksum.
+        return -1;
+    pkt->rtp.checksum = payload_crc;
+    return recv_length;
+}
+
+rtp_packet_t* rtp_recvfrom(int sockfd, struct sockaddr* from, socklen_t* fromlen){
+    rtp_packet_t* recv_pkt = malloc(sizeof(rtp_header_t) + PAYLOAD_SIZE);
+    if(rtp_recv(sockfd, recv_pkt, sizeof(rtp_header_t) + PAYLOAD_SIZE, from, fromlen) == -1){
         free(recv_pkt);
         return NULL;
     }
-    else
-        return recv_pkt;
+    return recv_pkt;
 }
 
 void rtp_sendEND(int sockfd, struct sockaddr* to, socklen_t* tolen, rtp_sender_t* sender_control){
     uint32_t seq_next = 0;
-    if(sender_control != NULL)
+    rtp_rto_t rto;
+    rtp_rtoInit(&rto);
+    int attempts = 1;
+    rtp_digest_t digest = {0, 0};
+    uint16_t length = 0;
+    if(sender_control != NULL){
         seq_next = sender_control->seq_next;
-
-    // Send End packet.
-    rtp_packet_t* end_pkt = rtp_packet(RTP_END, 0, seq_next, NULL);
-    ssize_t end_length = sendto(sockfd, (void*)end_pkt, sizeof(rtp_header_t), 0, to, *tolen);
-    if(end_length != sizeof(rtp_header_t)){
-        free(end_pkt);
-        perror("End failure");
-        return;
+        rto = sender_control->rto;
+        attempts += RTP_END_RETRIES;
+        if(sender_control->caps & RTP_CAP_DIGEST){
+            digest.crc = sender_control->digest;
+            digest.length = sender_control->digest_length;
+            length = sizeof(digest);
+        }
     }
-    free(end_pkt);
 
+    // Send End packet.
     // Check whether ACK time out.
-    // If time out, return and close connection.
+    // If time out, back off and resend, return and close connection after the last attempt.
     // Else, check seq_num
-    
     fd_set wait_fd;
-    while(true){
-        FD_ZERO(&wait_fd);
-        FD_SET(sockfd, &wait_fd);
-        struct timeval timeout = {0, 100000}; //100ms
-        int res = select(sockfd + 1, &wait_fd, NULL, NULL, &timeout);
-        if(res == -1 || res == 0)
+    for(int i = 0; i < attempts; i++){
+        if(i > 0)
+            rtp_rtoBackoff(&rto);
+        if(rtp_sendctlPayload(sockfd, RTP_END, seq_next, &digest, length, to, *tolen) == -1){
+            perror("End failure");
             return;
-        else if(FD_ISSET(sockfd, &wait_fd)){
-            rtp_packet_t* recv_ack = rtp_recvfrom(sockfd, to, tolen);
-            if(!recv_ack)
-                continue;
-            else if(recv_ack->rtp.seq_num != seq_next){
-                free(recv_ack);
-                continue;
-            }
-            else{
-                free(recv_ack);
+        }
+        uint64_t deadline = mono_us() + rtp_rtoTimeout(&rto);
+        while(true){
+            uint64_t now = mono_us();
+            if(now >= deadline)
+                break;
+            FD_ZERO(&wait_fd);
+            FD_SET(sockfd, &wait_fd);
+            struct timeval timeout = {(deadline - now) / 1000000, (deadline - now) % 1000000};
+            int res = select(sockfd + 1, &wait_fd, NULL, NULL, &timeout);
+            if(res == -1)
+                return;
+            else if(res == 0)
                 break;
+            else if(FD_ISSET(sockfd, &wait_fd)){
+                char buf[RTP_ACK_SIZE] __attribute__((aligned(8)));
+                rtp_packet_t* recv_ack = (rtp_packet_t*)buf;
+                if(rtp_recv(sockfd, recv_ack, sizeof(buf), to, tolen) == -1)
+                    continue;
+                else if(recv_ack->rtp.type != RTP_ACK || recv_ack->rtp.length != 0 || recv_ack->rtp.seq_num != seq_next)
+                    continue;
+                else
+                    return;
             }
         }
     }
@@ -144,10 +328,33 @@ void rtp_freeSenderControl(rtp_sender_t* sender_control){
                 free(sender_control->send_buf[i]);
         free(sender_control->send_buf);
     }
+    if(sender_control->send_header)
+        free(sender_control->send_header);
+    if(sender_control->send_data)
+        free(sender_control->send_data);
     if(sender_control->send_ack)
         free(sender_control->send_ack);
+    if(sender_control->send_time)
+        free(sender_control->send_time);
+    if(sender_control->send_count)
+        free(sender_control->send_count);
+    rtp_freeWheel(sender_control->timer);
     if(sender_control->send_length)
         free(sender_control->send_length);
+    rtp_freeBatch(sender_control->send_batch);
+    rtp_freeBatch(sender_control->ack_batch);
+    if(sender_control->ack_buf)
+        free(sender_control->ack_buf);
+    free(sender_control->write_buf);
+    rtp_fecFree(&sender_control->fec);
+    free(sender_control->fec_buf);
+    free(sender_control->fec_end);
+    free(sender_control->lz);
+    if(sender_control->lz_buf){
+        for(uint32_t i = 0; i < sender_control->window_size; i++)
+            free(sender_control->lz_buf[i]);
+        free(sender_control->lz_buf);
+    }
     free(sender_control);
 }
 
@@ -159,9 +366,419 @@ void rtp_freeReceiverControl(rtp_receiver_t* receiver_control){
                 free(receiver_control->recv_buf[i]);
         free(receiver_control->recv_buf);
     }
-    if(receiver_control->recv_ack)
-        free(receiver_control->recv_ack);
+    if(receiver_control->recv_map)
+        free(receiver_control->recv_map);
     if(receiver_control->recv_length)
         free(receiver_control->recv_length);
+    free(receiver_control->recv_crc);
+    if(receiver_control->recv_batch){
+        for(uint32_t i = 0; i < receiver_control->recv_batch->count; i++)
+            free(rtp_batchBuffer(receiver_control->recv_batch, i));
+        rtp_freeBatch(receiver_control->recv_batch);
+    }
+    rtp_freeBatch(receiver_control->ack_batch);
+    if(receiver_control->ack_buf)
+        free(receiver_control->ack_buf);
+    free(receiver_control->read_buf);
+    free(receiver_control->fec_spare);
+    free(receiver_control->lz_spare);
     free(receiver_control);
-}
\ No newline at end of file
+}
+
+rtp_session_t* rtp_createSession(uint32_t window_size){
+    rtp_session_t* session = calloc(1, sizeof(rtp_session_t));
+    session->fd = -1;
+    session->window_size = window_size;
+    session->cc_ops = &rtp_cc_newreno;
+    session->stripes = 1;
+    session->payload_size = PAYLOAD_SIZE;
+    session->pacing = false;
+    session->offload = true;
+    session->ack_every = RTP_ACK_EVERY;
+    session->ack_delay = RTP_ACK_DELAY;
+    return session;
+}
+
+void rtp_sessionClose(rtp_session_t* session){
+    if(!session) return;
+    if(session->sender){
+        socklen_t len = sizeof(session->addr);
+        rtp_sendEND(session->fd, (struct sockaddr*)&session->addr, &len, session->sender);
+        rtp_freeSenderControl(session->sender);
+    }
+    rtp_freeReceiverControl(session->receiver);
+    if(session->fd != -1)
+        close(session->fd);
+    free(session);
+}
+
+int rtp_sessionSetCongestionControl(rtp_session_t* session, const char* name){
+    const rtp_cc_ops_t* ops = rtp_ccFind(name);
+    if(!ops)
+        return -1;
+    session->cc_ops = ops;
+    return 0;
+}
+
+const rtp_cc_t* rtp_sessionCongestionState(const rtp_session_t* session){
+    return session && session->sender ? &session->sender->cc : NULL;
+}
+
+void rtp_sessionSetDirectWrite(rtp_session_t* session, int enable){
+    session->direct_write = enable != 0;
+}
+
+void rtp_sessionSetStripes(rtp_session_t* session, uint32_t count){
+    session->stripes = count ? count : 1;
+}
+
+void rtp_sessionSetPacing(rtp_session_t* session, int enable, uint64_t rate, int txtime){
+    session->pacing = enable != 0;
+    session->pace_rate = rate;
+    session->txtime = txtime != 0;
+}
+
+void rtp_sessionSetPayloadSize(rtp_session_t* session, uint32_t size){
+    session->payload_size = size > RTP_MAX_PAYLOAD ? RTP_MAX_PAYLOAD : size;
+}
+
+void rtp_sessionSetOffload(rtp_session_t* session, int enable){
+    session->offload = enable != 0;
+}
+
+void rtp_sessionSetFEC(rtp_session_t* session, int enable, uint32_t group){
+    session->fec = enable != 0;
+    session->fec_group = group;
+}
+
+void rtp_sessionSetCompression(rtp_session_t* session, int enable){
+    session->compress = enable != 0;
+}
+
+void rtp_sessionSetResume(rtp_session_t* session, int enable){
+    session->resume = enable != 0;
+}
+
+void rtp_sessionSetDelta(rtp_session_t* session, int enable){
+    session->delta = enable != 0;
+}
+
+void rtp_sessionSetAckPolicy(rtp_session_t* session, uint32_t every, uint32_t delay_us){
+    session->ack_every = every ? every : 1;
+    session->ack_delay = delay_us;
+}
+
+// Coalesced datagrams of UDP_GRO, handed out one segment at a time.
+struct RTP_gro{
+    char* buf;             // RTP_GRO_BUFS buffers of RTP_GRO_SIZE bytes
+    struct mmsghdr msgs[RTP_GRO_BUFS];
+    struct iovec iovs[RTP_GRO_BUFS];
+    char cmsgs[RTP_GRO_BUFS][CMSG_SPACE(sizeof(int))];
+    struct sockaddr_in from[RTP_GRO_BUFS];
+    uint32_t count;        // Datagrams received into buf
+    uint32_t index;        // Datagram being split
+    uint32_t offset;       // Offset of its next segment
+};
+
+rtp_batch_t* rtp_createBatch(uint32_t capacity){
+    rtp_batch_t* batch = malloc(sizeof(rtp_batch_t));
+    batch->capacity = capacity;
+    batch->count = 0;
+    batch->msgs = calloc(capacity, sizeof(struct mmsghdr));
+    batch->iovs = calloc(capacity * RTP_BATCH_IOV, sizeof(struct iovec));
+    batch->cmsgs = calloc(capacity, CMSG_SPACE(sizeof(uint64_t)));
+    batch->gso = false;
+    batch->gso_msgs = NULL;
+    batch->gso_first = NULL;
+    batch->gro = NULL;
+    for(uint32_t i = 0; i < capacity; i++)
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i * RTP_BATCH_IOV];
+    return batch;
+}
+
+void rtp_freeBatch(rtp_batch_t* batch){
+    if(!batch) return;
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->cmsgs);
+    free(batch->gso_msgs);
+    free(batch->gso_first);
+    if(batch->gro)
+        free(batch->gro->buf);
+    free(batch->gro);
+    free(batch);
+}
+
+int rtp_batchPush(rtp_batch_t* batch, void* buf, size_t len){
+    if(batch->count == batch->capacity)
+        return -1;
+    struct msghdr* hdr = &batch->msgs[batch->count].msg_hdr;
+    hdr->msg_iov[0].iov_base = buf;
+    hdr->msg_iov[0].iov_len = len;
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = NULL;
+    hdr->msg_controllen = 0;
+    batch->count++;
+    return 0;
+}
+
+int rtp_batchPushPkt(rtp_batch_t* batch, rtp_header_t* header, const char* payload){
+    if(batch->count == batch->capacity)
+        return -1;
+    struct msghdr* hdr = &batch->msgs[batch->count].msg_hdr;
+    hdr->msg_iov[0].iov_base = header;
+    hdr->msg_iov[0].iov_len = sizeof(rtp_header_t);
+    hdr->msg_iov[1].iov_base = (void*)payload;
+    hdr->msg_iov[1].iov_len = header->length;
+    hdr->msg_iovlen = header->length ? 2 : 1;
+    hdr->msg_control = NULL;
+    hdr->msg_controllen = 0;
+    batch->count++;
+    return 0;
+}
+
+void rtp_batchTxtime(rtp_batch_t* batch, uint64_t txtime_us){
+    struct msghdr* hdr = &batch->msgs[batch->count - 1].msg_hdr;
+    hdr->msg_control = batch->cmsgs + (batch->count - 1) * CMSG_SPACE(sizeof(uint64_t));
+    hdr->msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    uint64_t txtime_ns = txtime_us * 1000;
+    memcpy(CMSG_DATA(cmsg), &txtime_ns, sizeof(txtime_ns));
+}
+
+int rtp_enableGSO(int sockfd, rtp_batch_t* batch){
+    // A default segment size of 0 only checks that the kernel knows UDP_SEGMENT.
+    int size = 0;
+    if(setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == -1)
+        return -1;
+    if(!batch->gso_msgs){
+        batch->gso_msgs = calloc(batch->capacity, sizeof(struct mmsghdr));
+        batch->gso_first = calloc(batch->capacity, sizeof(uint32_t));
+    }
+    batch->gso = true;
+    return 0;
+}
+
+int rtp_enableGRO(int sockfd, rtp_batch_t* batch){
+    int enable = 1;
+    if(setsockopt(sockfd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == -1)
+        return -1;
+    if(batch->gro)
+        return 0;
+    struct RTP_gro* gro = calloc(1, sizeof(struct RTP_gro));
+    gro->buf = malloc((size_t)RTP_GRO_BUFS * RTP_GRO_SIZE);
+    for(uint32_t i = 0; i < RTP_GRO_BUFS; i++){
+        gro->iovs[i].iov_base = gro->buf + (size_t)i * RTP_GRO_SIZE;
+        gro->iovs[i].iov_len = RTP_GRO_SIZE;
+        gro->msgs[i].msg_hdr.msg_iov = &gro->iovs[i];
+        gro->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    batch->gro = gro;
+    return 0;
+}
+
+bool rtp_batchPending(const rtp_batch_t* batch){
+    return batch->gro && batch->gro->index < batch->gro->count;
+}
+
+static size_t msg_bytes(const struct msghdr* hdr){
+    size_t bytes = 0;
+    for(size_t i = 0; i < hdr->msg_iovlen; i++)
+        bytes += hdr->msg_iov[i].iov_len;
+    return bytes;
+}
+
+/**
+ * @brief Send queued datagrams, each run of equal pkts as one super-datagram the kernel cuts at the pkt size.
+ * Only the last datagram of a run may be shorter. Iovecs of consecutive datagrams are adjacent,
+ * so a run is gathered in place. Datagrams stamped with a departure time go alone.
+ * @return Number of datagrams sent, fewer than batch->count if the kernel refused segmentation; -1 means failure
+*/
+static int send_segmented(int sockfd, rtp_batch_t* batch, const struct sockaddr* to, socklen_t tolen){
+    uint32_t runs = 0;
+    for(uint32_t i = 0; i < batch->count; runs++){
+        struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+        size_t segment = msg_bytes(hdr);
+        size_t total = segment;
+        uint32_t j = i + 1;
+        while(hdr->msg_iovlen == RTP_BATCH_IOV && !hdr->msg_control && j < batch->count && j - i < RTP_GSO_SEGMENTS){
+            struct msghdr* next = &batch->msgs[j].msg_hdr;
+            size_t length = msg_bytes(next);
+            if(next->msg_iovlen != RTP_BATCH_IOV || next->msg_control || length > segment || total + length > RTP_GSO_BYTES)
+                break;
+            total += length;
+            j++;
+            if(length < segment)
+                break;
+        }
+
+        struct msghdr* run = &batch->gso_msgs[runs].msg_hdr;
+        *run = *hdr;
+        run->msg_name = (void*)to;
+        run->msg_namelen = tolen;
+        if(j - i > 1){
+            run->msg_iovlen = (j - i) * RTP_BATCH_IOV;
+            run->msg_control = batch->cmsgs + i * CMSG_SPACE(sizeof(uint64_t));
+            run->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(run);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t size = segment;
+            memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        }
+        batch->gso_first[runs] = i;
+        i = j;
+    }
+
+    uint32_t sent = 0;
+    while(sent < runs){
+        int res = sendmmsg(sockfd, batch->gso_msgs + sent, runs - sent, 0);
+        if(res == -1){
+            if(errno == EINTR)
+                continue;
+            // No segmentation on this route or device, e.g. pkts beyond its MTU.
+            if(errno == EINVAL || errno == EIO || errno == EOPNOTSUPP){
+                batch->gso = false;
+                return batch->gso_first[sent];
+            }
+            return -1;
+        }
+        sent += res;
+    }
+    return batch->count;
+}
+
+int rtp_sendBatch(int sockfd, rtp_batch_t* batch, const struct sockaddr* to, socklen_t tolen){
+    uint32_t sent = 0;
+    if(batch->gso){
+        int res = send_segmented(sockfd, batch, to, tolen);
+        if(res == -1){
+            batch->count = 0;
+            return -1;
+        }
+        sent = res;
+    }
+    for(uint32_t i = sent; i < batch->count; i++){
+        batch->msgs[i].msg_hdr.msg_name = (void*)to;
+        batch->msgs[i].msg_hdr.msg_namelen = tolen;
+    }
+    while(sent < batch->count){
+        int res = sendmmsg(sockfd, batch->msgs + sent, batch->count - sent, 0);
+        if(res == -1){
+            if(errno == EINTR)
+                continue;
+            batch->count = 0;
+            return -1;
+        }
+        sent += res;
+    }
+    batch->count = 0;
+    return 0;
+}
+
+/**
+ * @brief Receive coalesced datagrams and split them into the posted buffers of batch.
+ * Segments that do not fit stay for the next call, see rtp_batchPending.
+ * @return Number of datagrams received, -1 means failure
+*/
+static int recv_coalesced(int sockfd, rtp_batch_t* batch){
+    struct RTP_gro* gro = batch->gro;
+    uint32_t n = 0;
+    while(n < batch->count){
+        if(gro->index == gro->count){
+            for(uint32_t i = 0; i < RTP_GRO_BUFS; i++){
+                struct msghdr* hdr = &gro->msgs[i].msg_hdr;
+                hdr->msg_name = &gro->from[i];
+                hdr->msg_namelen = sizeof(struct sockaddr_in);
+                hdr->msg_control = gro->cmsgs[i];
+                hdr->msg_controllen = sizeof(gro->cmsgs[i]);
+                hdr->msg_flags = 0;
+            }
+            gro->count = gro->index = gro->offset = 0;
+            int res = recvmmsg(sockfd, gro->msgs, RTP_GRO_BUFS, MSG_DONTWAIT, NULL);
+            if(res == -1){
+                if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    break;
+                perror("Receive failure");
+                return -1;
+            }
+            if(res == 0)
+                break;
+            gro->count = res;
+        }
+
+        // Segment size of a coalesced datagram, the whole datagram otherwise.
+        struct msghdr* hdr = &gro->msgs[gro->index].msg_hdr;
+        uint32_t length = gro->msgs[gro->index].msg_len;
+        uint32_t segment = length;
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+            if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO){
+                int size;
+                memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                if(size > 0)
+                    segment = size;
+            }
+
+        const char* data = gro->iovs[gro->index].iov_base;
+        while(n < batch->count && gro->offset < length){
+            uint32_t size = length - gro->offset < segment ? length - gro->offset : segment;
+            struct msghdr* out = &batch->msgs[n].msg_hdr;
+            // A segment larger than the buffer fails verification.
+            batch->msgs[n].msg_len = size <= out->msg_iov[0].iov_len ? size : 0;
+            memcpy(out->msg_iov[0].iov_base, data + gro->offset, batch->msgs[n].msg_len);
+            if(out->msg_name){
+                memcpy(out->msg_name, &gro->from[gro->index], sizeof(struct sockaddr_in));
+                out->msg_namelen = sizeof(struct sockaddr_in);
+            }
+            gro->offset += size;
+            n++;
+        }
+        if(gro->offset >= length){
+            gro->index++;
+            gro->offset = 0;
+        }
+    }
+    return n;
+}
+
+static int recv_batch(int sockfd, rtp_batch_t* batch){
+    if(batch->gro)
+        return recv_coalesced(sockfd, batch);
+    for(uint32_t i = 0; i < batch->count; i++)
+        batch->msgs[i].msg_len = 0;
+    int res = recvmmsg(sockfd, batch->msgs, batch->count, MSG_DONTWAIT, NULL);
+    if(res == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        perror("Receive failure");
+        return -1;
+    }
+    return res;
+}
+
+int rtp_recvBatch(int sockfd, rtp_batch_t* batch, struct sockaddr* from, socklen_t* fromlen){
+    for(uint32_t i = 0; i < batch->count; i++){
+        batch->msgs[i].msg_hdr.msg_name = from;
+        batch->msgs[i].msg_hdr.msg_namelen = *fromlen;
+    }
+    int res = recv_batch(sockfd, batch);
+    if(res > 0)
+        *fromlen = batch->msgs[res - 1].msg_hdr.msg_namelen;
+    return res;
+}
+
+int rtp_recvBatchFrom(int sockfd, rtp_batch_t* batch, struct sockaddr_in* from){
+    for(uint32_t i = 0; i < batch->count; i++){
+        batch->msgs[i].msg_hdr.msg_name = &from[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    return recv_batch(sockfd, batch);
+}
+
+ssize_t rtp_batchVerify(rtp_batch_t* batch, uint32_t index){
+    return rtp_verify((rtp_packet_t*)rtp_batchBuffer(batch, index), batch->msgs[index].msg_len);
+}
@@ -5,7 +5,17 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include "wheel.h"
+#include "cc.h"
+#include "pace.h"
+#include "fec.h"
+#include "lz.h"
+#include "delta.h"
+#include "session.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,12 +25,57 @@ extern "C" {
 #define RTP_END   1
 #define RTP_DATA  2
 #define RTP_ACK   3
+#define RTP_FEC   4                 // Parity of a group of DATA pkts, only sent to receivers announcing RTP_CAP_FEC
+#define RTP_LZ    5                 // DATA pkt whose payload is compressed by rtp_lzCompress, only sent to receivers announcing RTP_CAP_LZ
+#define RTP_SIG   6                 // Block signatures of the receiver's old file: asked for by the sender, answered by the receiver
 
-#define PAYLOAD_SIZE 1461
+#define PAYLOAD_SIZE 1461           // Payload of full DATA pkts unless a size was negotiated
+#define RTP_MAX_PAYLOAD 65496       // Largest payload of a UDP/IPv4 datagram
+#define RTP_JUMBO_PAYLOAD 8961      // Payload filling a 9000-byte jumbo frame
+#define RTP_WIRE_OVERHEAD 39        // IPv4, UDP and RTP headers of every pkt
+
+// Extensions are only used between peers that both announce them: our sender marks the
+// START seq_num with RTP_HELLO_MAGIC, our receiver answers with an ACK carrying rtp_hello_t.
+// Other peers see plain zero-length START and ACK.
+#define RTP_HELLO_MASK  0xFF000000u
+#define RTP_HELLO_MAGIC 0xA5000000u
+#define RTP_CAP_SACK    0x1         // ACK seq_num is cumulative, payload is a bitmap of pkts received beyond it
+#define RTP_CAP_OPTIONS 0x2         // Receiver takes a START carrying rtp_options_t after the hello
+#define RTP_CAP_STRIPE  0x4         // Receiver joins stripes of one file sent over several flows
+#define RTP_CAP_FEC     0x8         // Receiver rebuilds a lost DATA pkt from an RTP_FEC pkt
+#define RTP_CAP_LZ      0x10        // Receiver decompresses RTP_LZ pkts
+#define RTP_CAP_DIGEST  0x20        // Receiver checks the rtp_digest_t carried by END
+#define RTP_CAPS (RTP_CAP_SACK | RTP_CAP_OPTIONS | RTP_CAP_STRIPE | RTP_CAP_FEC | RTP_CAP_LZ | RTP_CAP_DIGEST) // Extensions implemented here
+
+#define RTP_OPT_STRIPE  0x1         // The flow carries one byte range of a striped file
+#define RTP_OPT_PAYLOAD 0x2         // DATA pkts carry up to payload bytes instead of PAYLOAD_SIZE
+#define RTP_OPT_RESUME  0x4         // The receiver checkpoints the file, DATA starts at resume bytes into it
+#define RTP_OPT_DELTA   0x8         // DATA carries a delta against the receiver's old file of basis bytes, see delta.h
+
+#define RTP_SACK_BYTES 256          // Max SACK bitmap, covering 2048 pkts past the cumulative ACK
+#define RTP_ACK_SIZE (sizeof(rtp_header_t) + RTP_SACK_BYTES) // Buffer size of one ACK
+#define RTP_PKT_ROOM(payload) (sizeof(rtp_header_t) + sizeof(rtp_parity_t) + (payload)) // Buffer of a received DATA or RTP_FEC pkt
+
+#define RTP_RTO_INIT 100000         // RTO before any RTT sample in us
+#define RTP_RTO_MIN  10000          // Lower bound of RTO in us
+#define RTP_RTO_MAX  10000000       // Upper bound of RTO in us
+#define RTP_CONNECT_TIMEOUT 10000000 // Give up connecting after this many us
+#define RTP_END_RETRIES 4           // END retransmissions before giving up
+#define RTP_PROBE_RETRIES 1         // Retransmissions of a path MTU probe before trying a smaller size
+
+#define RTP_ACK_EVERY 2             // Default ACK coalescing: one ACK per this many in-order pkts
+#define RTP_ACK_DELAY 1000          // Default longest delay of a pending ACK in us
+
+#define RTP_BATCH_SIZE 64   // Max datagrams moved by one sendmmsg/recvmmsg
+#define RTP_BATCH_IOV  2    // Iovecs per datagram: header and payload
+#define RTP_GSO_SEGMENTS 64 // Most datagrams cut from one UDP_SEGMENT send
+#define RTP_GSO_BYTES 65507 // Most bytes of one UDP_SEGMENT send, a UDP/IPv4 datagram at most
+#define RTP_GRO_BUFS 8      // Coalesced datagrams taken by one recvmmsg with UDP_GRO
+#define RTP_GRO_SIZE 65536  // Room of one coalesced datagram
 
 typedef struct __attribute__ ((__packed__)) RTP_header {
-    uint8_t type;       // 0: START; 1: END; 2: DATA; 3: ACK
-    uint16_t length;    // Length of data; 0 for ACK, START and END packets
+    uint8_t type;       // 0: START; 1: END; 2: DATA; 3: ACK; 4: FEC; 5: LZ; 6: SIG
+    uint16_t length;    // Length of data; 0 for ACK, START and END packets unless an extension adds a payload
     uint32_t seq_num;
     uint32_t checksum;  // 32-bit CRC
 } rtp_header_t;
@@ -31,33 +86,246 @@ typedef struct __attribute__ ((__packed__)) RTP_packet {
     char payload[];
 } rtp_packet_t;
 
+// Payload of the ACK answering a marked START.
+typedef struct __attribute__ ((__packed__)) RTP_hello {
+    uint32_t caps;      // RTP_CAP_* the receiver supports
+    uint32_t max_payload;  // Largest DATA payload the receiver takes, 0 for PAYLOAD_SIZE
+} rtp_hello_t;
+
+// Payload of the START a sender sends after the hello to set options, and of the ACK
+// answering it with the options the receiver agreed to. Fields are only ever appended,
+// peers read the part both of them know.
+typedef struct __attribute__ ((__packed__)) RTP_options {
+    uint32_t flags;     // RTP_OPT_* requested or agreed
+    uint64_t transfer;  // Id shared by the stripes of one file
+    uint64_t offset;    // File offset of this stripe
+    uint64_t total;     // File size
+    uint16_t stripe;    // Index of this stripe
+    uint16_t stripes;   // Number of stripes
+    uint32_t payload;   // Payload of full DATA pkts
+    uint64_t file;      // Identity of the file, the same for every transfer of an unchanged file
+    uint64_t resume;    // Bytes from the start of the file the receiver already has
+    uint64_t basis;     // Size of the receiver's old file
+    uint32_t block;     // Block size of its signatures
+} rtp_options_t;
+
+// Payload of END to a receiver announcing RTP_CAP_DIGEST: CRC-32 of every byte the receiver writes
+// for the connection, combined from per-pkt CRCs in seq_num order, or of the file a delta rebuilds.
+typedef struct __attribute__ ((__packed__)) RTP_digest {
+    uint32_t crc;
+    uint64_t length;
+} rtp_digest_t;
+
+// Payload of an RTP_SIG pkt asking for signatures of blocks [seq_num, seq_num + count).
+// The answer is RTP_SIG pkts of as many rtp_signature_t as fit a payload, seq_num the first block of each.
+typedef struct __attribute__ ((__packed__)) RTP_sig_request {
+    uint32_t count;
+} rtp_sig_request_t;
+
+// Datagrams for one sendmmsg/recvmmsg call, RTP_BATCH_IOV iovecs per datagram.
+typedef struct RTP_batch{
+    uint32_t capacity;     // Max number of datagrams
+    uint32_t count;        // Number of queued datagrams or posted buffers
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    char* cmsgs;           // Room for one SCM_TXTIME or UDP_SEGMENT control message per datagram
+    bool gso;              // Send runs of equal-size datagrams as one UDP_SEGMENT send each
+    struct mmsghdr* gso_msgs;  // Super-datagrams of a send, capacity of them
+    uint32_t* gso_first;   // Index of the first datagram in each super-datagram
+    struct RTP_gro* gro;   // Datagrams coalesced by UDP_GRO and not split yet, NULL without GRO
+} rtp_batch_t;
+
+// Retransmission timeout estimated from RTT samples as in RFC 6298.
+typedef struct RTP_rto{
+    uint64_t srtt;         // Smoothed RTT in us, 0 before the first sample
+    uint64_t rttvar;       // RTT variation in us
+    uint64_t rto;          // Timeout in us without backoff
+    uint32_t backoff;      // Timeouts since the last RTT sample or window progress
+} rtp_rto_t;
+
+// Caches below are ring buffers: pkt seq is kept in slot seq % window_size.
 typedef struct RTP_sender{
-    int seq_base;          // First pkt waiting for ACK
-    int seq_next;          // Next pkt to be sent
+    uint32_t seq_base;     // First pkt waiting for ACK
+    uint32_t seq_next;     // Next pkt to be sent
+    uint32_t seq_resend;   // Next cached pkt to resend after a Go-Back-N timeout, seq_next if none
+    uint32_t dup_acks;     // Duplicate cumulative ACKs of seq_base
     uint32_t window_size;
-    char** send_buf;       // Pkt cache
-    size_t* send_length;   // Pkt length in cache
+    rtp_header_t* send_header; // Framed header of each cached pkt
+    const char** send_data;    // Payload of each cached pkt, in file mapping or send_buf
+    char** send_buf;       // Payload copies, only allocated when file cannot be mapped
+    size_t* send_length;   // Payload length in cache
     size_t* send_ack;      // 1 for acked pkt
+    uint64_t* send_time;   // Time of last transmission in us
+    uint32_t* send_count;  // Transmissions of cached pkt, RTT is only sampled when 1
+    rtp_wheel_t* timer;    // Retransmission timer of each slot
+    uint32_t caps;         // Extensions agreed with the receiver
+    uint32_t payload_size; // Payload of full DATA pkts
+    rtp_rto_t rto;
+    rtp_cc_t cc;           // Congestion window, never above window_size
+    rtp_pacer_t pacer;     // Spreads sends over time when the session paces
+    bool txtime;           // Departure times are handed to the kernel instead of waiting for tokens
+    rtp_batch_t* send_batch;  // Pkts queued for one sendmmsg
+    rtp_batch_t* ack_batch;   // ACK buffers posted for one recvmmsg
+    char* ack_buf;            // Storage of posted ACK buffers, RTP_ACK_SIZE each
+    char* write_buf;       // Bytes of rtp_write short of a full pkt, NULL before the stream starts
+    uint32_t write_length;
+    rtp_fec_t fec;         // Parity of new pkts, fec.parity is NULL without FEC
+    uint32_t* fec_end;     // seq_num past the parity group of each cached pkt, 0 until its parity pkt is sent
+    char* fec_buf;         // Parity pkts queued in send_batch
+    uint32_t fec_queued;
+    rtp_lz_t* lz;          // Compressor of new pkts, NULL without compression
+    char** lz_buf;         // Compressed payload of each cached pkt sent as RTP_LZ, allocated on first use
+    uint32_t lz_skip;      // New pkts still sent raw after incompressible ones
+    uint32_t lz_backoff;   // Pkts to skip after the next incompressible one
+    uint32_t digest;       // CRC-32 of the data taken into the window so far, sent in END
+    uint64_t digest_length;
 } rtp_sender_t;
 
 typedef struct RTP_receiver{
-    int seq_next;          // Next expected pkt seq_num
+    uint32_t seq_next;     // Next expected pkt seq_num
     uint32_t window_size;
-    char** recv_buf;       // Pkt cache
-    size_t* recv_length;   // Pkt length in cache
-    size_t* recv_ack;      // 1 for acked pkt
+    char** recv_buf;       // Pkt cache, each slot is a received rtp_packet_t, allocated on first use
+    size_t* recv_length;   // Payload length in cache
+    uint32_t* recv_crc;    // CRC-32 of each payload in cache, whether the pkt is kept or already placed
+    uint32_t seq_high;     // Largest seq_num received plus one
+    uint32_t caps;         // Extensions agreed with the sender
+    uint32_t payload_size; // Payload of full DATA pkts, as negotiated
+    uint32_t max_payload;  // Payload room of every pkt buffer
+    uint64_t* recv_map;    // Bitmap of slots holding a received pkt
+    uint32_t ack_pending;  // In-order pkts not acknowledged yet
+    uint64_t ack_deadline; // Monotonic time the pending ACK is due in us, 0 if none
+    rtp_batch_t* recv_batch;  // Spare pkt buffers posted for one recvmmsg
+    rtp_batch_t* ack_batch;   // ACKs queued for one sendmmsg
+    char* ack_buf;            // Storage of queued ACKs, RTP_ACK_SIZE each
+    char* read_buf;        // Data delivered in order to rtp_read, [read_begin, read_end) not read yet
+    size_t read_size;
+    size_t read_begin;
+    size_t read_end;
+    bool read_eof;         // The stream ended, rtp_read returns 0 once read_buf is empty
+    bool fec_seen;         // The sender sends parity, so placed pkts are kept for repairs too
+    char* fec_spare;       // Buffer a lost pkt is rebuilt in
+    char* lz_spare;        // Buffer an RTP_LZ pkt is decompressed in
+    uint32_t digest;       // CRC-32 of the data written in order so far, checked against END
+    uint64_t digest_length;
 } rtp_receiver_t;
 
+// One transfer endpoint behind the opaque handle of session.h.
+// initSender and initReceiver keep one each.
+struct RTP_session{
+    int fd;                // UDP socket, -1 before connect or accept
+    struct sockaddr_in addr;  // Peer's address
+    uint32_t window_size;
+    rtp_sender_t* sender;     // Set by rtp_sessionConnect
+    rtp_receiver_t* receiver; // Set by rtp_sessionAccept
+    uint32_t conn;         // seq_num of START
+    const rtp_cc_ops_t* cc_ops;  // Congestion control of sends
+    uint32_t stripes;      // Flows a file is split over when the receiver can join them
+    uint32_t payload_size; // Sender: payload asked for, 0 to probe the path. Receiver: largest payload taken
+    bool pacing;           // Pace sends with a token bucket
+    uint64_t pace_rate;    // Bytes per second, 0 to follow cwnd over srtt
+    bool txtime;           // Let the kernel (fq qdisc) release pkts at their departure times
+    bool offload;          // UDP GSO on sends and GRO on receives where the kernel has them
+    bool fec;              // Send parity pkts to receivers that can repair with them
+    uint32_t fec_group;    // DATA pkts per parity pkt, 0 to follow the loss rate
+    bool compress;         // Compress pkts to receivers that can decompress them
+    bool resume;           // Sender: skip what the receiver kept of the file. Receiver: checkpoint files to resume
+    bool delta;            // Sender: send a delta against the receiver's old file. Receiver: offer old files for deltas
+    bool direct_write;     // Place received pkts at their file offsets
+    uint32_t ack_every;    // Coalesce ACKs of in-order pkts received
+    uint32_t ack_delay;
+};
+
+/**
+ * @brief Map a sequence number to its slot in a window ring buffer
+ * @param seq_num Sequence number of pkt
+ * @param window_size Number of slots in the ring
+ * @return Index of the slot holding seq_num
+*/
+static inline uint32_t rtp_slot(uint32_t seq_num, uint32_t window_size){
+    return seq_num % window_size;
+}
+
+/**
+ * @brief Number of 64-bit words in a bitmap of n bits
+*/
+static inline size_t rtp_bitmapWords(uint32_t n){
+    return (n + 63) / 64;
+}
+
+static inline int rtp_testBit(const uint64_t* map, uint32_t i){
+    return (map[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void rtp_setBit(uint64_t* map, uint32_t i){
+    map[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static inline void rtp_clearBit(uint64_t* map, uint32_t i){
+    map[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+/**
+ * @brief Reset RTO estimation to its initial state
+ * @param rto RTO estimator
+*/
+void rtp_rtoInit(rtp_rto_t* rto);
+
+/**
+ * @brief Update SRTT, RTTVAR and RTO with a new RTT sample and clear backoff.
+ * Only feed RTT of pkts sent once (Karn's rule).
+ * @param rto RTO estimator
+ * @param rtt Measured RTT in us
+*/
+void rtp_rtoSample(rtp_rto_t* rto, uint64_t rtt);
+
+/**
+ * @brief Double RTO after a retransmission timeout, up to RTP_RTO_MAX
+ * @param rto RTO estimator
+*/
+void rtp_rtoBackoff(rtp_rto_t* rto);
+
+/**
+ * @brief Current retransmission timeout with backoff applied
+ * @param rto RTO estimator
+ * @return Timeout in us
+*/
+uint64_t rtp_rtoTimeout(const rtp_rto_t* rto);
+
 /**
  * @brief Build RTP connection
+ * START is retransmitted with backoff until ACKed or RTP_CONNECT_TIMEOUT passes.
  * @author Sheng Lin
  * @param sockfd Sender's socket fd
  * @param servaddr Receiver's address
  * @param addrlen A pointer to address length
+ * @param rto RTO estimator, fed with the handshake RTT
+ * @param hello Set to the caps and max_payload the receiver announced, all zero for a plain receiver
+ * @param conn Set to seq_num of START, which identifies the connection
  * @return -1 means failure, 0 means success
  * @cite https://www.man7.org/linux/man-pages/man3/FD_SET.3.html
 */
-int rtp_connect(int sockfd, struct sockaddr_in* servaddr, socklen_t* addrlen);
+int rtp_connect(int sockfd, struct sockaddr_in* servaddr, socklen_t* addrlen, rtp_rto_t* rto, rtp_hello_t* hello, uint32_t* conn);
+
+/**
+ * @brief Ask a receiver announcing RTP_CAP_OPTIONS for options, resending with backoff up to RTP_END_RETRIES times
+ * Options the request leaves out keep the values agreed before.
+ * @param sockfd Sender's socket fd
+ * @param servaddr Receiver's address
+ * @param conn seq_num of the connection's START
+ * @param rto RTO estimator
+ * @param options Options requested, replaced by the options agreed
+ * @param probe Pad the request to this payload size to find out whether the path carries it, giving up after
+ * RTP_PROBE_RETRIES retransmissions or when the datagram does not fit the local link. 0 for no padding
+ * @return -1 means failure, 0 means success
+*/
+int rtp_negotiate(int sockfd, const struct sockaddr_in* servaddr, uint32_t conn, rtp_rto_t* rto, rtp_options_t* options, uint32_t probe);
+
+/**
+ * @brief Identity of a file as a resumable sender gives it, from its device, inode, size and mtime
+ * Server sessions name a resumed file after it, as %016llx.
+ * @return Nonzero identity
+*/
+uint64_t rtp_fileIdentity(const struct stat* st);
 
 /**
  * @brief Create a RTP packet of specific type
@@ -71,6 +339,71 @@ int rtp_connect(int sockfd, struct sockaddr_in* servaddr, socklen_t* addrlen);
 */
 rtp_packet_t* rtp_packet(uint8_t type, uint16_t length, uint32_t seq_num, char* message);
 
+/**
+ * @brief Fill the header of a packet whose payload is already in place and compute its checksum
+ * @param pkt Packet buffer holding at least sizeof(rtp_header_t) + length bytes
+ * @param type RTP segment type
+ * @param length RTP message length
+ * @param seq_num RTP sequence number
+*/
+void rtp_frame(rtp_packet_t* pkt, uint8_t type, uint16_t length, uint32_t seq_num);
+
+/**
+ * @brief Fill a header for a payload stored elsewhere and compute the checksum over both
+ * The payload is summed on its own and combined with the header, so its CRC comes for free.
+ * @param header Header to be filled
+ * @param type RTP segment type
+ * @param length RTP message length
+ * @param seq_num RTP sequence number
+ * @param payload Payload of length bytes, not necessarily adjacent to header
+ * @return CRC-32 of the payload alone
+*/
+uint32_t rtp_frameHeader(rtp_header_t* header, uint8_t type, uint16_t length, uint32_t seq_num, const char* payload);
+
+/**
+ * @brief Send a header-only packet (START, END or ACK) built on the stack
+ * @param sockfd Socket fd
+ * @param type RTP segment type
+ * @param seq_num RTP sequence number
+ * @param to Peer's address
+ * @param tolen Peer's address length
+ * @return -1 means failure, 0 means success
+*/
+int rtp_sendctl(int sockfd, uint8_t type, uint32_t seq_num, const struct sockaddr* to, socklen_t tolen);
+
+/**
+ * @brief Send a control packet (START, END or ACK) carrying a small payload, built on the stack
+ * @param sockfd Socket fd
+ * @param type RTP segment type
+ * @param seq_num RTP sequence number
+ * @param payload Payload, at most RTP_SACK_BYTES bytes
+ * @param length Payload length
+ * @param to Peer's address
+ * @param tolen Peer's address length
+ * @return -1 means failure, 0 means success
+*/
+int rtp_sendctlPayload(int sockfd, uint8_t type, uint32_t seq_num, const void* payload, uint16_t length, const struct sockaddr* to, socklen_t tolen);
+
+/**
+ * @brief Receive a RTP packet into a caller-owned buffer and verify its checksum.
+ * @param sockfd Socket fd
+ * @param pkt Buffer to receive the packet
+ * @param size Size of pkt buffer
+ * @param from Peer's address
+ * @param fromlen A pointer to peer address's length
+ * @return Length of received packet, -1 if receiving or verification failed
+*/
+ssize_t rtp_recv(int sockfd, rtp_packet_t* pkt, size_t size, struct sockaddr* from, socklen_t* fromlen);
+
+/**
+ * @brief Verify length and checksum of a received RTP packet.
+ * Header and payload are summed apart, the checksum field is left holding the CRC-32 of the payload alone.
+ * @param pkt Received packet
+ * @param recv_length Number of bytes received
+ * @return recv_length if packet is valid, -1 otherwise
+*/
+ssize_t rtp_verify(rtp_packet_t* pkt, ssize_t recv_length);
+
 /**
  * @brief Receive a RTP packet and verify its checksum.
  * Remember to free returned packet.
@@ -84,7 +417,9 @@ rtp_packet_t* rtp_recvfrom(int sockfd, struct sockaddr* from, socklen_t* fromlen
 
 /**
  * @brief Send END packet and wait for ACK with correct seq_num.
+ * END is retransmitted with backoff up to RTP_END_RETRIES times.
  * Return when time out or receive ACK.
+ * END carries the digest of the data sent to receivers announcing RTP_CAP_DIGEST.
  * Remember to close connection after return.
  * @author Sheng Lin
  * @param sockfd Sender's socket fd
@@ -108,6 +443,108 @@ void rtp_freeSenderControl(rtp_sender_t* sender_control);
 */
 void rtp_freeReceiverControl(rtp_receiver_t* receiver_control);
 
+/**
+ * @brief Create an empty datagram batch
+ * @param capacity Max number of datagrams in the batch
+ * @return A pointer to the batch, free it with rtp_freeBatch
+*/
+rtp_batch_t* rtp_createBatch(uint32_t capacity);
+
+/**
+ * @brief Free a datagram batch. Queued buffers are owned by caller and not freed.
+ * @param batch Batch to be freed
+*/
+void rtp_freeBatch(rtp_batch_t* batch);
+
+/**
+ * @brief Queue a datagram to send, or post a buffer to receive into
+ * @param batch Datagram batch
+ * @param buf Datagram buffer, must stay valid until the batch is sent or reset
+ * @param len Datagram length, or buffer size for receiving
+ * @return -1 if the batch is full, 0 means success
+*/
+int rtp_batchPush(rtp_batch_t* batch, void* buf, size_t len);
+
+/**
+ * @brief Queue a datagram gathered from a framed header and its payload
+ * @param batch Datagram batch
+ * @param header Framed header, its length field gives the payload length
+ * @param payload Payload, must stay valid until the batch is sent
+ * @return -1 if the batch is full, 0 means success
+*/
+int rtp_batchPushPkt(rtp_batch_t* batch, rtp_header_t* header, const char* payload);
+
+/**
+ * @brief Stamp the datagram pushed last with the time the kernel should send it (SO_TXTIME)
+ * @param batch Datagram batch, not empty
+ * @param txtime_us Departure time in us of CLOCK_MONOTONIC
+*/
+void rtp_batchTxtime(rtp_batch_t* batch, uint64_t txtime_us);
+
+/**
+ * @brief Buffer of the index-th datagram in a batch
+*/
+static inline void* rtp_batchBuffer(rtp_batch_t* batch, uint32_t index){
+    return batch->iovs[index * RTP_BATCH_IOV].iov_base;
+}
+
+/**
+ * @brief Let the kernel segment runs of equal-size datagrams sent through batch on sockfd (UDP_SEGMENT)
+ * Sends fall back to one datagram each if the kernel or the route later refuses segmentation.
+ * @return -1 if the kernel lacks UDP GSO, 0 means success
+*/
+int rtp_enableGSO(int sockfd, rtp_batch_t* batch);
+
+/**
+ * @brief Let the kernel coalesce datagrams received on sockfd (UDP_GRO), split again into the buffers of batch
+ * @param batch Batch whose buffers were posted by rtp_batchPush, each large enough for one datagram
+ * @return -1 if the kernel lacks UDP GRO, 0 means success
+*/
+int rtp_enableGRO(int sockfd, rtp_batch_t* batch);
+
+/**
+ * @brief Whether datagrams coalesced by GRO are left to be received without waiting for the socket
+*/
+bool rtp_batchPending(const rtp_batch_t* batch);
+
+/**
+ * @brief Send every queued datagram with sendmmsg and empty the batch
+ * @param sockfd Socket fd
+ * @param batch Datagram batch
+ * @param to Peer's address
+ * @param tolen Peer's address length
+ * @return -1 means failure, 0 means success
+*/
+int rtp_sendBatch(int sockfd, rtp_batch_t* batch, const struct sockaddr* to, socklen_t tolen);
+
+/**
+ * @brief Drain queued datagrams into the posted buffers with one non-blocking recvmmsg.
+ * Posted buffers stay in the batch, so it can be called repeatedly.
+ * @param sockfd Socket fd
+ * @param batch Datagram batch whose buffers were posted by rtp_batchPush
+ * @param from Peer's address, set to the sender of the last datagram
+ * @param fromlen A pointer to peer address's length
+ * @return Number of datagrams received, -1 means failure
+*/
+int rtp_recvBatch(int sockfd, rtp_batch_t* batch, struct sockaddr* from, socklen_t* fromlen);
+
+/**
+ * @brief Like rtp_recvBatch, but keep the sender of every datagram, for sockets shared by many peers
+ * @param sockfd Socket fd
+ * @param batch Datagram batch whose buffers were posted by rtp_batchPush
+ * @param from Array of batch->count addresses, from[i] is set to the sender of the i-th datagram
+ * @return Number of datagrams received, -1 means failure
+*/
+int rtp_recvBatchFrom(int sockfd, rtp_batch_t* batch, struct sockaddr_in* from);
+
+/**
+ * @brief Verify the index-th datagram received by rtp_recvBatch
+ * @param batch Datagram batch
+ * @param index Index of datagram
+ * @return Packet length if packet is valid, -1 otherwise
+*/
+ssize_t rtp_batchVerify(rtp_batch_t* batch, uint32_t index);
+
 #ifdef __cplusplus
 }
 #endif
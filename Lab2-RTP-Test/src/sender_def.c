@@ -3,343 +3,1309 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
 #include "rtp.h"
+#include "util.h"
 #include "sender_def.h"
 
-rtp_sender_t* sender_control = NULL;
-struct sockaddr_in servaddr;
-int sendfd;
+#define READAHEAD_SIZE (4 << 20)  // Bytes of mapping hinted with MADV_WILLNEED at once
+#define TIMER_TICK 1000           // Resolution of retransmission timers in us
+#define DUP_ACK_THRESHOLD 3       // Duplicate ACKs that trigger a fast retransmit
+#define FEC_BUFS 8                // Parity pkts queued in one batch before it is sent
+#define LZ_MIN_GAIN 16            // Compressed pkts must save 1/16 of the payload, others go out raw
+#define LZ_MAX_SKIP 64            // Most new pkts sent raw without trying after an incompressible one
+#define SIG_REQUEST_BYTES (16 << 20)  // Bytes of the receiver's old file signed per RTP_SIG request
+#define SIG_SLACK 200000          // Time the receiver gets to read and sign them, on top of RTO, in us
+
+// Where file segments come from: a read-only mapping of the whole file,
+// a stream read into slot buffers when the file cannot be mapped,
+// or the buffers of one rtp_writev copied into slot buffers.
+typedef struct file_source{
+    FILE* stream;          // Fallback stream, NULL when mapped
+    const char* map;       // File mapping
+    size_t size;           // File size
+    size_t begin;          // Byte range of the file to be sent
+    size_t end;
+    uint32_t seq_begin;    // seq_num of the pkt at begin
+    size_t advised;        // End of mapping already hinted for readahead
+    const struct iovec* iov;  // Buffers of rtp_writev, taken after the bytes kept in write_buf
+    int iovcnt;
+    int iov_index;         // Buffer and offset of the next byte not taken
+    size_t iov_offset;
+    bool written;          // Bytes of rtp_writev or rtp_flush instead of a file
+    bool flush;            // Bytes short of a full pkt go out instead of staying in write_buf
+    uint64_t identity;     // Identity of a mapped file for resuming, 0 for others
+    rtp_delta_t* delta;    // Delta of a mapped file against the receiver's old one, NULL to send the file itself
+} file_source_t;
+
+// One stripe of a striped file, sent by its own thread over its own flow.
+typedef struct stripe_flow{
+    rtp_session_t* parent;  // Session the file is sent on
+    file_source_t source;   // Mapping shared with the other stripes, limited to this stripe
+    rtp_options_t options;
+    bool opt;
+    int state;              // -1 means failure, 0 means success
+    pthread_t thread;
+} stripe_flow_t;
+
+// Passed to on_expire through the timing wheel.
+typedef struct expire_arg{
+    rtp_session_t* session;
+    int state;             // Set to -1 on failure
+} expire_arg_t;
+
+static rtp_session_t* sender_session = NULL;  // Session of initSender and sendMessage
+static const rtp_cc_ops_t* cc_ops = &rtp_cc_newreno;
+static uint32_t stripes = 1;
+static uint32_t payload_size = PAYLOAD_SIZE;
+static bool pacing = false;
+static uint64_t pace_rate = 0;
+static bool txtime = false;
+static bool offload = true;
+static bool fec = false;
+static uint32_t fec_group = 0;
+static bool compress = false;
+static bool resume = false;
+static bool delta = false;
+
+int setSenderCongestionControl(const char* name){
+    const rtp_cc_ops_t* ops = rtp_ccFind(name);
+    if(!ops)
+        return -1;
+    cc_ops = ops;
+    return 0;
+}
+
+void setSenderPayloadSize(uint32_t size){
+    payload_size = size > RTP_MAX_PAYLOAD ? RTP_MAX_PAYLOAD : size;
+}
+
+void setSenderStripes(uint32_t count){
+    stripes = count ? count : 1;
+}
+
+void setSenderPacing(int enable, uint64_t rate, int use_txtime){
+    pacing = enable != 0;
+    pace_rate = rate;
+    txtime = use_txtime != 0;
+}
+
+void setSenderOffload(int enable){
+    offload = enable != 0;
+}
+
+void setSenderFEC(int enable, uint32_t group){
+    fec = enable != 0;
+    fec_group = group;
+}
+
+void setSenderCompression(int enable){
+    compress = enable != 0;
+}
+
+void setSenderResume(int enable){
+    resume = enable != 0;
+}
+
+void setSenderDelta(int enable){
+    delta = enable != 0;
+}
+
+const rtp_cc_t* getSenderCongestionState(){
+    return rtp_sessionCongestionState(sender_session);
+}
+
+/**
+ * @brief Allocate sender control for a window.
+ * @return A pointer to sender control
+*/
+static rtp_sender_t* create_control(uint32_t window_size, const rtp_cc_ops_t* ops){
+    rtp_sender_t* control = malloc(sizeof(rtp_sender_t));
+    control->window_size = window_size;
+    control->seq_base = 0;
+    control->seq_next = 0;
+    control->seq_resend = 0;
+    control->dup_acks = 0;
+    control->send_header = malloc(window_size * sizeof(rtp_header_t));
+    control->send_data = malloc(window_size * sizeof(char*));
+    control->send_buf = malloc(window_size * sizeof(char*));
+    control->send_length = malloc(window_size * sizeof(size_t));
+    control->send_ack = malloc(window_size * sizeof(size_t));
+    control->send_time = calloc(window_size, sizeof(uint64_t));
+    control->send_count = calloc(window_size, sizeof(uint32_t));
+    control->caps = 0;
+    control->payload_size = PAYLOAD_SIZE;
+    rtp_pacerInit(&control->pacer, 0, mono_us());
+    control->txtime = false;
+    control->write_buf = NULL;
+    control->write_length = 0;
+    memset(&control->fec, 0, sizeof(rtp_fec_t));
+    control->fec_buf = NULL;
+    control->fec_queued = 0;
+    control->fec_end = calloc(window_size, sizeof(uint32_t));
+    control->lz = NULL;
+    control->lz_buf = NULL;
+    control->lz_skip = 0;
+    control->lz_backoff = 0;
+    control->digest = 0;
+    control->digest_length = 0;
+    rtp_rtoInit(&control->rto);
+    rtp_ccInit(&control->cc, ops, window_size);
+    control->timer = rtp_createWheel(window_size, TIMER_TICK, mono_us());
+    for(int i=0; i < window_size; ++i){
+        control->send_data[i] = NULL;
+        control->send_length[i] = 0;
+        control->send_ack[i] = 0;
+        control->send_buf[i] = NULL;
+    }
+
+    // Initialize batches for sending pkts and draining ACKs.
+    control->send_batch = rtp_createBatch(RTP_BATCH_SIZE);
+    control->ack_batch = rtp_createBatch(RTP_BATCH_SIZE);
+    control->ack_buf = malloc(RTP_BATCH_SIZE * RTP_ACK_SIZE);
+    for(int i=0; i < RTP_BATCH_SIZE; ++i)
+        rtp_batchPush(control->ack_batch, control->ack_buf + i * RTP_ACK_SIZE, RTP_ACK_SIZE);
+    return control;
+}
+
+/**
+ * @brief Payload a pkt to addr can carry without fragments, from the MTU of its route.
+*/
+static uint32_t path_payload(const struct sockaddr_in* addr){
+    uint32_t payload = PAYLOAD_SIZE;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int mtu;
+    socklen_t len = sizeof(mtu);
+    if(fd != -1 && connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) == 0
+        && getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 && mtu > RTP_WIRE_OVERHEAD)
+        payload = mtu - RTP_WIRE_OVERHEAD;
+    if(fd != -1)
+        close(fd);
+    return payload < RTP_MAX_PAYLOAD ? payload : RTP_MAX_PAYLOAD;
+}
+
+/**
+ * @brief Ask the receiver for DATA payloads of size bytes.
+ * @param probe Pad the request to size, so it is only answered if the path carries such pkts
+ * @return -1 means failure, 0 means success
+*/
+static int agree_payload(rtp_session_t* session, uint32_t size, bool probe){
+    rtp_sender_t* control = session->sender;
+    rtp_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.flags = RTP_OPT_PAYLOAD;
+    options.payload = size;
+    rtp_rto_t rto = control->rto;
+    if(rtp_negotiate(session->fd, &session->addr, session->conn, &rto, &options, probe ? size : 0) == -1)
+        return -1;
+    if(!(options.flags & RTP_OPT_PAYLOAD) || options.payload == 0 || options.payload > size)
+        return -1;
+    control->payload_size = options.payload;
+    return 0;
+}
+
+/**
+ * @brief Settle the payload of DATA pkts with the receiver.
+ * A size asked for is taken as far as the receiver goes. With size 0 the path is probed with padded requests:
+ * the route MTU first, then jumbo frames, settling on PAYLOAD_SIZE when neither gets through.
+ * @return -1 means failure, 0 means success
+*/
+static int negotiate_payload(rtp_session_t* session, const rtp_hello_t* hello){
+    rtp_sender_t* control = session->sender;
+    if(session->payload_size == PAYLOAD_SIZE || !(control->caps & RTP_CAP_OPTIONS))
+        return 0;
+    uint32_t max = hello->max_payload ? hello->max_payload : PAYLOAD_SIZE;
+    if(session->payload_size)
+        return agree_payload(session, session->payload_size < max ? session->payload_size : max, false);
+
+    // Probes must not be fragmented, whatever the kernel knows about the path.
+    int pmtu = IP_PMTUDISC_PROBE;
+    setsockopt(session->fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+    uint32_t sizes[] = {path_payload(&session->addr), RTP_JUMBO_PAYLOAD};
+    uint32_t probed = UINT32_MAX;
+    int state = -1;
+    for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && state == -1; i++){
+        uint32_t size = sizes[i] < max ? sizes[i] : max;
+        if(size >= probed || size == PAYLOAD_SIZE)
+            continue;
+        probed = size;
+        state = agree_payload(session, size, true);
+    }
+    pmtu = IP_PMTUDISC_WANT;
+    setsockopt(session->fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+
+    // A receiver that agreed to a probe whose answer got lost has to hear of the fallback.
+    if(state == -1 && probed != UINT32_MAX)
+        state = agree_payload(session, PAYLOAD_SIZE, false);
+    return probed == UINT32_MAX ? 0 : state;
+}
+
+/**
+ * @brief Connect session to the receiver at servaddr.
+ * @return -1 means failure, 0 means success
+*/
+static int connect_addr(rtp_session_t* session, const struct sockaddr_in* servaddr){
+    if(session->fd != -1)
+        return -1;
 
-int initSender(const char* receiver_ip, uint16_t receiver_port, uint32_t window_size){
     // Create a socket.
-    sendfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if(sendfd == -1){
+    session->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(session->fd == -1){
         perror("[Sender] Socket failure");
         return -1;
     }
 
-    // Initialize server sockaddr.
+    // Connect to server.
+    session->addr = *servaddr;
+    socklen_t len = sizeof(session->addr);
+    rtp_rto_t rto;
+    rtp_rtoInit(&rto);
+    rtp_hello_t hello;
+    int conn = rtp_connect(session->fd, &session->addr, &len, &rto, &hello, &session->conn);
+    if(conn == -1){
+        perror("[Sender] Connection failure");
+        close(session->fd);
+        session->fd = -1;
+        return -1;
+    }
+
+    session->sender = create_control(session->window_size, session->cc_ops);
+    session->sender->caps = hello.caps;
+    session->sender->rto = rto;
+    // Without UDP GSO every pkt is its own send, as before.
+    if(session->offload)
+        rtp_enableGSO(session->fd, session->sender->send_batch);
+    if(negotiate_payload(session, &hello) == -1){
+        fprintf(stderr, "[Sender] Payload negotiation failure.\n");
+        rtp_sendEND(session->fd, (struct sockaddr*)&session->addr, &len, NULL);
+        rtp_freeSenderControl(session->sender);
+        session->sender = NULL;
+        close(session->fd);
+        session->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int rtp_sessionConnect(rtp_session_t* session, const char* receiver_ip, uint16_t receiver_port){
+    struct sockaddr_in servaddr;
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     inet_pton(AF_INET, receiver_ip, &servaddr.sin_addr);
     servaddr.sin_port = htons(receiver_port);
+    return connect_addr(session, &servaddr);
+}
 
-    // Connect to server.
-    socklen_t len = sizeof(servaddr);
-    int conn = rtp_connect(sendfd, &servaddr, &len);
-    if(conn == -1){
-        perror("[Sender] Connection failure");
-        close(sendfd);
+int initSender(const char* receiver_ip, uint16_t receiver_port, uint32_t window_size){
+    sender_session = rtp_createSession(window_size);
+    sender_session->cc_ops = cc_ops;
+    sender_session->payload_size = payload_size;
+    sender_session->offload = offload;
+    if(rtp_sessionConnect(sender_session, receiver_ip, receiver_port) == -1){
+        rtp_sessionClose(sender_session);
+        sender_session = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send every pkt queued in send_batch with one syscall.
+ * @return -1 means failure, 0 means success
+*/
+static int flush_batch(rtp_session_t* s){
+    s->sender->fec_queued = 0;
+    if(rtp_sendBatch(s->fd, s->sender->send_batch, (struct sockaddr*)&s->addr, sizeof(s->addr)) == -1){
+        perror("[Sender] Send failure");
         return -1;
     }
+    return 0;
+}
 
-    // Initialize sender_control.
-    sender_control = malloc(sizeof(rtp_sender_t));
-    sender_control->window_size = window_size;
-    sender_control->seq_base = 0;
-    sender_control->seq_next = 0;
-    sender_control->send_buf = malloc(window_size * sizeof(char*));
-    sender_control->send_length = malloc(window_size * sizeof(size_t));
-    sender_control->send_ack = malloc(window_size * sizeof(size_t));
-    for(int i=0; i < window_size; ++i){
-        sender_control->send_length[i] = 0;
-        sender_control->send_ack[i] = 0;
-        sender_control->send_buf[i] = malloc(PAYLOAD_SIZE);
-        memset(sender_control->send_buf[i], 0, PAYLOAD_SIZE);
+/**
+ * @brief Account the pkt just queued in send_batch to the pacer.
+ * @return Time the pkt leaves in us
+*/
+static uint64_t pace_pkt(rtp_sender_t* control, uint32_t bytes){
+    uint64_t now = mono_us();
+    if(control->txtime){
+        // RTT is measured from the time the pkt actually leaves.
+        now = rtp_pacerDepart(&control->pacer, bytes, now);
+        rtp_batchTxtime(control->send_batch, now);
     }
+    else
+        rtp_pacerSpend(&control->pacer, bytes, now);
+    return now;
+}
 
+/**
+ * @brief Queue the cached pkt whose sequence number is seq for sending.
+ * The slot header is already framed and is gathered with its payload.
+ * @param opt true to arm the retransmission timer of the pkt
+ * @return -1 means failure, 0 means success
+*/
+static int send_slot(rtp_session_t* s, uint32_t seq, bool opt){
+    rtp_sender_t* control = s->sender;
+    uint32_t slot = rtp_slot(seq, control->window_size);
+    if(control->send_batch->count == control->send_batch->capacity && flush_batch(s) == -1)
+        return -1;
+    rtp_batchPushPkt(control->send_batch, &control->send_header[slot], control->send_data[slot]);
+    control->send_time[slot] = pace_pkt(control, sizeof(rtp_header_t) + control->send_header[slot].length);
+    control->send_count[slot]++;
+    if(opt)
+        rtp_wheelSchedule(control->timer, slot, control->send_time[slot] + rtp_rtoTimeout(&control->rto));
     return 0;
 }
 
-int sendMessage(const char* message){
-    // Open file whose name is message.
-    FILE* send_file = fopen(message, "r");
-    size_t message_num = 0;
-    if(!send_file){
-        perror("[Sender] Open file failure");
+/**
+ * @brief Queue the parity pkt of the new pkts summed since the last one.
+ * @return -1 means failure, 0 means success
+*/
+static int send_parity(rtp_session_t* s){
+    rtp_sender_t* control = s->sender;
+    if((control->fec_queued == FEC_BUFS || control->send_batch->count == control->send_batch->capacity) && flush_batch(s) == -1)
+        return -1;
+    rtp_packet_t* pkt = (rtp_packet_t*)(control->fec_buf + control->fec_queued * RTP_PKT_ROOM(control->payload_size));
+    uint32_t first;
+    uint32_t count = control->fec.count;
+    size_t length = rtp_fecTake(&control->fec, pkt->payload, &first);
+    if(length == 0)
+        return 0;
+    for(uint32_t seq = first; seq < first + count; seq++)
+        control->fec_end[rtp_slot(seq, control->window_size)] = first + count;
+    rtp_frame(pkt, RTP_FEC, length, first);
+    rtp_batchPush(control->send_batch, pkt, sizeof(rtp_header_t) + length);
+    control->fec_queued++;
+    pace_pkt(control, sizeof(rtp_header_t) + length);
+    return 0;
+}
+
+/**
+ * @brief Resend the pkt whose retransmission timer expired.
+ * @param slot Window slot of the pkt, also its timer id
+ * @param arg expire_arg_t of the session
+*/
+static void on_expire(uint32_t slot, void* arg){
+    expire_arg_t* expire = arg;
+    rtp_sender_t* control = expire->session->sender;
+    if(control->send_ack[slot] == 1)
+        return;
+    // Back off once per loss of the oldest pkt, not for every pkt timing out with it.
+    // Losing the oldest pkt again after resending it is a timeout, other expiries are single losses.
+    uint32_t seq = control->send_header[slot].seq_num;
+    uint64_t now = mono_us();
+    if(seq == control->seq_base)
+        rtp_rtoBackoff(&control->rto);
+    if(seq == control->seq_base && control->send_count[slot] > 1)
+        rtp_ccTimeout(&control->cc, control->seq_next, now);
+    else
+        rtp_ccLoss(&control->cc, seq, control->seq_next, now);
+    if(send_slot(expire->session, seq, true) == -1)
+        expire->state = -1;
+}
+
+/**
+ * @brief Duplicate ACKs that make seq_base count as lost.
+ * With FEC the receiver may still repair it once the parity pkt of its group arrives.
+*/
+static uint32_t dup_threshold(const rtp_sender_t* control){
+    uint32_t end = control->fec.parity ? control->fec_end[rtp_slot(control->seq_base, control->window_size)] : 0;
+    // The pkts of the group after seq_base come before the parity pkt.
+    if(end > control->seq_base)
+        return DUP_ACK_THRESHOLD + end - control->seq_base - 1;
+    return DUP_ACK_THRESHOLD;
+}
+
+/**
+ * @brief Count a duplicate ACK of seq_base.
+ * @return true if seq_base now counts as lost
+*/
+static bool dup_ack(rtp_sender_t* control){
+    if(++control->dup_acks == 1 && control->fec.parity)
+        rtp_fecLoss(&control->fec);
+    return control->dup_acks == dup_threshold(control);
+}
+
+/**
+ * @brief Resend only seq_base after dup_threshold duplicate ACKs, without waiting for the timeout.
+ * @param opt true to rearm the retransmission timer of the pkt
+ * @return -1 means failure, 0 means success
+*/
+static int fast_retransmit(rtp_session_t* s, bool opt){
+    rtp_sender_t* control = s->sender;
+    rtp_ccLoss(&control->cc, control->seq_base, control->seq_next, mono_us());
+    if(send_slot(s, control->seq_base, opt) == -1)
+        return -1;
+    return flush_batch(s);
+}
+
+/**
+ * @brief Feed RTT of newly acked pkt seq to the RTO estimator.
+ * Retransmitted pkts are skipped, their ACK may answer any copy. As Go-Back-N resends the whole window,
+ * callers also clear backoff when the window slides, or no sample would ever undo it.
+*/
+static void sample_rtt(rtp_sender_t* control, uint32_t seq){
+    uint32_t slot = rtp_slot(seq, control->window_size);
+    if(control->send_count[slot] == 1)
+        rtp_rtoSample(&control->rto, mono_us() - control->send_time[slot]);
+}
+
+/**
+ * @brief Open file to be sent, mapping it when possible.
+ * @return -1 means failure, 0 means success
+*/
+static int source_open(file_source_t* source, const char* message){
+    memset(source, 0, sizeof(file_source_t));
+    int fd = open(message, O_RDONLY);
+    if(fd == -1)
         return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        source->size = st.st_size;
+        source->end = source->size;
+        if(source->size == 0){
+            close(fd);
+            return 0;
+        }
+        void* map = mmap(NULL, source->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED){
+            close(fd);
+            source->map = map;
+            source->identity = rtp_fileIdentity(&st);
+            madvise(map, source->size, MADV_SEQUENTIAL);
+            return 0;
+        }
     }
 
-    // Read file segments to window.
-    for(int i=0; i < sender_control->window_size; i++){
-        size_t read_byte = fread(sender_control->send_buf[i], 1, PAYLOAD_SIZE, send_file);
-        if(read_byte == 0)
-            break;
-        sender_control->send_length[i] = read_byte;
-        message_num++;
+    // Not a mappable regular file, e.g. a pipe.
+    source->stream = fdopen(fd, "r");
+    if(!source->stream){
+        close(fd);
+        return -1;
     }
+    return 0;
+}
 
-    // Send message.
-    for(int i=0; i < sender_control->window_size; i++){
-        if(sender_control->send_length[i] == 0)
-            break;
-        //rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[i], sender_control->seq_base + i, sender_control->send_buf[i]);
-        rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[i], sender_control->seq_next, sender_control->send_buf[i]);
-        ssize_t send_len = sendto(sendfd, (void*)pkt, sizeof(rtp_header_t) + sender_control->send_length[i], 0, (struct sockaddr*)&servaddr, sizeof(servaddr));
-        if(send_len != sizeof(rtp_header_t) + sender_control->send_length[i]){
-            free(pkt);
-            fclose(send_file);
-            perror("[Sender] Send failure");
-            return -1;
+static void source_close(file_source_t* source){
+    if(source->stream)
+        fclose(source->stream);
+    if(source->map)
+        munmap((void*)source->map, source->size);
+    rtp_freeDelta(source->delta);
+}
+
+/**
+ * @brief Copy up to size bytes of the buffers of a stream write to dst.
+ * @return Bytes copied
+*/
+static size_t iov_take(file_source_t* source, char* dst, size_t size){
+    size_t taken = 0;
+    while(taken < size && source->iov_index < source->iovcnt){
+        const struct iovec* iov = &source->iov[source->iov_index];
+        size_t length = iov->iov_len - source->iov_offset;
+        if(length > size - taken)
+            length = size - taken;
+        memcpy(dst + taken, (const char*)iov->iov_base + source->iov_offset, length);
+        taken += length;
+        source->iov_offset += length;
+        if(source->iov_offset == iov->iov_len){
+            source->iov_index++;
+            source->iov_offset = 0;
         }
-        free(pkt);
-        sender_control->seq_next++;
     }
+    return taken;
+}
 
-    // Wait for ACK
-    fd_set wait_fd;
-    while(true){
-        FD_ZERO(&wait_fd);
-        FD_SET(sendfd, &wait_fd);
-        struct timeval timeout = {0, 100000}; // 100ms
-        int res = select(sendfd + 1, &wait_fd, NULL, NULL, &timeout);
-        if(res == -1){
-            fclose(send_file);
+/**
+ * @brief Coalesce bytes of stream writes into the payload of pkt seq.
+ * Bytes short of a full pkt are kept in write_buf for the next write, unless flushing.
+ * @param data Set to the payload
+ * @return Payload length, 0 when no pkt can be made yet
+*/
+static size_t stream_read(rtp_sender_t* control, file_source_t* source, uint32_t seq, const char** data){
+    size_t pending = control->write_length;
+    for(int i = source->iov_index; i < source->iovcnt && pending < control->payload_size; i++)
+        pending += source->iov[i].iov_len - (i == source->iov_index ? source->iov_offset : 0);
+    if(pending < control->payload_size && !(source->flush && pending > 0)){
+        control->write_length += iov_take(source, control->write_buf + control->write_length, control->payload_size - control->write_length);
+        return 0;
+    }
+
+    uint32_t slot = rtp_slot(seq, control->window_size);
+    if(!control->send_buf[slot])
+        control->send_buf[slot] = malloc(control->payload_size);
+    memcpy(control->send_buf[slot], control->write_buf, control->write_length);
+    size_t length = control->write_length + iov_take(source, control->send_buf[slot] + control->write_length, control->payload_size - control->write_length);
+    control->write_length = 0;
+    *data = control->send_buf[slot];
+    return length;
+}
+
+/**
+ * @brief Locate payload of pkt seq in the file.
+ * A mapped file is used in place, otherwise the segment is read into the slot buffer,
+ * as is the delta replacing a file.
+ * @param data Set to the payload
+ * @return Payload length, 0 at the end of file
+*/
+static size_t source_read(rtp_sender_t* control, file_source_t* source, uint32_t seq, const char** data){
+    if(source->written)
+        return stream_read(control, source, seq, data);
+    if(!source->stream && !source->delta){
+        uint64_t offset = source->begin + (uint64_t)(seq - source->seq_begin) * control->payload_size;
+        if(offset >= source->end)
+            return 0;
+
+        // Hint the kernel to read ahead of the window.
+        if(source->advised < offset)
+            source->advised = offset;
+        if(offset + (uint64_t)control->window_size * control->payload_size > source->advised && source->advised < source->end){
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t begin = source->advised & ~(page - 1);
+            size_t length = READAHEAD_SIZE;
+            if(length < (size_t)control->window_size * control->payload_size)
+                length = (size_t)control->window_size * control->payload_size;
+            if(length > source->end - begin)
+                length = source->end - begin;
+            madvise((void*)(source->map + begin), length, MADV_WILLNEED);
+            source->advised = begin + length;
+        }
+
+        *data = source->map + offset;
+        return source->end - offset < control->payload_size ? source->end - offset : control->payload_size;
+    }
+
+    uint32_t slot = rtp_slot(seq, control->window_size);
+    if(!control->send_buf[slot])
+        control->send_buf[slot] = malloc(control->payload_size);
+    *data = control->send_buf[slot];
+    if(source->delta)
+        return rtp_deltaRead(source->delta, control->send_buf[slot], control->payload_size);
+    return fread(control->send_buf[slot], 1, control->payload_size, source->stream);
+}
+
+/**
+ * @brief Compress the payload of new pkt seq into its slot of lz_buf if that saves enough wire bytes.
+ * After an incompressible pkt the next ones go out raw without trying, twice as many each time it happens again in a row.
+ * @param length Set to the compressed length
+ * @return true if the pkt goes out as RTP_LZ
+*/
+static bool compress_pkt(rtp_sender_t* control, uint32_t slot, const char* data, size_t read_byte, size_t* length){
+    if(control->lz_skip){
+        control->lz_skip--;
+        return false;
+    }
+    if(!control->lz_buf[slot])
+        control->lz_buf[slot] = malloc(control->payload_size);
+    size_t size = rtp_lzCompress(control->lz, data, read_byte, control->lz_buf[slot], read_byte - 1 - read_byte / LZ_MIN_GAIN);
+    if(size == 0){
+        control->lz_skip = control->lz_backoff;
+        control->lz_backoff = control->lz_backoff ? control->lz_backoff * 2 : 1;
+        if(control->lz_backoff > LZ_MAX_SKIP)
+            control->lz_backoff = LZ_MAX_SKIP;
+        return false;
+    }
+    control->lz_backoff = 0;
+    *length = size;
+    return true;
+}
+
+/**
+ * @brief Whether the token bucket holds the next pkt back.
+ * With SO_TXTIME pkts are never held, the kernel sends them at their departure times.
+*/
+static bool pace_blocked(rtp_sender_t* control){
+    return control->pacer.rate && !control->txtime && rtp_pacerDelay(&control->pacer, mono_us()) > 0;
+}
+
+/**
+ * @brief Time until the token bucket lets fill_window go on.
+ * @param eof Whether the whole file has been read
+ * @return us to wait, UINT64_MAX if sending is not held back by pacing
+*/
+static uint64_t pace_wait(rtp_sender_t* control, bool eof){
+    if(!control->pacer.rate || control->txtime)
+        return UINT64_MAX;
+    uint32_t window = rtp_ccWindow(&control->cc);
+    if(window > control->window_size)
+        window = control->window_size;
+    bool more;
+    if(control->seq_resend < control->seq_next)
+        more = control->seq_resend < control->seq_base + window;
+    else
+        more = !eof && control->seq_next < control->seq_base + window;
+    if(!more)
+        return UINT64_MAX;
+    return rtp_pacerDelay(&control->pacer, mono_us());
+}
+
+/**
+ * @brief Send pkts until the window or cwnd is full.
+ * Cached pkts waiting to be resent go first, then file segments are taken into free slots.
+ * Each segment is framed and checksummed once when it enters the window.
+ * When pacing, sending also stops once the token bucket is empty.
+ * @param source File to be sent
+ * @param eof Set to true once the whole file has been read
+ * @param opt true to arm retransmission timers of new pkts
+ * @return -1 means failure, 0 means success
+*/
+static int fill_window(rtp_session_t* s, file_source_t* source, bool* eof, bool opt){
+    rtp_sender_t* control = s->sender;
+    uint32_t window = rtp_ccWindow(&control->cc);
+    if(window > control->window_size)
+        window = control->window_size;
+    if(s->pacing && s->pace_rate == 0)
+        rtp_pacerSetRate(&control->pacer, rtp_pacerRateOf(&control->cc, sizeof(rtp_header_t) + control->payload_size, control->rto.srtt), mono_us());
+    while(control->seq_resend < control->seq_next && control->seq_resend < control->seq_base + window && !pace_blocked(control)){
+        // Pkts a SACK reported are not resent.
+        if(control->send_ack[rtp_slot(control->seq_resend, control->window_size)] == 0 && send_slot(s, control->seq_resend, opt) == -1)
             return -1;
+        control->seq_resend++;
+    }
+    while(!*eof && control->seq_resend == control->seq_next && control->seq_next < control->seq_base + window && !pace_blocked(control)){
+        uint32_t slot = rtp_slot(control->seq_next, control->window_size);
+        const char* data;
+        size_t read_byte = source_read(control, source, control->seq_next, &data);
+        if(read_byte == 0){
+            *eof = true;
+            // A stream write that only paused keeps its group open.
+            if(control->fec.parity && (!source->written || source->flush) && send_parity(s) == -1)
+                return -1;
+            break;
+        }
+        // Parity and digest are summed over the raw payload, which is what the receiver caches.
+        // A raw pkt's CRC falls out of framing it.
+        size_t length;
+        uint32_t crc;
+        if(control->lz && compress_pkt(control, slot, data, read_byte, &length)){
+            rtp_frameHeader(&control->send_header[slot], RTP_LZ, length, control->seq_next, control->lz_buf[slot]);
+            control->send_data[slot] = control->lz_buf[slot];
+            crc = compute_checksum(data, read_byte);
         }
-        else if(res == 0){
-            // No message to sent.
-            if(sender_control->send_length[0] == 0)
-                return 0;
-
-            // Resend message.
-            for(int i=0; i < sender_control->window_size; i++){
-                if(sender_control->send_length[i] == 0)
-                    break;
-                rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[i], sender_control->seq_base + i, sender_control->send_buf[i]);
-                ssize_t send_len = sendto(sendfd, (void*)pkt, sizeof(rtp_header_t) + sender_control->send_length[i], 0, (struct sockaddr*)&servaddr, sizeof(servaddr));
-                if(send_len != sizeof(rtp_header_t) + sender_control->send_length[i]){
-                    free(pkt);
-                    fclose(send_file);
-                    perror("[Sender] Resend failure");
-                    return -1;
-                }
-                free(pkt);
-            }
+        else{
+            crc = rtp_frameHeader(&control->send_header[slot], RTP_DATA, read_byte, control->seq_next, data);
+            control->send_data[slot] = data;
         }
-        else if(FD_ISSET(sendfd, &wait_fd)){
-            // Receive ACK and check its checksum.
-            socklen_t addrlen = sizeof(servaddr);
-            rtp_packet_t* recv_ack = rtp_recvfrom(sendfd, (struct sockaddr*)&servaddr, &addrlen);
-            if(!recv_ack)
-                continue;
-            else{
-                if(recv_ack->rtp.seq_num >= sender_control->seq_base + 1){
-                    // Update sliding window
-                    int sliding_num = recv_ack->rtp.seq_num - sender_control->seq_base;
-                    for(int i = sliding_num; i < sender_control->window_size; i++){
-                        memset(sender_control->send_buf[i - sliding_num], 0, PAYLOAD_SIZE);
-                        if(sender_control->send_length[i] != 0)
-                            memcpy(sender_control->send_buf[i - sliding_num], sender_control->send_buf[i], sender_control->send_length[i]);
-                        sender_control->send_length[i - sliding_num] = sender_control->send_length[i];
-                    }
-                    for(int i = 0; i < sliding_num; i++){
-                        int j = sender_control->window_size - 1 - i;
-                        if(sender_control->send_length[j] != 0){
-                            memset(sender_control->send_buf[j], 0, PAYLOAD_SIZE);
-                            sender_control->send_length[j] = 0;
-                        }
-                    }
-                    sender_control->seq_base = recv_ack->rtp.seq_num;
-                    
-                    // Send more message.
-                    // Read from file first.
-                    for(int i=0; i < sliding_num; i++){
-                        int j = sender_control->window_size - sliding_num + i;
-                        size_t read_byte = fread(sender_control->send_buf[j], 1, PAYLOAD_SIZE, send_file);
-                        if(read_byte == 0)
-                            break;
-                        sender_control->send_length[j] = read_byte;
-                        message_num++;
-                    }
-
-                    // No more message to send.
-                    if(sender_control->seq_base >= message_num){
-                        free(recv_ack);
-                        break;
-                    }
-
-                    // Send new message.
-                    for(int i = 0; i < sliding_num; i++){
-                        int j = sender_control->window_size - sliding_num + i;
-                        if(sender_control->send_length[j] == 0)
-                            break;
-                        // rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[j], sender_control->seq_base + j, sender_control->send_buf[j]);
-                        rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[j], sender_control->seq_next, sender_control->send_buf[j]);
-                        ssize_t send_len = sendto(sendfd, (void*)pkt, sizeof(rtp_header_t) + sender_control->send_length[j], 0, (struct sockaddr*)&servaddr, sizeof(servaddr));
-                        if(send_len != sizeof(rtp_header_t) + sender_control->send_length[j]){
-                            free(pkt);
-                            perror("[Sender] Send failure");
-                            fclose(send_file);
-                            return -1;
-                        }
-                        free(pkt);
-                        sender_control->seq_next++;
-                    }
-                }
-            }
-            free(recv_ack);
+        // The digest of a delta is that of the file it rebuilds.
+        if(!source->delta){
+            control->digest = crc32_combine(control->digest, crc, read_byte);
+            control->digest_length += read_byte;
         }
+        control->send_length[slot] = read_byte;
+        control->send_ack[slot] = 0;
+        control->send_count[slot] = 0;
+        control->fec_end[slot] = 0;
+        if(send_slot(s, control->seq_next, opt) == -1)
+            return -1;
+        if(control->fec.parity){
+            rtp_fecAdd(&control->fec, control->seq_next, data, read_byte);
+            if(rtp_fecFull(&control->fec) && send_parity(s) == -1)
+                return -1;
+        }
+        control->seq_next++;
+        control->seq_resend++;
+    }
+    return flush_batch(s);
+}
+
+/**
+ * @brief Release slots in front of the window until seq_base reaches new_base.
+ * Only bookkeeping is touched, cached payloads stay where they are.
+*/
+static void slide_window(rtp_sender_t* control, uint32_t new_base){
+    while(control->seq_base < new_base){
+        uint32_t slot = rtp_slot(control->seq_base, control->window_size);
+        control->send_length[slot] = 0;
+        control->send_ack[slot] = 0;
+        control->seq_base++;
+    }
+    if(control->seq_resend < control->seq_base)
+        control->seq_resend = control->seq_base;
+}
+
+/**
+ * @brief Mark pkt seq as acked and stop its retransmission timer.
+ * @return true if seq was not acked before
+*/
+static bool ack_slot(rtp_sender_t* control, uint32_t seq){
+    uint32_t slot = rtp_slot(seq, control->window_size);
+    if(control->send_ack[slot] == 1)
+        return false;
+    control->send_ack[slot] = 1;
+    rtp_wheelCancel(control->timer, slot);
+    return true;
+}
+
+/**
+ * @brief Slide the window over acked pkts in front of it.
+ * @return true if the window moved
+*/
+static bool slide_acked(rtp_sender_t* control){
+    uint32_t new_base = control->seq_base;
+    while(new_base < control->seq_next && control->send_ack[rtp_slot(new_base, control->window_size)] == 1)
+        new_base++;
+    if(new_base == control->seq_base)
+        return false;
+    control->rto.backoff = 0;
+    control->dup_acks = 0;
+    slide_window(control, new_base);
+    return true;
+}
+
+/**
+ * @brief Handle a plain ACK of Go-Back-N, which acknowledges every pkt before ack_seq.
+ * @return -1 means failure, 0 means success
+*/
+static int on_cumulative_ack(rtp_session_t* s, uint32_t ack_seq){
+    rtp_sender_t* control = s->sender;
+    // Repeated ACK of seq_base means later pkts arrived without it.
+    if(ack_seq == control->seq_base && ack_seq < control->seq_next){
+        if(dup_ack(control))
+            return fast_retransmit(s, false);
+        return 0;
     }
-    fclose(send_file);
+    if(ack_seq <= control->seq_base || ack_seq > control->seq_next)
+        return 0;
+    control->dup_acks = 0;
+    sample_rtt(control, ack_seq - 1);
+    control->rto.backoff = 0;
+    rtp_ccAck(&control->cc, ack_seq - control->seq_base, mono_us(), control->rto.srtt);
+    slide_window(control, ack_seq);
     return 0;
 }
 
-void terminateSender(){
-    socklen_t len = sizeof(servaddr);
-    rtp_sendEND(sendfd, (struct sockaddr*)&servaddr, &len, sender_control);
-    close(sendfd);
-    rtp_freeSenderControl(sender_control);
-    return;
+/**
+ * @brief Handle a plain ACK of selective repeat, which acknowledges exactly pkt ack_seq.
+*/
+static void on_selective_ack(rtp_sender_t* control, uint32_t ack_seq){
+    if(ack_seq < control->seq_base || ack_seq >= control->seq_next)
+        return;
+    if(ack_slot(control, ack_seq)){
+        sample_rtt(control, ack_seq);
+        rtp_ccAck(&control->cc, 1, mono_us(), control->rto.srtt);
+    }
+    slide_acked(control);
 }
 
-int sendMessageOpt(const char* message){
-    // Open file whose name is message.
-    FILE* send_file = fopen(message, "r");
-    size_t message_num = 0;
-    if(!send_file){
-        perror("[Sender] Open file failure");
+/**
+ * @brief Handle a SACK, which reports the whole receive window in either mode:
+ * every pkt before seq_num, and seq_num + 1 + i for each bit i set in the payload.
+ * @param opt true to rearm timers of fast retransmitted pkts
+ * @return -1 means failure, 0 means success
+*/
+static int on_sack(rtp_session_t* s, rtp_packet_t* ack, bool opt){
+    rtp_sender_t* control = s->sender;
+    uint32_t cum = ack->rtp.seq_num;
+    if(cum < control->seq_base || cum > control->seq_next)
+        return 0;
+
+    uint32_t acked = 0;
+    uint32_t newest = 0;
+    for(uint32_t seq = control->seq_base; seq < cum; seq++)
+        if(ack_slot(control, seq)){
+            acked++;
+            newest = seq;
+        }
+    const uint8_t* bitmap = (const uint8_t*)ack->payload;
+    for(uint32_t i = 0; i < ack->rtp.length * 8u && cum + 1 + i < control->seq_next; i++)
+        if(((bitmap[i >> 3] >> (i & 7)) & 1) && ack_slot(control, cum + 1 + i)){
+            acked++;
+            newest = cum + 1 + i;
+        }
+    if(acked > 0){
+        // The newest pkt acked is most likely the one this ACK answers.
+        sample_rtt(control, newest);
+        rtp_ccAck(&control->cc, acked, mono_us(), control->rto.srtt);
+    }
+
+    // An ACK that leaves seq_base missing counts as duplicate.
+    if(!slide_acked(control) && cum == control->seq_base && cum < control->seq_next)
+        if(dup_ack(control))
+            return fast_retransmit(s, opt);
+    return 0;
+}
+
+/**
+ * @brief Set up pacing of a transfer as configured on s.
+ * Without SO_TXTIME the token bucket holds pkts back itself.
+ * @param flows Flows sharing a fixed pacing rate
+*/
+static void start_pacing(rtp_session_t* s, uint32_t flows){
+    rtp_sender_t* control = s->sender;
+    uint64_t rate = 0;
+    if(s->pacing && s->pace_rate)
+        rate = s->pace_rate / flows ? s->pace_rate / flows : 1;
+    rtp_pacerInit(&control->pacer, rate, mono_us());
+    control->txtime = false;
+    if(s->pacing && s->txtime){
+        struct sock_txtime config = {CLOCK_MONOTONIC, 0};
+        control->txtime = setsockopt(s->fd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0;
+    }
+}
+
+/**
+ * @brief Wait for ACKs, a retransmission timeout or tokens, handle them and send what the window allows.
+ * @param source Data to be sent
+ * @param eof Set to true once source has nothing more to send
+ * @param opt false for Go-Back-N with cumulative ACK, true for selective repeat
+ * @return -1 means failure, 0 means success
+*/
+static int send_round(rtp_session_t* s, file_source_t* source, bool* eof, bool opt){
+    rtp_sender_t* control = s->sender;
+    uint64_t wait = rtp_rtoTimeout(&control->rto);
+    uint64_t pace = pace_wait(control, *eof);
+    bool paced = pace < wait;
+    if(paced)
+        wait = pace;
+    if(opt){
+        // Resend pkts whose own timer expired.
+        expire_arg_t expire = {s, 0};
+        uint64_t now = mono_us();
+        rtp_wheelAdvance(control->timer, now, on_expire, &expire);
+        if(expire.state == -1 || flush_batch(s) == -1)
+            return -1;
+        uint64_t next = rtp_wheelTimeout(control->timer, now);
+        if(next < wait)
+            wait = next;
+    }
+
+    fd_set wait_fd;
+    FD_ZERO(&wait_fd);
+    FD_SET(s->fd, &wait_fd);
+    struct timeval timeout = {wait / 1000000, wait % 1000000};
+    int res = select(s->fd + 1, &wait_fd, NULL, NULL, &timeout);
+    if(res == -1)
         return -1;
+    else if(res == 0 && paced){
+        // Tokens for the next pkts.
+        return fill_window(s, source, eof, opt);
+    }
+    else if(res == 0 && !opt){
+        // Go back to the oldest pkt and resend as cwnd allows.
+        rtp_rtoBackoff(&control->rto);
+        rtp_ccTimeout(&control->cc, control->seq_next, mono_us());
+        control->seq_resend = control->seq_base;
+        control->dup_acks = 0;
+        return fill_window(s, source, eof, opt);
     }
+    else if(res == 0)
+        return 0;
 
-    // Read file segments.
-    for(int i=0; i < sender_control->window_size; i++){
-        size_t read_byte = fread(sender_control->send_buf[i], 1, PAYLOAD_SIZE, send_file);
-        if(read_byte == 0)
-            break;
-        sender_control->send_length[i] = read_byte;
-        message_num++;
+    // Drain queued ACKs.
+    socklen_t addrlen = sizeof(s->addr);
+    int recv_num = rtp_recvBatch(s->fd, control->ack_batch, (struct sockaddr*)&s->addr, &addrlen);
+    if(recv_num == -1)
+        return -1;
+    for(int i = 0; i < recv_num; i++){
+        // Skip broken ACK pkt.
+        if(rtp_batchVerify(control->ack_batch, i) == -1)
+            continue;
+        rtp_packet_t* ack = (rtp_packet_t*)rtp_batchBuffer(control->ack_batch, i);
+        if(ack->rtp.type != RTP_ACK)
+            continue;
+        int state = 0;
+        if(control->caps & RTP_CAP_SACK)
+            state = on_sack(s, ack, opt);
+        else if(!opt)
+            state = on_cumulative_ack(s, ack->rtp.seq_num);
+        else
+            on_selective_ack(control, ack->rtp.seq_num);
+        if(state == -1)
+            return -1;
     }
 
-    // Send message.
-    for(int i=0; i < sender_control->window_size; i++){
-        if(sender_control->send_length[i] == 0)
-            break;
-        // rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[i], sender_control->seq_base + i, sender_control->send_buf[i]);
-        rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[i], sender_control->seq_next, sender_control->send_buf[i]);
-        ssize_t send_len = sendto(sendfd, (void*)pkt, sizeof(rtp_header_t) + sender_control->send_length[i], 0, (struct sockaddr*)&servaddr, sizeof(servaddr));
-        if(send_len != sizeof(rtp_header_t) + sender_control->send_length[i]){
-            free(pkt);
-            fclose(send_file);
-            perror("[Sender] Send failure");
+    // Send more message.
+    return fill_window(s, source, eof, opt);
+}
+
+/**
+ * @brief Reset congestion control and pacing for a new transfer on s.
+ * @param flows Flows sharing a fixed pacing rate
+*/
+static void start_transfer(rtp_session_t* s, uint32_t flows){
+    rtp_sender_t* control = s->sender;
+    // Each transfer starts probing the path afresh.
+    rtp_ccInit(&control->cc, s->cc_ops, control->window_size);
+    control->seq_resend = control->seq_next;
+    control->dup_acks = 0;
+    start_pacing(s, flows);
+
+    // Parity pkts must fit a datagram.
+    rtp_fecFree(&control->fec);
+    if(s->fec && (control->caps & RTP_CAP_FEC) && control->payload_size <= RTP_MAX_PAYLOAD - sizeof(rtp_parity_t)){
+        rtp_fecInit(&control->fec, s->fec_group, control->payload_size, control->window_size);
+        control->fec_buf = realloc(control->fec_buf, FEC_BUFS * RTP_PKT_ROOM(control->payload_size));
+    }
+
+    free(control->lz);
+    control->lz = NULL;
+    control->lz_skip = 0;
+    control->lz_backoff = 0;
+    if(s->compress && (control->caps & RTP_CAP_LZ)){
+        control->lz = calloc(1, sizeof(rtp_lz_t));
+        if(!control->lz_buf)
+            control->lz_buf = calloc(control->window_size, sizeof(char*));
+    }
+}
+
+/**
+ * @brief Shared sending loop of RTP and optimized RTP.
+ * @param s Connected session
+ * @param source Opened file, its range [begin, end) is sent
+ * @param opt false for Go-Back-N with cumulative ACK, true for selective repeat
+ * @param flows Flows sharing a fixed pacing rate
+ * @return -1 means failure, 0 means success
+*/
+static int send_source(rtp_session_t* s, file_source_t* source, bool opt, uint32_t flows){
+    rtp_sender_t* control = s->sender;
+    start_transfer(s, flows);
+    source->seq_begin = control->seq_next;
+
+    // Take file segments to window and send them, then wait for ACK.
+    bool eof = false;
+    if(fill_window(s, source, &eof, opt) == -1)
+        return -1;
+    while(!eof || control->seq_base < control->seq_next)
+        if(send_round(s, source, &eof, opt) == -1)
             return -1;
-        }
-        free(pkt);
-        sender_control->seq_next++;
+    return 0;
+}
+
+/**
+ * @brief Take the bytes of a stream write into the window, one pkt per full payload.
+ * Returns once every byte is in the window or kept in write_buf; streams are sent by selective repeat.
+ * @param flush Send the bytes short of a full pkt too, and wait until every pkt is acked
+ * @return -1 means failure, 0 means success
+*/
+static int send_stream(rtp_session_t* s, const struct iovec* iov, int iovcnt, bool flush){
+    rtp_sender_t* control = s->sender;
+    if(!control->write_buf){
+        start_transfer(s, 1);
+        control->write_buf = malloc(control->payload_size);
+        control->write_length = 0;
     }
+    file_source_t source;
+    memset(&source, 0, sizeof(source));
+    source.written = true;
+    source.iov = iov;
+    source.iovcnt = iovcnt;
+    source.flush = flush;
+
+    bool eof = false;
+    if(fill_window(s, &source, &eof, true) == -1)
+        return -1;
+    while(!eof || (flush && control->seq_base < control->seq_next))
+        if(send_round(s, &source, &eof, true) == -1)
+            return -1;
+    return 0;
+}
+
+ssize_t rtp_writev(rtp_session_t* session, const struct iovec* iov, int iovcnt){
+    if(!session->sender)
+        return -1;
+    ssize_t write_byte = 0;
+    for(int i = 0; i < iovcnt; i++)
+        write_byte += iov[i].iov_len;
+    if(send_stream(session, iov, iovcnt, false) == -1)
+        return -1;
+    return write_byte;
+}
+
+ssize_t rtp_write(rtp_session_t* session, const void* buf, size_t len){
+    struct iovec iov = {(void*)buf, len};
+    return rtp_writev(session, &iov, 1);
+}
 
-    // Wait for ACK
+int rtp_flush(rtp_session_t* session){
+    if(!session->sender)
+        return -1;
+    return send_stream(session, NULL, 0, true);
+}
+
+/**
+ * @brief Agree with the receiver that the flow of s carries stripe of a striped file.
+ * @return -1 means failure, 0 means success
+*/
+static int negotiate_stripe(rtp_session_t* s, const rtp_options_t* stripe){
+    if(!(s->sender->caps & RTP_CAP_STRIPE))
+        return -1;
+    rtp_options_t options = *stripe;
+    rtp_rto_t rto = s->sender->rto;
+    if(rtp_negotiate(s->fd, &s->addr, s->conn, &rto, &options, 0) == -1)
+        return -1;
+    if(!(options.flags & RTP_OPT_STRIPE) || options.transfer != stripe->transfer || options.stripe != stripe->stripe)
+        return -1;
+    return 0;
+}
+
+static void* stripe_main(void* arg){
+    stripe_flow_t* flow = arg;
+    rtp_session_t* parent = flow->parent;
+    rtp_session_t* s = rtp_createSession(parent->window_size);
+    s->cc_ops = parent->cc_ops;
+    s->payload_size = parent->payload_size;
+    s->offload = parent->offload;
+    rtp_sessionSetFEC(s, parent->fec, parent->fec_group);
+    s->compress = parent->compress;
+    s->resume = parent->resume;
+    s->delta = parent->delta;
+    rtp_sessionSetPacing(s, parent->pacing, parent->pace_rate, parent->txtime);
+    flow->state = -1;
+    if(connect_addr(s, &parent->addr) == 0 && negotiate_stripe(s, &flow->options) == 0)
+        flow->state = send_source(s, &flow->source, flow->opt, flow->options.stripes);
+    rtp_sessionClose(s);
+    return NULL;
+}
+
+/**
+ * @brief Ask the receiver how much of the file it kept from an interrupted transfer, and start source there.
+ * @param resumable Set to whether the receiver checkpoints this transfer
+ * @return -1 means failure, 0 means success
+*/
+static int negotiate_resume(rtp_session_t* s, file_source_t* source, bool* resumable){
+    rtp_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.flags = RTP_OPT_RESUME;
+    options.file = source->identity;
+    options.total = source->size;
+    if(rtp_negotiate(s->fd, &s->addr, s->conn, &s->sender->rto, &options, 0) == -1)
+        return -1;
+    *resumable = (options.flags & RTP_OPT_RESUME) && options.file == source->identity && options.resume <= source->size;
+    if(*resumable)
+        source->begin = options.resume;
+    return 0;
+}
+
+/**
+ * @brief Wait for the RTP_SIG pkts answering a request, storing the signatures in sigs.
+ * The wait starts over with every answer, so signing a large request never looks like a loss.
+ * @param got Bitmap of the blocks stored so far
+ * @return -1 means failure, 0 means success, whether or not every answer came
+*/
+static int recv_signatures(rtp_session_t* s, rtp_signature_t* sigs, uint64_t* got, uint32_t first, uint32_t end, rtp_packet_t* pkt, size_t size){
+    uint64_t deadline = mono_us() + rtp_rtoTimeout(&s->sender->rto) + SIG_SLACK;
     fd_set wait_fd;
-    while(true){
+    while(first < end){
+        uint64_t now = mono_us();
+        if(now >= deadline)
+            return 0;
         FD_ZERO(&wait_fd);
-        FD_SET(sendfd, &wait_fd);
-        struct timeval timeout = {0, 100000}; // 100ms
-        int res = select(sendfd + 1, &wait_fd, NULL, NULL, &timeout);
-        if(res == -1){
-            fclose(send_file);
+        FD_SET(s->fd, &wait_fd);
+        struct timeval timeout = {(deadline - now) / 1000000, (deadline - now) % 1000000};
+        int res = select(s->fd + 1, &wait_fd, NULL, NULL, &timeout);
+        if(res == -1)
             return -1;
+        if(res == 0)
+            return 0;
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        // Late ACKs of the options are skipped like any other stray pkt.
+        if(rtp_recv(s->fd, pkt, size, (struct sockaddr*)&from, &fromlen) == -1 || pkt->rtp.type != RTP_SIG)
+            continue;
+        uint32_t count = pkt->rtp.length / sizeof(rtp_signature_t);
+        uint32_t seq = pkt->rtp.seq_num;
+        if(seq < first || seq >= end || count > end - seq)
+            continue;
+        memcpy(sigs + seq, pkt->payload, count * sizeof(rtp_signature_t));
+        for(uint32_t k = seq; k < seq + count; k++)
+            rtp_setBit(got, k);
+        while(first < end && rtp_testBit(got, first))
+            first++;
+        deadline = mono_us() + rtp_rtoTimeout(&s->sender->rto) + SIG_SLACK;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fetch the signatures of the receiver's old file, SIG_REQUEST_BYTES of it per request.
+ * Blocks not answered are asked for again with backoff, up to RTP_END_RETRIES times in a row.
+ * @return Signatures of blocks blocks, NULL on failure
+*/
+static rtp_signature_t* fetch_signatures(rtp_session_t* s, uint32_t blocks, uint32_t block){
+    rtp_sender_t* control = s->sender;
+    rtp_signature_t* sigs = malloc((size_t)blocks * sizeof(rtp_signature_t));
+    uint64_t* got = calloc(rtp_bitmapWords(blocks), sizeof(uint64_t));
+    size_t size = RTP_PKT_ROOM(control->payload_size);
+    rtp_packet_t* pkt = malloc(size);
+    uint32_t per_request = SIG_REQUEST_BYTES / block;
+    uint32_t first = 0;
+    int retries = 0;
+    while(first < blocks && retries <= RTP_END_RETRIES){
+        rtp_sig_request_t request = {blocks - first < per_request ? blocks - first : per_request};
+        if(rtp_sendctlPayload(s->fd, RTP_SIG, first, &request, sizeof(request), (struct sockaddr*)&s->addr, sizeof(s->addr)) == -1
+            || recv_signatures(s, sigs, got, first, first + request.count, pkt, size) == -1)
+            break;
+        uint32_t next = first;
+        while(next < blocks && rtp_testBit(got, next))
+            next++;
+        if(next == first){
+            rtp_rtoBackoff(&control->rto);
+            retries++;
         }
-        else if(res == 0){
-            // No more message to send.
-            if(sender_control->send_length[0] == 0)
-                return 0;
-
-            // Resend message.
-            for(int i=0; i < sender_control->window_size; i++){
-                // Send message not acked.
-                if(sender_control->send_ack[i] == 1)
-                    continue;
-                if(sender_control->send_length[i] == 0)
-                    break;
-                rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[i], sender_control->seq_base + i, sender_control->send_buf[i]);
-                ssize_t send_len = sendto(sendfd, (void*)pkt, sizeof(rtp_header_t) + sender_control->send_length[i], 0, (struct sockaddr*)&servaddr, sizeof(servaddr));
-                if(send_len != sizeof(rtp_header_t) + sender_control->send_length[i]){
-                    free(pkt);
-                    fclose(send_file);
-                    perror("[Sender] Resend failure");
-                    return -1;
-                }
-                free(pkt);
-            }
+        else
+            retries = 0;
+        first = next;
+    }
+    free(pkt);
+    free(got);
+    if(first < blocks){
+        free(sigs);
+        return NULL;
+    }
+    return sigs;
+}
+
+/**
+ * @brief Ask the receiver for its old version of the file and, if it has one, replace source by a delta against it.
+ * @return -1 means failure, 0 means success, with or without a delta
+*/
+static int negotiate_delta(rtp_session_t* s, file_source_t* source){
+    rtp_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.flags = RTP_OPT_DELTA;
+    options.total = source->size;
+    if(rtp_negotiate(s->fd, &s->addr, s->conn, &s->sender->rto, &options, 0) == -1)
+        return -1;
+    if(!(options.flags & RTP_OPT_DELTA) || options.block < RTP_DELTA_MIN_BLOCK || options.block > RTP_DELTA_MAX_BLOCK
+        || options.basis < options.block || options.basis / options.block > UINT32_MAX)
+        return 0;
+    uint32_t blocks = options.basis / options.block;
+    rtp_signature_t* sigs = fetch_signatures(s, blocks, options.block);
+    if(!sigs)
+        return -1;
+    source->delta = rtp_createDelta(sigs, blocks, options.block, source->map, source->size);
+    s->sender->digest = crc32_combine(s->sender->digest, compute_checksum(source->map, source->size), source->size);
+    s->sender->digest_length += source->size;
+    return 0;
+}
+
+/**
+ * @brief Send a file over the flow of s, split into stripes over parallel flows when allowed.
+ * Stripes need a mapped file, a fresh flow and a receiver joining stripes, otherwise the file goes as one flow.
+ * @return -1 means failure, 0 means success
+*/
+static int send_message(rtp_session_t* s, const char* message, bool opt){
+    // Open file whose name is message.
+    file_source_t source;
+    if(source_open(&source, message) == -1){
+        perror("[Sender] Open file failure");
+        return -1;
+    }
+    uint32_t count = s->stripes;
+    if(source.stream || !(s->sender->caps & RTP_CAP_STRIPE) || s->sender->seq_next != 0)
+        count = 1;
+
+    // A resumable file goes as one flow from where the receiver's checkpoint left off.
+    bool resumable = false;
+    if(s->resume && source.identity && (s->sender->caps & RTP_CAP_OPTIONS) && s->sender->seq_next == 0){
+        if(negotiate_resume(s, &source, &resumable) == -1){
+            source_close(&source);
+            return -1;
         }
-        else if(FD_ISSET(sendfd, &wait_fd)){
-            // Receive ACK and check its checksum.
-            socklen_t addrlen = sizeof(servaddr);
-            rtp_packet_t* recv_ack = rtp_recvfrom(sendfd, (struct sockaddr*)&servaddr, &addrlen);
-            if(!recv_ack)
-                // If ACK pkt is broken
-                continue;
-            else{
-                if(recv_ack->rtp.seq_num == sender_control->seq_base){
-                    // Update sliding window
-                    int sliding_num = 0;
-                    sender_control->send_ack[0] = 1;
-                    for(;sliding_num < sender_control->window_size; sliding_num++){
-                        if(sender_control->send_ack[sliding_num] == 0)
-                            break;
-                    }
-                    for(int i = sliding_num; i < sender_control->window_size; i++){
-                        memset(sender_control->send_buf[i - sliding_num], 0, PAYLOAD_SIZE);
-                        if(sender_control->send_length[i] != 0)
-                            memcpy(sender_control->send_buf[i - sliding_num], sender_control->send_buf[i], sender_control->send_length[i]);
-                        sender_control->send_length[i - sliding_num] = sender_control->send_length[i];
-                        sender_control->send_ack[i - sliding_num] = sender_control->send_ack[i];
-                    }
-                    for(int i = 0; i < sliding_num; i++){
-                        int j = sender_control->window_size - 1 - i;
-                        if(sender_control->send_length[j] != 0){
-                            memset(sender_control->send_buf[j], 0, PAYLOAD_SIZE);
-                            sender_control->send_length[j] = 0;
-                        }
-                        sender_control->send_ack[j] = 0;
-                    }
-                    sender_control->seq_base += sliding_num;
-                    
-                    // Send more message.
-                    // Read from file first.
-                    for(int i=0; i < sliding_num; i++){
-                        int j = sender_control->window_size - sliding_num + i;
-                        size_t read_byte = fread(sender_control->send_buf[j], 1, PAYLOAD_SIZE, send_file);
-                        if(read_byte == 0)
-                            break;
-                        sender_control->send_length[j] = read_byte;
-                        message_num++;
-                    }
-
-                    // No more message to send.
-                    if(sender_control->seq_base >= message_num){
-                        free(recv_ack);
-                        break;
-                    }
-
-                    // Send new message.
-                    for(int i = 0; i < sliding_num; i++){
-                        int j = sender_control->window_size - sliding_num + i;
-                        if(sender_control->send_length[j] == 0)
-                            break;
-                        // rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[j], sender_control->seq_base + j, sender_control->send_buf[j]);
-                        rtp_packet_t* pkt = rtp_packet(RTP_DATA, sender_control->send_length[j], sender_control->seq_next, sender_control->send_buf[j]);                        
-                        ssize_t send_len = sendto(sendfd, (void*)pkt, sizeof(rtp_header_t) + sender_control->send_length[j], 0, (struct sockaddr*)&servaddr, sizeof(servaddr));
-                        if(send_len != sizeof(rtp_header_t) + sender_control->send_length[j]){
-                            free(pkt);
-                            perror("[Sender] Send failure");
-                            fclose(send_file);
-                            return -1;
-                        }
-                        free(pkt);
-                        sender_control->seq_next++;
-                    }
-                }
-                else if(recv_ack->rtp.seq_num > sender_control->seq_base){
-                    int ack_num = recv_ack->rtp.seq_num - sender_control->seq_base;
-                    sender_control->send_ack[ack_num] = 1;
-                }
-            }
-            free(recv_ack);
+        if(resumable)
+            count = 1;
+    }
+
+    // A delta goes as one flow too, its bytes no longer line up with the file.
+    if(s->delta && source.map && !resumable && (s->sender->caps & RTP_CAP_OPTIONS) && s->sender->seq_next == 0){
+        if(negotiate_delta(s, &source) == -1){
+            source_close(&source);
+            return -1;
         }
+        if(source.delta)
+            count = 1;
     }
-    fclose(send_file);
-    return 0;
-}
\ No newline at end of file
+
+    // Cut the file at pkt boundaries, leaving no stripe empty.
+    uint32_t payload = s->sender->payload_size;
+    uint64_t pkts = (source.size + payload - 1) / payload;
+    uint64_t stripe_size = count > 1 ? (pkts + count - 1) / count * payload : source.size;
+    if(count > 1)
+        count = (source.size + stripe_size - 1) / stripe_size;
+    if(count <= 1){
+        int state = send_source(s, &source, opt, 1);
+        source_close(&source);
+        return state;
+    }
+
+    uint64_t transfer;
+    if(getrandom(&transfer, sizeof(transfer), 0) != sizeof(transfer))
+        transfer = mono_us() ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)s;
+    stripe_flow_t* flows = calloc(count, sizeof(stripe_flow_t));
+    for(uint32_t i = 0; i < count; i++){
+        flows[i].parent = s;
+        flows[i].source = source;
+        flows[i].source.begin = i * stripe_size;
+        flows[i].source.end = i + 1 < count ? (i + 1) * stripe_size : source.size;
+        flows[i].source.advised = 0;
+        flows[i].options = (rtp_options_t){
+            .flags = RTP_OPT_STRIPE,
+            .transfer = transfer,
+            .offset = i * stripe_size,
+            .total = source.size,
+            .stripe = i,
+            .stripes = count,
+        };
+        flows[i].opt = opt;
+    }
+
+    // Stripe 0 goes over s itself, the others over flows of their own.
+    uint32_t started = 1;
+    for(; started < count; started++)
+        if(pthread_create(&flows[started].thread, NULL, stripe_main, &flows[started]) != 0)
+            break;
+    int state = started == count ? negotiate_stripe(s, &flows[0].options) : -1;
+    if(state == 0)
+        state = send_source(s, &flows[0].source, opt, count);
+    for(uint32_t i = 1; i < started; i++){
+        pthread_join(flows[i].thread, NULL);
+        if(flows[i].state == -1)
+            state = -1;
+    }
+    free(flows);
+    source_close(&source);
+    return state;
+}
+
+int rtp_sessionSend(rtp_session_t* session, const char* message, int opt){
+    if(!session->sender)
+        return -1;
+    return send_message(session, message, opt != 0);
+}
+
+/**
+ * @brief Apply sender settings to the session of initSender.
+*/
+static rtp_session_t* legacy_session(){
+    sender_session->cc_ops = cc_ops;
+    sender_session->stripes = stripes;
+    rtp_sessionSetPacing(sender_session, pacing, pace_rate, txtime);
+    rtp_sessionSetFEC(sender_session, fec, fec_group);
+    rtp_sessionSetCompression(sender_session, compress);
+    rtp_sessionSetResume(sender_session, resume);
+    rtp_sessionSetDelta(sender_session, delta);
+    return sender_session;
+}
+
+int sendMessage(const char* message){
+    return send_message(legacy_session(), message, false);
+}
+
+void terminateSender(){
+    rtp_sessionClose(sender_session);
+    sender_session = NULL;
+    return;
+}
+
+int sendMessageOpt(const char* message){
+    return send_message(legacy_session(), message, true);
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include "cc.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +36,88 @@ int sendMessage(const char* message);
 int sendMessageOpt(const char* message);
 
 
+/**
+ * @brief 设置拥塞控制算法 (在sendMessage/sendMessageOpt之前调用)
+ * 拥塞窗口cwnd不会超过window大小，默认为newreno
+ * @param name "none"表示始终使用整个window，"newreno"表示AIMD，"cubic"表示CUBIC
+ * @return -1表示算法不存在，0表示设置成功
+ **/
+int setSenderCongestionControl(const char* name);
+
+/**
+ * @brief 设置数据包的payload大小 (在initSender之前调用)，默认PAYLOAD_SIZE(1461)
+ * 建立连接时与receiver协商，receiver支持的上限更小时取其上限；receiver不支持协商时仍为PAYLOAD_SIZE。
+ * 回环或巨型帧网络上更大的包可以大幅减少每包开销
+ * @param size 字节数，最大65496；0表示按路由MTU探测路径：依次用填充到路由MTU、9000字节巨型帧大小的请求试探，
+ * 都没有回应时使用PAYLOAD_SIZE
+ **/
+void setSenderPayloadSize(uint32_t size);
+
+/**
+ * @brief 设置文件分几段并行发送 (在sendMessage/sendMessageOpt之前调用)，默认为1
+ * 每段使用独立的连接与拥塞控制，只有receiver为createReceiverServer/createReceiverShards且文件可以mmap时生效，
+ * 否则整个文件仍经由一个连接发送
+ * @param count 段数，0视为1
+ **/
+void setSenderStripes(uint32_t count);
+
+/**
+ * @brief 设置发送节奏 (在sendMessage/sendMessageOpt之前调用)，默认关闭
+ * 开启后用令牌桶把window内的包按速率均匀发出，而不是窗口一打开就连续发出，减少接收端缓冲区溢出造成的丢包
+ * @param enable 1表示开启，0表示关闭
+ * @param rate 速率(字节/秒)，0表示按拥塞窗口与平滑RTT估计 (cwnd/srtt，留有余量)
+ * @param txtime 1表示用SO_TXTIME把每个包的发送时刻交给内核，由fq队列规则按时发出；设置失败时退回令牌桶
+ **/
+void setSenderPacing(int enable, uint64_t rate, int txtime);
+
+/**
+ * @brief 设置是否使用UDP GSO (在initSender之前调用)，默认开启
+ * 开启后同一批中大小相同的连续数据包合成一次发送，由内核切分，减少系统调用和协议栈开销；
+ * 内核或网卡不支持时自动退回逐包发送
+ * @param enable 1表示开启，0表示关闭
+ **/
+void setSenderOffload(int enable);
+
+/**
+ * @brief 设置前向纠错 (在sendMessage/sendMessageOpt之前调用)，默认关闭
+ * 开启后每组连续的数据包之后多发一个异或校验包，receiver丢了组内任意一个包时可以直接恢复，不必等待重传；
+ * 一组丢两个以上仍靠重传。receiver不支持时不发送校验包
+ * @param enable 1表示开启，0表示关闭
+ * @param group 每多少个数据包发一个校验包(2~64，且不超过window的一半)，0表示按重传比例自动调整：丢包越多组越小
+ **/
+void setSenderFEC(int enable, uint32_t group);
+
+/**
+ * @brief 设置逐包压缩 (在sendMessage/sendMessageOpt之前调用)，默认关闭
+ * 开启后每个数据包的内容按LZ4块格式压缩后发送，receiver解压后再写入；receiver在握手时未声明支持解压时照常发送原始数据。
+ * 压缩后不能明显变小的包按原样发送，连续遇到时暂时跳过压缩，随机或已压缩的文件几乎不增加开销
+ * @param enable 1表示开启，0表示关闭
+ **/
+void setSenderCompression(int enable);
+
+/**
+ * @brief 设置断点续传 (在sendMessage/sendMessageOpt之前调用)，默认关闭
+ * 开启后发送前把文件标识(设备、inode、大小和修改时间)告诉receiver，receiver保存有同一文件此前中断的传输时，
+ * 只发送其后的部分。receiver不支持或文件不是可映射的普通文件时照常发送整个文件；可续传的文件不分条带发送
+ * @param enable 1表示开启，0表示关闭
+ **/
+void setSenderResume(int enable);
+
+/**
+ * @brief 设置增量传输 (在sendMessage/sendMessageOpt之前调用)，默认关闭
+ * 开启后先取得receiver上同名旧文件各块的签名(滚动弱校验和与64位强哈希)，在新文件中逐字节滑动匹配，
+ * 只发送与旧文件不同的字节，其余部分以"复制旧文件第几块"的指令代替。receiver不支持、没有旧文件、
+ * 已协商断点续传或文件不是可映射的普通文件时照常发送整个文件；增量传输不分条带发送
+ * @param enable 1表示开启，0表示关闭
+ **/
+void setSenderDelta(int enable);
+
+/**
+ * @brief 获取当前的拥塞控制状态 (cwnd、ssthresh、丢包与超时次数等)，用于比较不同算法
+ * @return 指向拥塞控制状态的指针，在terminateSender之前有效；未建立连接时为NULL
+ **/
+const rtp_cc_t* getSenderCongestionState();
+
 /**
  * @brief 用于断开RTP连接以及关闭UDP socket
  **/
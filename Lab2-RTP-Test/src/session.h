@@ -0,0 +1,191 @@
+#ifndef __SESSION_H
+#define __SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "cc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 一次传输的句柄。状态全部在句柄中，不同句柄可以在不同线程中同时使用，
+// 同一个句柄同一时间只能在一个线程中使用。
+typedef struct RTP_session rtp_session_t;
+
+/**
+ * @brief 创建会话句柄，之后用rtp_sessionConnect作为发送方或rtp_sessionAccept作为接收方
+ * 默认使用newreno拥塞控制、按序缓冲写入、每2个按序包回一个ACK且最多推迟1000微秒，
+ * 不受setSenderCongestionControl等全局设置影响
+ * @param window_size window大小
+ * @return 会话句柄，用rtp_sessionClose释放
+ */
+rtp_session_t* rtp_createSession(uint32_t window_size);
+
+/**
+ * @brief 作为发送方建立RTP连接 (同initSender)
+ * @param session 会话句柄
+ * @param receiver_ip receiver的IP地址
+ * @param receiver_port receiver的端口
+ * @return -1表示连接失败，0表示连接成功
+ */
+int rtp_sessionConnect(rtp_session_t* session, const char* receiver_ip, uint16_t receiver_port);
+
+/**
+ * @brief 作为接收方在所有IP的port端口监听并等待连接 (同initReceiver)
+ * @param session 会话句柄
+ * @param port 监听的port
+ * @return -1表示连接失败，0表示连接成功
+ */
+int rtp_sessionAccept(rtp_session_t* session, uint16_t port);
+
+/**
+ * @brief 发送文件 (同sendMessage/sendMessageOpt)
+ * @param session 已连接的会话句柄
+ * @param message 要发送的文件名
+ * @param opt 0表示Go-Back-N，1表示优化版本的RTP
+ * @return -1表示发送失败，0表示发送成功
+ */
+int rtp_sessionSend(rtp_session_t* session, const char* message, int opt);
+
+/**
+ * @brief 接收数据直到对方发来END (同recvMessage/recvMessageOpt)
+ * @param session 已接受连接的会话句柄
+ * @param filename 用于接收数据的文件名
+ * @param opt 0同recvMessage，1同recvMessageOpt
+ * @return >0表示接收到的字节数(2 GiB及以上为INT_MAX) RTP_RECV_CORRUPT(-2)表示数据与发送方的摘要不符 -1表示出现错误
+ */
+int rtp_sessionRecv(rtp_session_t* session, const char* filename, int opt);
+
+/**
+ * @brief 以字节流方式发送，可以多次调用，总长度不必事先知道
+ * 小块写入会合并成完整payload的包再发出，不足一个包的字节留到下次写入或rtp_flush；
+ * 数据在返回前已复制，buf随即可以重用。只在window已满时阻塞等待ACK。使用优化版本的RTP
+ * @param session 已连接的会话句柄
+ * @param buf 要发送的数据
+ * @param len 字节数
+ * @return 写入的字节数(总是len)，-1表示发送失败
+ */
+ssize_t rtp_write(rtp_session_t* session, const void* buf, size_t len);
+
+/**
+ * @brief 同rtp_write，依次发送iovcnt段数据
+ * @return 写入的字节数，-1表示发送失败
+ */
+ssize_t rtp_writev(rtp_session_t* session, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief 发出rtp_write留下的不足一个包的字节，并等待所有数据被确认
+ * 在rtp_sessionClose之前调用，否则留下的字节会被丢弃
+ * @return -1表示发送失败，0表示成功
+ */
+int rtp_flush(rtp_session_t* session);
+
+/**
+ * @brief 以字节流方式接收，按序到达的数据一经到达即可读出
+ * 没有可读数据时阻塞等待，对方发来END或10秒内没有数据视为流结束；END附带的摘要与收到的数据不符时返回-1
+ * @param session 已接受连接的会话句柄
+ * @param buf 接收缓冲区
+ * @param len 最多读取的字节数
+ * @return >0表示读取的字节数，0表示流已结束，-1表示出现错误
+ */
+ssize_t rtp_read(rtp_session_t* session, void* buf, size_t len);
+
+/**
+ * @brief 同rtp_read，依次填入iovcnt段缓冲区
+ * @return >0表示读取的字节数，0表示流已结束，-1表示出现错误
+ */
+ssize_t rtp_readv(rtp_session_t* session, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief 断开RTP连接 (发送方会先发送END)，关闭socket并释放句柄
+ * @param session 会话句柄，可以为NULL
+ */
+void rtp_sessionClose(rtp_session_t* session);
+
+/**
+ * @brief 设置该会话发送时的拥塞控制算法
+ * @param name "none"、"newreno"或"cubic"
+ * @return -1表示算法不存在，0表示设置成功
+ */
+int rtp_sessionSetCongestionControl(rtp_session_t* session, const char* name);
+
+/**
+ * @brief 设置该会话发送文件时分几段并行发送，同setSenderStripes
+ * 第0段经由该会话发送，其余各段各自建立连接；拥塞控制状态只反映第0段
+ * @param count 段数，0视为1
+ */
+void rtp_sessionSetStripes(rtp_session_t* session, uint32_t count);
+
+/**
+ * @brief 设置该会话发送时的节奏控制，同setSenderPacing
+ * @param enable 1表示按速率均匀发送，0表示窗口打开时立即发送
+ * @param rate 速率(字节/秒)，0表示按cwnd/srtt估计；分段发送时由各段平分
+ * @param txtime 1表示用SO_TXTIME把发送时刻交给内核(需要fq队列规则)，不可用时退回令牌桶
+ */
+void rtp_sessionSetPacing(rtp_session_t* session, int enable, uint64_t rate, int txtime);
+
+/**
+ * @brief 设置该会话的payload大小 (在rtp_sessionConnect/rtp_sessionAccept之前调用)
+ * 发送方同setSenderPayloadSize，0表示探测路径；接收方同setReceiverMaxPayload，为可以接受的上限
+ * @param size 字节数，最大65496
+ */
+void rtp_sessionSetPayloadSize(rtp_session_t* session, uint32_t size);
+
+/**
+ * @brief 设置该会话是否使用UDP分段卸载 (在rtp_sessionConnect/rtp_sessionAccept之前调用)，默认开启
+ * 发送方同setSenderOffload，接收方同setReceiverOffload；内核不支持时自动按普通数据报收发
+ * @param enable 1表示开启，0表示关闭
+ */
+void rtp_sessionSetOffload(rtp_session_t* session, int enable);
+
+/**
+ * @brief 设置该会话发送时的前向纠错，同setSenderFEC
+ * @param enable 1表示开启，0表示关闭
+ * @param group 每多少个数据包发一个校验包，0表示按重传比例自动调整
+ */
+void rtp_sessionSetFEC(rtp_session_t* session, int enable, uint32_t group);
+
+/**
+ * @brief 设置该会话发送时是否压缩数据包，同setSenderCompression
+ * @param enable 1表示开启，0表示关闭
+ */
+void rtp_sessionSetCompression(rtp_session_t* session, int enable);
+
+/**
+ * @brief 获取该会话的拥塞控制状态
+ * @return 指向拥塞控制状态的指针，在rtp_sessionClose之前有效；未作为发送方连接时为NULL
+ */
+const rtp_cc_t* rtp_sessionCongestionState(const rtp_session_t* session);
+
+/**
+ * @brief 设置该会话接收数据的写入方式，同setReceiverDirectWrite
+ * @param enable 1表示直接写入，0表示按序缓冲写入
+ */
+void rtp_sessionSetDirectWrite(rtp_session_t* session, int enable);
+
+/**
+ * @brief 设置该会话是否断点续传，同setSenderResume/setReceiverResume
+ * @param enable 1表示开启，0表示关闭
+ */
+void rtp_sessionSetResume(rtp_session_t* session, int enable);
+
+/**
+ * @brief 设置该会话是否增量传输，同setSenderDelta/setReceiverDelta
+ * @param enable 1表示开启，0表示关闭
+ */
+void rtp_sessionSetDelta(rtp_session_t* session, int enable);
+
+/**
+ * @brief 设置该会话接收时的ACK合并策略，同setReceiverAckPolicy
+ * @param every 每多少个按序包回一个ACK，1表示逐包回ACK
+ * @param delay_us ACK最长推迟时间(微秒)
+ */
+void rtp_sessionSetAckPolicy(rtp_session_t* session, uint32_t every, uint32_t delay_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,9 +4,20 @@
 #include <stdint.h>
 #include <thread>
 #include <fcntl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
 #include<cstring>
+#include <climits>
 #include "sender_def.h"
 #include "receiver_def.h"
+#include "util.h"
+#include "wheel.h"
+#include "rtp.h"
+#include "session.h"
 int diff_file(char *f1, char *f2)
 {
     FILE* fp1 = fopen(f1, "rb");
@@ -402,6 +413,40 @@ TEST(RTP, OPT_RECEIVER_TEST_MIXED_2)
     EXPECT_EQ(opt_receiver_test(message, recvfile, ws, pb, er), 1);
 }
 
+TEST(RTP, DIRECT_RECEIVER_TEST_MIXED)
+{
+    char* message = (char*)"testdata";
+    char* recvfile = (char*)"recvfile";
+    char* ws = (char*)"256";
+    char* pb = (char*)"10";
+    char* er = (char*)"73";
+    setReceiverDirectWrite(1);
+    EXPECT_EQ(receiver_test(message, recvfile, ws, pb, er), 1);
+    setReceiverDirectWrite(0);
+}
+
+TEST(RTP, DIRECT_OPT_RECEIVER_TEST_MIXED)
+{
+    char* message = (char*)"testdata";
+    char* recvfile = (char*)"recvfile";
+    char* ws = (char*)"256";
+    char* pb = (char*)"10";
+    char* er = (char*)"73";
+    setReceiverDirectWrite(1);
+    EXPECT_EQ(opt_receiver_test(message, recvfile, ws, pb, er), 1);
+    setReceiverDirectWrite(0);
+}
+
+TEST(RTP, COALESCED_ACK_NO_FAILURE_OPT)
+{
+    char* message = (char*)"testdata";
+    char* recvfile = (char*)"recvfile";
+    char* ws = (char*)"256";
+    setReceiverAckPolicy(16, 2000);
+    EXPECT_EQ(easy_opt_test(message, recvfile, ws), 1);
+    setReceiverAckPolicy(2, 1000);
+}
+
 TEST(RTP, OPT_SENDER_TEST_LOST_ACK)
 {
     char* message = (char*)"testdata";
@@ -462,6 +507,1288 @@ TEST(RTP, OPT_SENDER_TEST_MIXED_2)
     EXPECT_EQ(opt_sender_test(message, recvfile, ws, pb, er), 1);
 }
 
+TEST(RTP, CHECKSUM)
+{
+    EXPECT_EQ(compute_checksum("123456789", 9), 0xCBF43926u);
+    EXPECT_EQ(compute_checksum("", 0), 0u);
+
+    // Any split of the input, aligned or not, gives the same CRC.
+    static char buf[4096 + 16];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (char)(i * 131 + (i >> 3));
+    for (size_t off = 0; off < 16; off += 5)
+    {
+        uint32_t whole = compute_checksum(buf + off, 4096);
+        for (size_t cut = 0; cut <= 4096; cut += 173)
+        {
+            uint32_t crc = 0;
+            crc32(buf + off, cut, &crc);
+            crc32(buf + off + cut, 4096 - cut, &crc);
+            EXPECT_EQ(crc, whole);
+        }
+    }
+}
+
+TEST(RTP, RTO_ESTIMATE)
+{
+    rtp_rto_t rto;
+    rtp_rtoInit(&rto);
+    EXPECT_EQ(rtp_rtoTimeout(&rto), (uint64_t)RTP_RTO_INIT);
+
+    // First sample: SRTT = R, RTTVAR = R / 2, RTO = SRTT + 4 * RTTVAR.
+    rtp_rtoSample(&rto, 40000);
+    EXPECT_EQ(rto.srtt, 40000u);
+    EXPECT_EQ(rto.rttvar, 20000u);
+    EXPECT_EQ(rtp_rtoTimeout(&rto), 120000u);
+
+    // Backoff doubles up to the bound, a new sample clears it.
+    rtp_rtoBackoff(&rto);
+    rtp_rtoBackoff(&rto);
+    EXPECT_EQ(rtp_rtoTimeout(&rto), 480000u);
+    for (int i = 0; i < 100; i++)
+        rtp_rtoBackoff(&rto);
+    EXPECT_EQ(rtp_rtoTimeout(&rto), (uint64_t)RTP_RTO_MAX);
+    rtp_rtoSample(&rto, 40000);
+    EXPECT_EQ(rto.srtt, 40000u);
+    EXPECT_EQ(rto.rttvar, 15000u);
+    EXPECT_EQ(rtp_rtoTimeout(&rto), 100000u);
+
+    // Tiny RTT is held at the lower bound.
+    for (int i = 0; i < 100; i++)
+        rtp_rtoSample(&rto, 50);
+    EXPECT_EQ(rtp_rtoTimeout(&rto), (uint64_t)RTP_RTO_MIN);
+}
+
+TEST(RTP, CONGESTION_CONTROL)
+{
+    rtp_cc_t cc;
+    EXPECT_EQ(rtp_ccFind("none"), &rtp_cc_none);
+    EXPECT_EQ(rtp_ccFind("bbr"), (const rtp_cc_ops_t*)NULL);
+
+    // NewReno: slow start is bounded by the window, a loss halves cwnd once per window.
+    rtp_ccInit(&cc, rtp_ccFind("newreno"), 64);
+    EXPECT_EQ(rtp_ccWindow(&cc), 4u);
+    for (int i = 0; i < 100; i++)
+        rtp_ccAck(&cc, 1, 0, 1000);
+    EXPECT_EQ(rtp_ccWindow(&cc), 64u);
+    rtp_ccLoss(&cc, 100, 164, 0);
+    rtp_ccLoss(&cc, 120, 164, 0);
+    EXPECT_EQ(rtp_ccWindow(&cc), 32u);
+    EXPECT_EQ(cc.losses, 1u);
+    rtp_ccAck(&cc, 32, 0, 1000);
+    EXPECT_EQ(rtp_ccWindow(&cc), 33u);
+    rtp_ccTimeout(&cc, 200, 0);
+    EXPECT_EQ(rtp_ccWindow(&cc), 1u);
+    EXPECT_EQ(cc.timeouts, 1u);
+
+    // CUBIC: reduce by beta, then climb back to the plateau within K seconds.
+    rtp_ccInit(&cc, rtp_ccFind("cubic"), 1024);
+    for (int i = 0; i < 96; i++)
+        rtp_ccAck(&cc, 1, 0, 1000);
+    EXPECT_EQ(rtp_ccWindow(&cc), 100u);
+    rtp_ccLoss(&cc, 0, 100, 1000000);
+    EXPECT_EQ(rtp_ccWindow(&cc), 70u);
+    uint64_t now = 1000000;
+    for (int i = 0; i < 5000 && cc.cwnd < 100; i++, now += 1000)
+        rtp_ccAck(&cc, 1, now, 1000);
+    EXPECT_GE(cc.cwnd, 99.0);
+    EXPECT_GE(now - 1000000, (uint64_t)(cc.k * 1e6) / 2);
+    EXPECT_LE(now - 1000000, (uint64_t)(cc.k * 1e6) + 500000);
+
+    // No congestion control keeps the whole window.
+    rtp_ccInit(&cc, &rtp_cc_none, 32);
+    rtp_ccTimeout(&cc, 0, 0);
+    EXPECT_EQ(rtp_ccWindow(&cc), 32u);
+}
+
+static void record_expire(uint32_t id, void* arg)
+{
+    ((uint64_t*)arg)[id] = ((uint64_t*)arg)[64];
+}
+
+TEST(RTP, TIMING_WHEEL)
+{
+    // fired[64] holds the current time, fired[id] the time timer id fired.
+    uint64_t fired[65] = {0};
+    uint64_t expire[64];
+    rtp_wheel_t* wheel = rtp_createWheel(64, 1000, 0);
+    for (uint32_t id = 0; id < 64; id++)
+    {
+        // Spread over every level, including past a level boundary.
+        expire[id] = (uint64_t)(id * id * id * 97 + id) * 1000 + 1;
+        rtp_wheelSchedule(wheel, id, expire[id]);
+    }
+    rtp_wheelCancel(wheel, 7);
+    rtp_wheelSchedule(wheel, 9, 5000);
+    expire[9] = 5000;
+
+    for (uint64_t now = 0; ; )
+    {
+        fired[64] = now;
+        rtp_wheelAdvance(wheel, now, record_expire, fired);
+        uint64_t wait = rtp_wheelTimeout(wheel, now);
+        if (wait == UINT64_MAX)
+            break;
+        now += wait > 0 ? wait : 1000;
+    }
+    for (uint32_t id = 0; id < 64; id++)
+    {
+        if (id == 7)
+        {
+            EXPECT_EQ(fired[id], 0u);
+            continue;
+        }
+        // Never early, at most one tick late.
+        EXPECT_GE(fired[id], expire[id]);
+        EXPECT_LT(fired[id], expire[id] + 1000);
+    }
+    EXPECT_EQ(wheel->active, 0u);
+    rtp_freeWheel(wheel);
+}
+
+static void server_done(const char* filename, const struct sockaddr_in* peer, int bytes, void* arg)
+{
+    std::vector<std::pair<std::string, int>>* done = (std::vector<std::pair<std::string, int>>*)arg;
+    done->push_back(std::make_pair(std::string(filename), bytes));
+}
+
+TEST(RTP, RECEIVER_SERVER_MULTI_SESSION)
+{
+    const int senders = 8;
+    std::vector<std::pair<std::string, int>> done;
+    rtp_server_t* server = createReceiverServer(12350, 64, 16, 300, ".", 0);
+    ASSERT_NE(server, nullptr);
+    setReceiverServerCallback(server, server_done, &done);
+
+    // Senders run in their own processes, each from its own port.
+    pid_t pids[senders];
+    for (int i = 0; i < senders; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            if (initSender("127.0.0.1", 12350, 64) == 0)
+            {
+                if (i % 2)
+                    sendMessageOpt((char*)"testdata");
+                else
+                    sendMessage((char*)"testdata");
+                terminateSender();
+            }
+            _exit(0);
+        }
+    }
+
+    // A peer going silent after START is evicted.
+    int idlefd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(12350);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    rtp_sendctl(idlefd, RTP_START, 1234, (struct sockaddr*)&to, sizeof(to));
+
+    std::thread server_thread(runReceiverServer, server);
+    for (int i = 0; i < senders; i++)
+        waitpid(pids[i], NULL, 0);
+    usleep(600000);
+    stopReceiverServer(server);
+    server_thread.join();
+    freeReceiverServer(server);
+    close(idlefd);
+
+    int complete = 0, evicted = 0;
+    for (auto& session : done)
+    {
+        if (session.second == -1)
+            evicted++;
+        else if (session.second == 3000000 && diff_file((char*)"testdata", (char*)session.first.c_str()) == 1)
+            complete++;
+        remove(session.first.c_str());
+    }
+    EXPECT_EQ(complete, senders);
+    EXPECT_EQ(evicted, 1);
+}
+
+static void session_receiver(int id, int* bytes)
+{
+    rtp_session_t* session = rtp_createSession(128);
+    rtp_sessionSetDirectWrite(session, id % 2);
+    char filename[32];
+    sprintf(filename, "recvfile_%d", id);
+    if (rtp_sessionAccept(session, 12370 + id) == 0)
+        *bytes = rtp_sessionRecv(session, filename, id % 2);
+    rtp_sessionClose(session);
+}
+
+// Sets the option a test exercises on a sender session before it connects.
+typedef std::function<void(rtp_session_t*)> session_setup;
+
+static void session_sender(uint16_t port, const char* filename, int opt, session_setup setup, int* state, uint32_t* pkts)
+{
+    rtp_session_t* session = rtp_createSession(128);
+    setup(session);
+    if (rtp_sessionConnect(session, "127.0.0.1", port) == 0)
+    {
+        *state = rtp_sessionSend(session, filename, opt);
+        if (pkts)
+            *pkts = session->sender->seq_next;
+    }
+    rtp_sessionClose(session);
+}
+
+// Send filename from a sender set up by setup to session_receiver id.
+static void session_transfer(int id, const char* filename, session_setup setup, int* bytes, int* state)
+{
+    std::thread receiver(session_receiver, id, bytes);
+    usleep(10000);
+    std::thread sender(session_sender, 12370 + id, filename, id % 2, setup, state, nullptr);
+    sender.join();
+    receiver.join();
+}
+
+TEST(RTP, SESSION_CONCURRENT_TRANSFERS)
+{
+    const int pairs = 4;
+    int bytes[pairs], states[pairs];
+    std::vector<std::thread> threads;
+    for (int i = 0; i < pairs; i++)
+    {
+        bytes[i] = states[i] = -1;
+        threads.emplace_back(session_receiver, i, &bytes[i]);
+    }
+    usleep(10000);
+    for (int i = 0; i < pairs; i++)
+    {
+        session_setup setup = [i](rtp_session_t* session) {
+            rtp_sessionSetCongestionControl(session, i % 2 ? "cubic" : "newreno");
+        };
+        threads.emplace_back(session_sender, 12370 + i, "testdata", i % 2, setup, &states[i], nullptr);
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    for (int i = 0; i < pairs; i++)
+    {
+        char filename[32];
+        sprintf(filename, "recvfile_%d", i);
+        EXPECT_EQ(states[i], 0);
+        EXPECT_EQ(bytes[i], 3000000);
+        EXPECT_EQ(diff_file((char*)"testdata", filename), 1);
+        remove(filename);
+    }
+}
+
+struct shard_record
+{
+    std::vector<std::pair<std::string, int>> done;
+    std::vector<struct sockaddr_in> peers;
+};
+
+static void shard_done(const char* filename, const struct sockaddr_in* peer, int bytes, void* arg)
+{
+    shard_record* record = (shard_record*)arg;
+    record->done.push_back(std::make_pair(std::string(filename), bytes));
+    record->peers.push_back(*peer);
+}
+
+TEST(RTP, SHARDED_RECEIVER)
+{
+    const int count = 4, senders = 8;
+    rtp_shards_t* shards = createReceiverShards(12380, count, 64, 16, 1000, ".", 1);
+    ASSERT_NE(shards, nullptr);
+    shard_record records[count];
+    for (int i = 0; i < count; i++)
+        setReceiverServerCallback(getReceiverShard(shards, i), shard_done, &records[i]);
+    ASSERT_EQ(startReceiverShards(shards), 0);
+
+    int states[senders];
+    std::vector<std::thread> threads;
+    for (int i = 0; i < senders; i++)
+    {
+        states[i] = -1;
+        threads.emplace_back([i, &states]() {
+            rtp_session_t* session = rtp_createSession(64);
+            if (rtp_sessionConnect(session, "127.0.0.1", 12380) == 0)
+                states[i] = rtp_sessionSend(session, "testdata", i % 2);
+            rtp_sessionClose(session);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    stopReceiverShards(shards);
+
+    // Every session ends on the shard its sender is steered to.
+    int complete = 0;
+    for (int i = 0; i < count; i++)
+        for (size_t j = 0; j < records[i].done.size(); j++)
+        {
+            uint32_t shard = receiverShardOf(shards, &records[i].peers[j]);
+            if (shard != UINT32_MAX)
+            {
+                EXPECT_EQ(shard, (uint32_t)i);
+            }
+            if (records[i].done[j].second == 3000000 && diff_file((char*)"testdata", (char*)records[i].done[j].first.c_str()) == 1)
+                complete++;
+            remove(records[i].done[j].first.c_str());
+        }
+    freeReceiverShards(shards);
+    for (int i = 0; i < senders; i++)
+        EXPECT_EQ(states[i], 0);
+    EXPECT_EQ(complete, senders);
+}
+
+TEST(RTP, STRIPED_TRANSFER)
+{
+    const int count = 4, stripes = 4;
+    // Stripes also probe for larger pkts.
+    setReceiverMaxPayload(16384);
+    rtp_shards_t* shards = createReceiverShards(12390, count, 64, 16, 1000, ".", 1);
+    setReceiverMaxPayload(PAYLOAD_SIZE);
+    ASSERT_NE(shards, nullptr);
+    shard_record records[count];
+    for (int i = 0; i < count; i++)
+        setReceiverServerCallback(getReceiverShard(shards, i), shard_done, &records[i]);
+    ASSERT_EQ(startReceiverShards(shards), 0);
+
+    rtp_session_t* session = rtp_createSession(64);
+    rtp_sessionSetStripes(session, stripes);
+    rtp_sessionSetPayloadSize(session, 0);
+    int state = -1;
+    uint32_t payload = 0;
+    if (rtp_sessionConnect(session, "127.0.0.1", 12390) == 0)
+    {
+        payload = session->sender->payload_size;
+        state = rtp_sessionSend(session, "testdata", 1);
+    }
+    rtp_sessionClose(session);
+    stopReceiverShards(shards);
+
+    // Every stripe is a session of its own, all writing one file.
+    std::vector<std::string> files;
+    int flows = 0, bytes = 0;
+    for (int i = 0; i < count; i++)
+        for (auto& done : records[i].done)
+        {
+            flows++;
+            bytes += done.second;
+            files.push_back(done.first);
+        }
+    freeReceiverShards(shards);
+    EXPECT_EQ(state, 0);
+    EXPECT_EQ(payload, 16384u);
+    EXPECT_EQ(flows, stripes);
+    EXPECT_EQ(bytes, 3000000);
+    ASSERT_FALSE(files.empty());
+    for (auto& file : files)
+        EXPECT_EQ(file, files[0]);
+    EXPECT_EQ(diff_file((char*)"testdata", (char*)files[0].c_str()), 1);
+    remove(files[0].c_str());
+}
+
+TEST(RTP, PACER)
+{
+    rtp_pacer_t pacer;
+    // 1 MB/s: the bucket holds 1 ms of sending, at least two full pkts.
+    rtp_pacerInit(&pacer, 1000000, 0);
+    EXPECT_EQ(pacer.burst, 2944u);
+    EXPECT_EQ(rtp_pacerDelay(&pacer, 0), 0u);
+    rtp_pacerSpend(&pacer, 1472, 0);
+    rtp_pacerSpend(&pacer, 1472, 0);
+    EXPECT_EQ(rtp_pacerDelay(&pacer, 0), 1u);
+    rtp_pacerSpend(&pacer, 1000, 0);
+    EXPECT_EQ(rtp_pacerDelay(&pacer, 0), 1001u);
+    EXPECT_EQ(rtp_pacerDelay(&pacer, 1001), 0u);
+    // Idle time refills no more than the bucket holds.
+    EXPECT_EQ(rtp_pacerDelay(&pacer, 1000000), 0u);
+    EXPECT_DOUBLE_EQ(pacer.tokens, 2944);
+
+    // Departure times follow one another at rate.
+    rtp_pacerInit(&pacer, 1000000, 100);
+    EXPECT_EQ(rtp_pacerDepart(&pacer, 1000, 100), 100u);
+    EXPECT_EQ(rtp_pacerDepart(&pacer, 1000, 100), 1100u);
+    EXPECT_EQ(rtp_pacerDepart(&pacer, 1000, 5000), 5000u);
+
+    // Without an RTT sample there is no rate to follow.
+    rtp_cc_t cc;
+    rtp_ccInit(&cc, &rtp_cc_newreno, 64);
+    EXPECT_EQ(rtp_pacerRateOf(&cc, 1472, 0), 0u);
+    EXPECT_EQ(rtp_pacerRateOf(&cc, 1000, 1000), 8000000u);
+}
+
+TEST(RTP, PACED_TRANSFER)
+{
+    // A fixed rate of 20 MB/s stretches 3 MB over about 150 ms, pacing by cwnd or SO_TXTIME only has to deliver.
+    const uint64_t rates[] = {20000000, 0, 0};
+    const int txtimes[] = {0, 0, 1};
+    for (int i = 0; i < 3; i++)
+    {
+        int bytes = -1, state = -1;
+        uint64_t rate = rates[i];
+        int txtime = txtimes[i];
+        uint64_t start = mono_us();
+        session_transfer(6, "testdata", [rate, txtime](rtp_session_t* session) {
+            rtp_sessionSetPacing(session, 1, rate, txtime);
+        }, &bytes, &state);
+        uint64_t elapsed = mono_us() - start;
+        EXPECT_EQ(state, 0);
+        EXPECT_EQ(bytes, 3000000);
+        EXPECT_EQ(diff_file((char*)"testdata", (char*)"recvfile_6"), 1);
+        if (rates[i])
+        {
+            EXPECT_GE(elapsed, 100000u);
+        }
+        remove("recvfile_6");
+    }
+}
+
+static void large_receiver(int direct, int* bytes)
+{
+    rtp_session_t* session = rtp_createSession(64);
+    rtp_sessionSetPayloadSize(session, RTP_MAX_PAYLOAD);
+    rtp_sessionSetDirectWrite(session, direct);
+    if (rtp_sessionAccept(session, 12377) == 0)
+        *bytes = rtp_sessionRecv(session, "recvfile_large", 1);
+    rtp_sessionClose(session);
+}
+
+TEST(RTP, NEGOTIATED_PAYLOAD)
+{
+    // A size asked for, then a size probed up to the loopback MTU.
+    const uint32_t asked[] = {32768, 0};
+    for (int i = 0; i < 2; i++)
+    {
+        int bytes = -1, state = -1;
+        uint32_t payload = 0;
+        std::thread receiver(large_receiver, i == 0, &bytes);
+        usleep(10000);
+        rtp_session_t* session = rtp_createSession(64);
+        rtp_sessionSetPayloadSize(session, asked[i]);
+        if (rtp_sessionConnect(session, "127.0.0.1", 12377) == 0)
+        {
+            payload = session->sender->payload_size;
+            state = rtp_sessionSend(session, "testdata", 1);
+        }
+        rtp_sessionClose(session);
+        receiver.join();
+        EXPECT_EQ(state, 0);
+        EXPECT_EQ(bytes, 3000000);
+        EXPECT_EQ(diff_file((char*)"testdata", (char*)"recvfile_large"), 1);
+        remove("recvfile_large");
+        if (asked[i])
+        {
+            EXPECT_EQ(payload, asked[i]);
+        }
+        else
+        {
+            EXPECT_GT(payload, (uint32_t)RTP_JUMBO_PAYLOAD);
+        }
+    }
+
+    // A receiver keeping the default takes no more than PAYLOAD_SIZE.
+    int bytes = -1, state = -1;
+    uint32_t payload = 0;
+    std::thread receiver(session_receiver, 7, &bytes);
+    usleep(10000);
+    rtp_session_t* session = rtp_createSession(64);
+    rtp_sessionSetPayloadSize(session, 0);
+    if (rtp_sessionConnect(session, "127.0.0.1", 12377) == 0)
+    {
+        payload = session->sender->payload_size;
+        state = rtp_sessionSend(session, "testdata", 1);
+    }
+    rtp_sessionClose(session);
+    receiver.join();
+    EXPECT_EQ(state, 0);
+    EXPECT_EQ(bytes, 3000000);
+    EXPECT_EQ(payload, (uint32_t)PAYLOAD_SIZE);
+    EXPECT_EQ(diff_file((char*)"testdata", (char*)"recvfile_7"), 1);
+    remove("recvfile_7");
+}
+
+TEST(RTP, UDP_OFFLOAD)
+{
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(12378);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(rx, (struct sockaddr*)&addr, sizeof(addr)), 0);
+
+    // A batch of full pkts and a short last one goes out in one segmented send.
+    const int pkts = 20;
+    rtp_batch_t* send_batch = rtp_createBatch(RTP_BATCH_SIZE);
+    bool gso = rtp_enableGSO(tx, send_batch) == 0;
+    static rtp_header_t headers[pkts];
+    static char payload[pkts][1000];
+    for (int i = 0; i < pkts; i++)
+    {
+        headers[i].type = RTP_DATA;
+        headers[i].length = i + 1 < pkts ? 1000 : 300;
+        headers[i].seq_num = i;
+        memset(payload[i], 'a' + i, sizeof(payload[i]));
+        rtp_batchPushPkt(send_batch, &headers[i], payload[i]);
+    }
+
+    // Fewer buffers than segments leaves some pending between receives.
+    rtp_batch_t* recv_batch = rtp_createBatch(8);
+    bool gro = rtp_enableGRO(rx, recv_batch) == 0;
+    for (int i = 0; i < 8; i++)
+        rtp_batchPush(recv_batch, malloc(2048), 2048);
+    EXPECT_EQ(rtp_sendBatch(tx, send_batch, (struct sockaddr*)&addr, sizeof(addr)), 0);
+
+    int got = 0;
+    for (int round = 0; round < 100 && got < pkts; round++)
+    {
+        if (!rtp_batchPending(recv_batch))
+        {
+            fd_set wait_fd;
+            FD_ZERO(&wait_fd);
+            FD_SET(rx, &wait_fd);
+            struct timeval timeout = {1, 0};
+            if (select(rx + 1, &wait_fd, NULL, NULL, &timeout) <= 0)
+                break;
+        }
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        int n = rtp_recvBatch(rx, recv_batch, (struct sockaddr*)&from, &fromlen);
+        ASSERT_NE(n, -1);
+        for (int i = 0; i < n; i++, got++)
+        {
+            rtp_header_t* header = (rtp_header_t*)rtp_batchBuffer(recv_batch, i);
+            uint32_t length = got + 1 < pkts ? 1000 : 300;
+            EXPECT_EQ(recv_batch->msgs[i].msg_len, sizeof(rtp_header_t) + length);
+            EXPECT_EQ(header->seq_num, (uint32_t)got);
+            EXPECT_EQ(((char*)(header + 1))[length - 1], 'a' + got);
+        }
+    }
+    EXPECT_EQ(got, pkts);
+    if (gso && gro)
+    {
+        EXPECT_TRUE(send_batch->gso);
+    }
+
+    for (uint32_t i = 0; i < recv_batch->count; i++)
+        free(rtp_batchBuffer(recv_batch, i));
+    rtp_freeBatch(recv_batch);
+    rtp_freeBatch(send_batch);
+    close(rx);
+    close(tx);
+}
+
+static void stream_writer(int* state)
+{
+    rtp_session_t* session = rtp_createSession(64);
+    *state = -1;
+    if (rtp_sessionConnect(session, "127.0.0.1", 12379) == 0)
+    {
+        // Writes of every size up to a few pkts, some of them gathered from three buffers.
+        static char data[3000000];
+        for (size_t i = 0; i < sizeof(data); i++)
+            data[i] = (char)(i * 7 + (i >> 11));
+        size_t sent = 0;
+        bool ok = true;
+        for (uint32_t n = 0; ok && sent < sizeof(data); n++)
+        {
+            size_t size = (n * 2654435761u) % 5000 + 1;
+            if (size > sizeof(data) - sent)
+                size = sizeof(data) - sent;
+            if (n % 3 == 0)
+            {
+                struct iovec iov[3] = {{data + sent, size / 3}, {data + sent + size / 3, 0}, {data + sent + size / 3, size - size / 3}};
+                ok = rtp_writev(session, iov, 3) == (ssize_t)size;
+            }
+            else
+                ok = rtp_write(session, data + sent, size) == (ssize_t)size;
+            sent += size;
+        }
+        if (ok && rtp_flush(session) == 0)
+            *state = 0;
+    }
+    rtp_sessionClose(session);
+}
+
+static void stream_reader(std::vector<char>* received, ssize_t* last)
+{
+    rtp_session_t* session = rtp_createSession(64);
+    *last = -1;
+    if (rtp_sessionAccept(session, 12379) == 0)
+    {
+        // Reads of other sizes than the writes.
+        char buf[7000];
+        ssize_t n;
+        for (uint32_t i = 0; (n = rtp_read(session, buf, i % 7000 + 1)) > 0; i++)
+            received->insert(received->end(), buf, buf + n);
+        // The end stays the end.
+        if (n == 0)
+            *last = rtp_read(session, buf, sizeof(buf));
+    }
+    rtp_sessionClose(session);
+}
+
+TEST(RTP, STREAM_API)
+{
+    std::vector<char> received;
+    ssize_t last = -1;
+    int state = -1;
+    std::thread reader(stream_reader, &received, &last);
+    usleep(10000);
+    std::thread writer(stream_writer, &state);
+    writer.join();
+    reader.join();
+
+    EXPECT_EQ(state, 0);
+    EXPECT_EQ(last, 0);
+    ASSERT_EQ(received.size(), 3000000u);
+    bool same = true;
+    for (size_t i = 0; i < received.size() && same; i++)
+        same = received[i] == (char)(i * 7 + (i >> 11));
+    EXPECT_TRUE(same);
+}
+
+TEST(RTP, FEC_PARITY)
+{
+    // Any one pkt of a group, short last pkt included, is rebuilt from the parity and the others.
+    const uint32_t payload = 1461, count = 5;
+    const size_t lengths[count] = {payload, payload, 700, payload, 3};
+    std::vector<std::vector<char>> pkts(count);
+    rtp_fec_t fec;
+    rtp_fecInit(&fec, count, payload, 64);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        for (size_t j = 0; j < lengths[i]; j++)
+            pkts[i].push_back((char)(i * 31 + j * 7));
+        EXPECT_FALSE(rtp_fecFull(&fec));
+        rtp_fecAdd(&fec, 100 + i, pkts[i].data(), lengths[i]);
+    }
+    EXPECT_TRUE(rtp_fecFull(&fec));
+    std::vector<char> parity(sizeof(rtp_parity_t) + payload);
+    uint32_t first = 0;
+    ASSERT_EQ(rtp_fecTake(&fec, parity.data(), &first), sizeof(rtp_parity_t) + payload);
+    EXPECT_EQ(first, 100u);
+    rtp_parity_t header;
+    memcpy(&header, parity.data(), sizeof(header));
+    EXPECT_EQ(header.count, count);
+    for (uint32_t lost = 0; lost < count; lost++)
+    {
+        std::vector<char> rebuilt(parity.begin() + sizeof(header), parity.end());
+        uint16_t length = header.length;
+        for (uint32_t i = 0; i < count; i++)
+            if (i != lost)
+            {
+                rtp_fecXor(rebuilt.data(), pkts[i].data(), lengths[i]);
+                length ^= lengths[i];
+            }
+        ASSERT_EQ(length, lengths[lost]);
+        EXPECT_EQ(memcmp(rebuilt.data(), pkts[lost].data(), length), 0);
+    }
+    // The next group starts afresh.
+    EXPECT_EQ(rtp_fecTake(&fec, parity.data(), &first), 0u);
+    rtp_fecFree(&fec);
+
+    // An adaptive encoder shrinks its group as losses rise and grows it back without them.
+    rtp_fecInit(&fec, 0, payload, 128);
+    EXPECT_EQ(fec.group, (uint32_t)RTP_FEC_GROUP);
+    for (uint32_t i = 0; i <= 512; i++)
+    {
+        if (i % 20 == 0)
+            rtp_fecLoss(&fec);
+        rtp_fecAdd(&fec, i, pkts[0].data(), payload);
+        if (rtp_fecFull(&fec))
+            rtp_fecTake(&fec, parity.data(), &first);
+    }
+    EXPECT_LE(fec.group, 10u);
+    EXPECT_GE(fec.group, (uint32_t)RTP_FEC_MIN_GROUP);
+    for (uint32_t i = 0; i <= 512; i++)
+    {
+        rtp_fecAdd(&fec, i, pkts[0].data(), payload);
+        if (rtp_fecFull(&fec))
+            rtp_fecTake(&fec, parity.data(), &first);
+    }
+    EXPECT_EQ(fec.group, (uint32_t)RTP_FEC_MAX_GROUP);
+    rtp_fecFree(&fec);
+}
+
+TEST(RTP, FEC_TRANSFER)
+{
+    // Parity pkts interleaved with DATA leave the file intact, buffered and direct, fixed and adaptive.
+    const int ids[] = {11, 12};
+    const uint32_t groups[] = {0, 4};
+    for (int i = 0; i < 2; i++)
+    {
+        int bytes = -1, state = -1;
+        char filename[32];
+        sprintf(filename, "recvfile_%d", ids[i]);
+        uint32_t group = groups[i];
+        session_transfer(ids[i], "testdata", [group](rtp_session_t* session) {
+            rtp_sessionSetFEC(session, 1, group);
+        }, &bytes, &state);
+        EXPECT_EQ(state, 0);
+        EXPECT_EQ(bytes, 3000000);
+        EXPECT_EQ(diff_file((char*)"testdata", filename), 1);
+        remove(filename);
+    }
+}
+
+TEST(RTP, LZ_CODEC)
+{
+    // CSV-like text compresses well and comes back byte for byte, up to the largest payload.
+    std::string text;
+    for (int i = 0; text.size() < RTP_MAX_PAYLOAD; i++)
+        text += std::to_string(1600000000 + i * 37) + ",sensor_" + std::to_string(i % 13) + ",OK," + std::to_string(i % 1000) + "\n";
+    rtp_lz_t* lz = (rtp_lz_t*)calloc(1, sizeof(rtp_lz_t));
+    std::vector<char> packed(RTP_MAX_PAYLOAD), unpacked(RTP_MAX_PAYLOAD);
+    const size_t lengths[] = {PAYLOAD_SIZE, 200, RTP_MAX_PAYLOAD};
+    for (size_t length : lengths)
+    {
+        size_t size = rtp_lzCompress(lz, text.data(), length, packed.data(), length - 1);
+        ASSERT_GT(size, 0u);
+        if (length >= PAYLOAD_SIZE)
+        {
+            EXPECT_LT(size, length / 2);
+        }
+        ASSERT_EQ(rtp_lzDecompress(packed.data(), size, unpacked.data(), length), (ssize_t)length);
+        EXPECT_EQ(memcmp(unpacked.data(), text.data(), length), 0);
+        // Output beyond capacity and cut input are refused.
+        EXPECT_EQ(rtp_lzDecompress(packed.data(), size, unpacked.data(), length - 1), -1);
+        if (size > 2)
+        {
+            EXPECT_NE(rtp_lzDecompress(packed.data(), size - 2, unpacked.data(), length), (ssize_t)length);
+        }
+    }
+
+    // A run is a match overlapping the bytes it produces.
+    std::vector<char> run(5000, 'x');
+    run[4000] = 'y';
+    size_t size = rtp_lzCompress(lz, run.data(), run.size(), packed.data(), run.size());
+    ASSERT_GT(size, 0u);
+    EXPECT_LT(size, 100u);
+    ASSERT_EQ(rtp_lzDecompress(packed.data(), size, unpacked.data(), run.size()), (ssize_t)run.size());
+    EXPECT_EQ(memcmp(unpacked.data(), run.data(), run.size()), 0);
+
+    // Random bytes do not fit below their own size.
+    std::vector<char> noise(PAYLOAD_SIZE);
+    uint32_t x = 12345;
+    for (char& c : noise)
+        c = (char)((x = x * 1103515245 + 12345) >> 23);
+    EXPECT_EQ(rtp_lzCompress(lz, noise.data(), noise.size(), packed.data(), noise.size() - 1), 0u);
+
+    // A match reaching before the output is refused.
+    const char bad[] = {0x10, 'a', 0x05, 0x00};
+    EXPECT_EQ(rtp_lzDecompress(bad, sizeof(bad), unpacked.data(), 100), -1);
+    free(lz);
+}
+
+TEST(RTP, LZ_TRANSFER)
+{
+    // Text goes compressed, random testdata goes raw, buffered and direct.
+    FILE* f = fopen("lzdata", "wb");
+    ASSERT_NE(f, nullptr);
+    for (int i = 0; i < 100000; i++)
+        fprintf(f, "%d,%s,%d.%02d\n", 1600000000 + i * 37, i % 7 ? "OK" : "RETRY", i % 997, i % 100);
+    fclose(f);
+    const int ids[] = {13, 14, 15};
+    const char* files[] = {"lzdata", "lzdata", "testdata"};
+    for (int i = 0; i < 3; i++)
+    {
+        int bytes = -1, state = -1;
+        char filename[32];
+        sprintf(filename, "recvfile_%d", ids[i]);
+        session_transfer(ids[i], files[i], [](rtp_session_t* session) {
+            rtp_sessionSetCompression(session, 1);
+        }, &bytes, &state);
+        EXPECT_EQ(state, 0);
+        EXPECT_EQ(diff_file((char*)files[i], filename), 1);
+        remove(filename);
+    }
+    remove("lzdata");
+}
+
+static void resume_setup(rtp_session_t* session)
+{
+    rtp_sessionSetResume(session, 1);
+}
+
+TEST(RTP, RESUME_TRANSFER)
+{
+    std::vector<std::pair<std::string, int>> done;
+    setReceiverResume(1);
+    rtp_server_t* server = createReceiverServer(12386, 64, 4, 300, ".", 1);
+    setReceiverResume(0);
+    ASSERT_NE(server, nullptr);
+    setReceiverServerCallback(server, server_done, &done);
+
+    // A sender paced to 8 MB/s is killed about 2 MB into the file.
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int state = -1;
+        session_sender(12386, "testdata", 1, [](rtp_session_t* session) {
+            rtp_sessionSetResume(session, 1);
+            rtp_sessionSetPacing(session, 1, 8000000, 0);
+        }, &state, nullptr);
+        _exit(0);
+    }
+    std::thread server_thread(runReceiverServer, server);
+    usleep(250000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    // Its session is evicted, keeping the checkpoint.
+    usleep(600000);
+    ASSERT_EQ(done.size(), 1u);
+    EXPECT_EQ(done[0].second, -1);
+    std::string checkpoint = done[0].first + ".ckpt";
+    EXPECT_EQ(access(checkpoint.c_str(), F_OK), 0);
+
+    // The restarted sender only sends what is not on disk yet.
+    int state = -1;
+    uint32_t pkts = 0;
+    std::thread sender(session_sender, 12386, "testdata", 1, resume_setup, &state, &pkts);
+    sender.join();
+    usleep(100000);
+    stopReceiverServer(server);
+    server_thread.join();
+    freeReceiverServer(server);
+
+    EXPECT_EQ(state, 0);
+    EXPECT_GT(pkts, 0u);
+    EXPECT_LT(pkts, (3000000u + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE - 500);
+    ASSERT_EQ(done.size(), 2u);
+    EXPECT_EQ(done[1].first, done[0].first);
+    EXPECT_EQ(done[1].second, 3000000);
+    EXPECT_EQ(diff_file((char*)"testdata", (char*)done[1].first.c_str()), 1);
+    EXPECT_NE(access(checkpoint.c_str(), F_OK), 0);
+    remove(done[1].first.c_str());
+    remove(checkpoint.c_str());
+}
+
+static void offset_receiver(int direct, int* bytes)
+{
+    rtp_session_t* session = rtp_createSession(64);
+    rtp_sessionSetResume(session, 1);
+    rtp_sessionSetDirectWrite(session, direct);
+    if (rtp_sessionAccept(session, 12391) == 0)
+        *bytes = rtp_sessionRecv(session, "recvfile_large", 1);
+    rtp_sessionClose(session);
+}
+
+TEST(RTP, RESUME_LARGE_OFFSET)
+{
+    // A sparse file with its last MB past 4 GiB, resumed from a checkpoint covering the hole.
+    const off_t hole = (off_t)4 << 30;
+    std::string tail(1000000, 0);
+    uint32_t x = 4321;
+    for (char& c : tail)
+        c = (char)((x = x * 1103515245 + 12345) >> 23);
+    int fd = open("largedata", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(fd, -1);
+    ASSERT_EQ(pwrite(fd, tail.data(), tail.size(), hole), (ssize_t)tail.size());
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+
+    // Same layout as the receiver's <file>.ckpt.
+    struct __attribute__ ((__packed__)) large_checkpoint
+    {
+        uint32_t magic;
+        uint64_t file;
+        uint64_t total;
+        uint64_t done;
+        uint32_t crc;
+    } checkpoint = {0x43505452u, rtp_fileIdentity(&st), (uint64_t)st.st_size, (uint64_t)hole, 0};
+    checkpoint.crc = compute_checksum(&checkpoint, offsetof(large_checkpoint, crc));
+
+    for (int direct = 0; direct < 2; direct++)
+    {
+        fd = open("recvfile_large", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ASSERT_NE(fd, -1);
+        ASSERT_EQ(ftruncate(fd, hole), 0);
+        close(fd);
+        fd = open("recvfile_large.ckpt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ASSERT_EQ(write(fd, &checkpoint, sizeof(checkpoint)), (ssize_t)sizeof(checkpoint));
+        close(fd);
+
+        int bytes = -1, state = -1;
+        uint32_t pkts = 0;
+        std::thread receiver(offset_receiver, direct, &bytes);
+        usleep(10000);
+        std::thread sender(session_sender, 12391, "largedata", 1, resume_setup, &state, &pkts);
+        sender.join();
+        receiver.join();
+
+        EXPECT_EQ(state, 0);
+        EXPECT_EQ(bytes, INT_MAX);
+        EXPECT_LE(pkts, (tail.size() + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE + 1);
+        struct stat recv_st;
+        ASSERT_EQ(stat("recvfile_large", &recv_st), 0);
+        EXPECT_EQ(recv_st.st_size, st.st_size);
+        std::string received(tail.size(), 0);
+        fd = open("recvfile_large", O_RDONLY);
+        EXPECT_EQ(pread(fd, &received[0], received.size(), hole), (ssize_t)received.size());
+        close(fd);
+        EXPECT_TRUE(received == tail);
+        EXPECT_NE(access("recvfile_large.ckpt", F_OK), 0);
+        remove("recvfile_large");
+        remove("recvfile_large.ckpt");
+    }
+    remove("largedata");
+}
+
+// Old and new version of a file: bytes changed, inserted and removed in a few places.
+static std::string delta_versions(std::string* changed)
+{
+    std::string old(3000000, 0);
+    uint32_t x = 777;
+    for (char& c : old)
+        c = (char)((x = x * 1103515245 + 12345) >> 23);
+    *changed = old;
+    changed->replace(100000, 300, std::string(300, 'a'));
+    changed->insert(1000003, "inserted bytes");
+    changed->erase(2000000, 4321);
+    *changed += "appended";
+    return old;
+}
+
+TEST(RTP, DELTA_CODEC)
+{
+    std::string changed;
+    std::string old = delta_versions(&changed);
+    uint32_t block = rtp_deltaBlock(old.size());
+    EXPECT_GE(block, (uint32_t)RTP_DELTA_MIN_BLOCK);
+    EXPECT_LE(block, (uint32_t)RTP_DELTA_MAX_BLOCK);
+    uint32_t blocks = old.size() / block;
+    rtp_signature_t* sigs = (rtp_signature_t*)malloc(blocks * sizeof(rtp_signature_t));
+    for (uint32_t k = 0; k < blocks; k++)
+        rtp_deltaSignature(old.data() + (size_t)k * block, block, &sigs[k]);
+
+    // Read in odd-sized pieces, ops cut anywhere.
+    rtp_delta_t* delta = rtp_createDelta(sigs, blocks, block, changed.data(), changed.size());
+    std::string ops;
+    char piece[777];
+    size_t n;
+    while ((n = rtp_deltaRead(delta, piece, sizeof(piece))) > 0)
+        ops.append(piece, n);
+    rtp_freeDelta(delta);
+    // Only the blocks around the four edits go as literals.
+    EXPECT_LT(ops.size(), (size_t)8 * block);
+
+    FILE* f = fopen("delta_old", "wb");
+    ASSERT_NE(f, nullptr);
+    fwrite(old.data(), 1, old.size(), f);
+    fclose(f);
+    int basis = open("delta_old", O_RDONLY);
+    ASSERT_NE(basis, -1);
+    rtp_undelta_t undelta;
+    ASSERT_EQ(rtp_undeltaInit(&undelta, basis, block), 0);
+    FILE* out = tmpfile();
+    ssize_t written = 0;
+    uint32_t crc = 0;
+    for (size_t i = 0; i < ops.size(); i += 1000)
+        written += rtp_undeltaApply(&undelta, ops.data() + i, std::min<size_t>(1000, ops.size() - i), out, &crc);
+    EXPECT_EQ(written, (ssize_t)changed.size());
+    EXPECT_EQ(crc, compute_checksum(changed.data(), changed.size()));
+    EXPECT_TRUE(rtp_undeltaDone(&undelta));
+    std::string rebuilt(changed.size(), 0);
+    rewind(out);
+    EXPECT_EQ(fread(&rebuilt[0], 1, rebuilt.size(), out), rebuilt.size());
+    EXPECT_TRUE(rebuilt == changed);
+
+    // Unknown ops and copies beyond the old file are refused, a cut op is not done.
+    const char unknown[] = {9};
+    EXPECT_EQ(rtp_undeltaApply(&undelta, unknown, sizeof(unknown), out, NULL), -1);
+    rtp_undeltaFree(&undelta);
+    ASSERT_EQ(rtp_undeltaInit(&undelta, basis, block), 0);
+    char copy[9] = {RTP_DELTA_COPY};
+    uint32_t first = blocks - 1, count = 2;
+    memcpy(copy + 1, &first, 4);
+    memcpy(copy + 5, &count, 4);
+    EXPECT_EQ(rtp_undeltaApply(&undelta, copy, sizeof(copy), out, NULL), -1);
+    rtp_undeltaFree(&undelta);
+    ASSERT_EQ(rtp_undeltaInit(&undelta, basis, block), 0);
+    EXPECT_EQ(rtp_undeltaApply(&undelta, copy, 4, out, NULL), 0);
+    EXPECT_FALSE(rtp_undeltaDone(&undelta));
+    rtp_undeltaFree(&undelta);
+    fclose(out);
+    close(basis);
+    remove("delta_old");
+}
+
+static void delta_receiver(uint16_t port, int direct, int* bytes)
+{
+    rtp_session_t* session = rtp_createSession(128);
+    rtp_sessionSetDelta(session, 1);
+    rtp_sessionSetDirectWrite(session, direct);
+    if (rtp_sessionAccept(session, port) == 0)
+        *bytes = rtp_sessionRecv(session, "recvfile_delta", direct);
+    rtp_sessionClose(session);
+}
+
+TEST(RTP, DELTA_TRANSFER)
+{
+    std::string changed;
+    std::string old = delta_versions(&changed);
+    FILE* f = fopen("delta_new", "wb");
+    ASSERT_NE(f, nullptr);
+    fwrite(changed.data(), 1, changed.size(), f);
+    fclose(f);
+
+    // With the old version at the receiver only the edits go, buffered and direct;
+    // without one the whole file goes.
+    const uint16_t ports[] = {12387, 12388, 12389};
+    for (int i = 0; i < 3; i++)
+    {
+        remove("recvfile_delta");
+        if (i < 2)
+        {
+            f = fopen("recvfile_delta", "wb");
+            ASSERT_NE(f, nullptr);
+            fwrite(old.data(), 1, old.size(), f);
+            fclose(f);
+        }
+        int bytes = -1, state = -1;
+        uint32_t pkts = 0;
+        std::thread receiver(delta_receiver, ports[i], i % 2, &bytes);
+        usleep(10000);
+        std::thread sender(session_sender, ports[i], "delta_new", 1, [](rtp_session_t* session) {
+            rtp_sessionSetDelta(session, 1);
+        }, &state, &pkts);
+        sender.join();
+        receiver.join();
+        EXPECT_EQ(state, 0);
+        EXPECT_EQ(bytes, (int)changed.size());
+        EXPECT_EQ(diff_file((char*)"delta_new", (char*)"recvfile_delta"), 1);
+        EXPECT_NE(access("recvfile_delta.rtptmp", F_OK), 0);
+        if (i < 2)
+        {
+            EXPECT_LT(pkts, 50u);
+        }
+        else
+        {
+            EXPECT_GE(pkts, (uint32_t)(changed.size() / PAYLOAD_SIZE));
+        }
+    }
+    remove("recvfile_delta");
+    remove("delta_new");
+}
+
+TEST(RTP, FILE_DIGEST)
+{
+    // CRCs of consecutive pieces combine into the CRC of the whole, whatever the cut.
+    std::string data(70000, 0);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (char)(i * 7 + 3);
+    uint32_t whole = compute_checksum(data.data(), data.size());
+    const size_t cuts[] = {0, 1, 11, PAYLOAD_SIZE, 65536, 70000};
+    for (size_t cut : cuts)
+    {
+        EXPECT_EQ(crc32_combine(compute_checksum(data.data(), cut), compute_checksum(data.data() + cut, data.size() - cut), data.size() - cut), whole);
+    }
+
+    // A verified pkt is left holding the CRC of its payload.
+    rtp_packet_t* pkt = rtp_packet(RTP_DATA, 1000, 7, &data[0]);
+    EXPECT_EQ(rtp_verify(pkt, sizeof(rtp_header_t) + 1000), (ssize_t)(sizeof(rtp_header_t) + 1000));
+    EXPECT_EQ(pkt->rtp.checksum, compute_checksum(data.data(), 1000));
+    free(pkt);
+}
+
+static void digest_receiver(int* bytes)
+{
+    rtp_session_t* session = rtp_createSession(64);
+    if (rtp_sessionAccept(session, 12390) == 0)
+        *bytes = rtp_sessionRecv(session, "recvfile_digest", 1);
+    rtp_sessionClose(session);
+}
+
+TEST(RTP, DIGEST_TRANSFER)
+{
+    // Pkts that pass their own checksums end in an END whose digest matches them or not.
+    std::string data(3 * PAYLOAD_SIZE - 100, 0);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (char)(i * 13);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(12390);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (uint32_t flip = 0; flip < 2; flip++)
+    {
+        int bytes = 0;
+        std::thread receiver(digest_receiver, &bytes);
+        usleep(10000);
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        socklen_t addrlen = sizeof(addr);
+        rtp_rto_t rto;
+        rtp_rtoInit(&rto);
+        rtp_hello_t hello;
+        uint32_t conn;
+        ASSERT_EQ(rtp_connect(fd, &addr, &addrlen, &rto, &hello, &conn), 0);
+        EXPECT_TRUE(hello.caps & RTP_CAP_DIGEST);
+        uint32_t seq = 0;
+        for (size_t offset = 0; offset < data.size(); offset += PAYLOAD_SIZE, seq++)
+        {
+            uint16_t length = std::min<size_t>(PAYLOAD_SIZE, data.size() - offset);
+            rtp_packet_t* pkt = rtp_packet(RTP_DATA, length, seq, &data[offset]);
+            sendto(fd, pkt, sizeof(rtp_header_t) + length, 0, (struct sockaddr*)&addr, sizeof(addr));
+            free(pkt);
+        }
+        usleep(10000);
+        rtp_digest_t digest = {compute_checksum(data.data(), data.size()) ^ flip, data.size()};
+        rtp_sendctlPayload(fd, RTP_END, seq, &digest, sizeof(digest), (struct sockaddr*)&addr, sizeof(addr));
+        receiver.join();
+        close(fd);
+        EXPECT_EQ(bytes, flip ? RTP_RECV_CORRUPT : (int)data.size());
+    }
+    remove("recvfile_digest");
+}
+
+static void oversize_receiver(int* bytes)
+{
+    rtp_session_t* session = rtp_createSession(64);
+    // Room for pkts longer than the payload a plain sender gets.
+    rtp_sessionSetPayloadSize(session, RTP_MAX_PAYLOAD);
+    if (rtp_sessionAccept(session, 12392) == 0)
+        *bytes = rtp_sessionRecv(session, "recvfile_oversize", 1);
+    rtp_sessionClose(session);
+}
+
+// Take ACKs until none comes for 100 ms, marking each pkt ACKed as a sender without SACK does.
+static int take_acks(int fd, std::vector<bool>* acked)
+{
+    int count = 0;
+    char buf[RTP_ACK_SIZE] __attribute__((aligned(8)));
+    rtp_header_t* ack = (rtp_header_t*)buf;
+    while (recv(fd, buf, sizeof(buf), 0) >= (ssize_t)sizeof(rtp_header_t))
+    {
+        if (ack->type == RTP_ACK && ack->seq_num < acked->size())
+            (*acked)[ack->seq_num] = true;
+        count++;
+    }
+    return count;
+}
+
+TEST(RTP, OVERSIZE_DATA_NO_SACK)
+{
+    // Without SACK the opt receiver ACKs every pkt it takes, a pkt longer than the payload agreed is
+    // dropped without ACK, so the sender resends it and the transfer completes.
+    const uint32_t count = 8;
+    std::string data(count * PAYLOAD_SIZE, 0);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (char)(i * 31 + (i >> 9));
+    std::string oversize(PAYLOAD_SIZE + 1, 'x');
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(12392);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int bytes = -1;
+    std::thread receiver(oversize_receiver, &bytes);
+    usleep(10000);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval timeout = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::vector<bool> acked(count, false);
+    // An unmarked START, so no extensions are agreed.
+    rtp_sendctl(fd, RTP_START, 0x12345678, (struct sockaddr*)&addr, sizeof(addr));
+    EXPECT_GT(take_acks(fd, &acked), 0);
+
+    rtp_packet_t* pkt = rtp_packet(RTP_DATA, oversize.size(), 0, &oversize[0]);
+    sendto(fd, pkt, sizeof(rtp_header_t) + oversize.size(), 0, (struct sockaddr*)&addr, sizeof(addr));
+    free(pkt);
+    take_acks(fd, &acked);
+    EXPECT_FALSE(acked[0]);
+
+    // Pkts not ACKed yet are resent each round.
+    for (int round = 0; round < 10 && std::find(acked.begin(), acked.end(), false) != acked.end(); round++)
+    {
+        for (uint32_t seq = 0; seq < count; seq++)
+        {
+            if (acked[seq])
+                continue;
+            pkt = rtp_packet(RTP_DATA, PAYLOAD_SIZE, seq, &data[seq * PAYLOAD_SIZE]);
+            sendto(fd, pkt, sizeof(rtp_header_t) + PAYLOAD_SIZE, 0, (struct sockaddr*)&addr, sizeof(addr));
+            free(pkt);
+        }
+        take_acks(fd, &acked);
+    }
+    rtp_sendctl(fd, RTP_END, count, (struct sockaddr*)&addr, sizeof(addr));
+    receiver.join();
+    close(fd);
+
+    EXPECT_EQ(bytes, (int)data.size());
+    FILE* f = fopen("recvfile_oversize", "rb");
+    ASSERT_NE(f, nullptr);
+    std::string received(data.size() + 1, 0);
+    received.resize(fread(&received[0], 1, received.size(), f));
+    fclose(f);
+    EXPECT_TRUE(received == data);
+    remove("recvfile_oversize");
+}
+
+static void trickle_receiver(int* bytes)
+{
+    rtp_session_t* session = rtp_createSession(256);
+    rtp_sessionSetAckPolicy(session, 1000, 5000);
+    if (rtp_sessionAccept(session, 12393) == 0)
+        *bytes = rtp_sessionRecv(session, "recvfile_trickle", 1);
+    rtp_sessionClose(session);
+}
+
+TEST(RTP, COALESCED_ACK_DEADLINE)
+{
+    // A pkt every millisecond never lets the receiver idle for the 5 ms ACK delay, nor reaches
+    // 1000 pkts an ACK, still every pkt is ACKed about 5 ms after it arrived.
+    const uint32_t count = 200;
+    std::string data(PAYLOAD_SIZE, 'd');
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(12393);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int bytes = -1;
+    std::thread receiver(trickle_receiver, &bytes);
+    usleep(10000);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    socklen_t addrlen = sizeof(addr);
+    rtp_rto_t rto;
+    rtp_rtoInit(&rto);
+    rtp_hello_t hello;
+    uint32_t conn;
+    ASSERT_EQ(rtp_connect(fd, &addr, &addrlen, &rto, &hello, &conn), 0);
+    EXPECT_TRUE(hello.caps & RTP_CAP_SACK);
+
+    std::vector<uint64_t> sent(count);
+    uint32_t acked = 0;
+    uint64_t worst = 0;
+    char buf[RTP_ACK_SIZE] __attribute__((aligned(8)));
+    rtp_header_t* ack = (rtp_header_t*)buf;
+    for (uint32_t seq = 0; seq < count; seq++)
+    {
+        rtp_packet_t* pkt = rtp_packet(RTP_DATA, PAYLOAD_SIZE, seq, &data[0]);
+        sent[seq] = mono_us();
+        sendto(fd, pkt, sizeof(rtp_header_t) + PAYLOAD_SIZE, 0, (struct sockaddr*)&addr, sizeof(addr));
+        free(pkt);
+        usleep(1000);
+        // A cumulative ACK covers every pkt before its seq_num.
+        while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) >= (ssize_t)sizeof(rtp_header_t))
+        {
+            uint64_t now = mono_us();
+            for (; ack->type == RTP_ACK && acked < ack->seq_num && acked < count; acked++)
+                worst = std::max(worst, now - sent[acked]);
+        }
+    }
+    rtp_sendctl(fd, RTP_END, count, (struct sockaddr*)&addr, sizeof(addr));
+    receiver.join();
+    close(fd);
+
+    EXPECT_EQ(bytes, (int)(count * PAYLOAD_SIZE));
+    EXPECT_GT(acked, count / 2);
+    EXPECT_LT(worst, 50000u);
+    remove("recvfile_trickle");
+}
+
 int main(int argc, char **argv)
 {
     
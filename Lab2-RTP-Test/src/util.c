@@ -1,18 +1,185 @@
+#include <string.h>
 #include "util.h"
+#include "crc32_table.h"
 
-uint32_t crc32_for_byte(uint32_t r) {
-    for(int j = 0; j < 8; ++j)
-        r = (r & 1? 0: (uint32_t)0xEDB88320L) ^ r >> 1;
-    return r ^ (uint32_t)0xFF000000L;
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_PCLMUL
+#endif
+
+// Slicing-by-8: fold 8 input bytes per step with eight table lookups.
+// c is the raw (pre-inverted) CRC register.
+static uint32_t crc32_slice8(uint32_t c, const uint8_t* p, size_t n) {
+    while(n && ((uintptr_t)p & 7)) {
+        c = crc32_table[0][(c ^ *p++) & 0xFF] ^ c >> 8;
+        n--;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(n >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+            crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+            crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+            crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+#endif
+    while(n--)
+        c = crc32_table[0][(c ^ *p++) & 0xFF] ^ c >> 8;
+    return c;
+}
+
+#ifdef CRC32_PCLMUL
+// Folding constants for the reflected polynomial, see Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+
+static int crc32_use_pclmul = 0;
+
+// CPUID is probed once at load time, before any thread can checksum.
+__attribute__((constructor)) static void crc32_probe(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        crc32_use_pclmul = (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+// Carry-less multiply folding of 64-byte blocks down to a 32-bit CRC.
+// Requires n >= 64 and n % 16 == 0. c is the raw CRC register.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    p += 64;
+    n -= 64;
+
+    // Fold four 128-bit lanes in parallel.
+    while(n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        n -= 64;
+    }
+
+    // Fold the four lanes into one.
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold remaining 16-byte blocks.
+    while(n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        n -= 16;
+    }
+
+    // Fold 128 bits to 64 bits.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduce to 32 bits.
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
 }
+#endif
 
 void crc32(const void *data, size_t n_bytes, uint32_t* crc) {
-    static uint32_t table[0x100];
-    if(!*table)
-        for(size_t i = 0; i < 0x100; ++i)
-            table[i] = crc32_for_byte(i);
-    for(size_t i = 0; i < n_bytes; ++i)
-        *crc = table[(uint8_t)*crc ^ ((uint8_t*)data)[i]] ^ *crc >> 8;
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t c = ~*crc;
+#ifdef CRC32_PCLMUL
+    if(crc32_use_pclmul && n_bytes >= 64) {
+        size_t chunk = n_bytes & ~(size_t)15;
+        c = crc32_pclmul(c, p, chunk);
+        p += chunk;
+        n_bytes -= chunk;
+    }
+#endif
+    *crc = ~crc32_slice8(c, p, n_bytes);
+}
+
+#define CRC32_POLY 0xEDB88320u
+
+// x^(2^k) modulo the CRC polynomial, reflected. x^(2^32) is x again, so 32 powers repeat.
+static uint32_t crc32_x2n[32];
+
+// Product of two polynomials modulo the CRC polynomial, reflected. a must not be 0.
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    while(1) {
+        if(a & m) {
+            p ^= b;
+            if((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+__attribute__((constructor)) static void crc32_powers(void) {
+    uint32_t p = 1u << 30;  // x^1
+    crc32_x2n[0] = p;
+    for(int k = 1; k < 32; k++)
+        crc32_x2n[k] = p = crc32_multmodp(p, p);
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    // crc1 moves over len2 zero bytes: times x^(8 * len2), one power per set bit.
+    uint32_t p = 1u << 31;  // x^0
+    for(unsigned int k = 3; len2; len2 >>= 1, k++)
+        if(len2 & 1)
+            p = crc32_multmodp(crc32_x2n[k & 31], p);
+    return crc32_multmodp(p, crc1) ^ crc2;
 }
 
 uint32_t compute_checksum(const void* pkt, size_t n_bytes) {
@@ -20,4 +187,3 @@ uint32_t compute_checksum(const void* pkt, size_t n_bytes) {
     crc32(pkt, n_bytes, &crc);
     return crc;
 }
-
@@ -8,6 +8,7 @@ extern "C" {
 #include <stdint.h>
 #include <stddef.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
 
@@ -17,6 +18,12 @@ extern "C" {
 
 uint32_t compute_checksum(const void* pkt, size_t n_bytes);
 
+// Continue a CRC-32: *crc is the checksum of the data so far (0 to start).
+void crc32(const void *data, size_t n_bytes, uint32_t* crc);
+
+// CRC-32 of A followed by B, from crc1 of A, crc2 of B and the length of B, without touching the data.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
 static inline uint64_t now_us () {
     //  Use POSIX gettimeofday function to get precise time.
     struct timeval tv;
@@ -24,6 +31,13 @@ static inline uint64_t now_us () {
     return (tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec);
 }
 
+static inline uint64_t mono_us () {
+    //  Monotonic clock for timers, unaffected by wall clock changes.
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * (uint64_t) 1000000 + ts.tv_nsec / 1000);
+}
+
 static inline int msleep(unsigned int tms) {
     return usleep(tms * 1000);
 }
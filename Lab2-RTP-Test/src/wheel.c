@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include "wheel.h"
+
+#define WHEEL_MASK (RTP_WHEEL_SLOTS - 1)
+
+static void unlink_timer(rtp_wheel_t* wheel, uint32_t id){
+    rtp_timer_t* timer = &wheel->timers[id];
+    if(timer->prev != RTP_WHEEL_NONE)
+        wheel->timers[timer->prev].next = timer->next;
+    else
+        wheel->heads[timer->bucket] = timer->next;
+    if(timer->next != RTP_WHEEL_NONE)
+        wheel->timers[timer->next].prev = timer->prev;
+    timer->active = false;
+    wheel->active--;
+}
+
+/**
+ * @brief Link timer id into the bucket matching its expiry.
+ * expire may equal now while cascading, then it lands in the slot about to fire.
+*/
+static void link_timer(rtp_wheel_t* wheel, uint32_t id){
+    rtp_timer_t* timer = &wheel->timers[id];
+    uint64_t expire = timer->expire;
+    int level = 0;
+    while(level < RTP_WHEEL_LEVELS - 1 && (expire >> (level * RTP_WHEEL_BITS)) - (wheel->now >> (level * RTP_WHEEL_BITS)) >= RTP_WHEEL_SLOTS)
+        level++;
+    int shift = level * RTP_WHEEL_BITS;
+    // Beyond the top level, park in its farthest slot and cascade again from there.
+    if((expire >> shift) - (wheel->now >> shift) >= RTP_WHEEL_SLOTS)
+        expire = ((wheel->now >> shift) + RTP_WHEEL_SLOTS - 1) << shift;
+
+    timer->bucket = level * RTP_WHEEL_SLOTS + ((expire >> shift) & WHEEL_MASK);
+    timer->prev = RTP_WHEEL_NONE;
+    timer->next = wheel->heads[timer->bucket];
+    if(timer->next != RTP_WHEEL_NONE)
+        wheel->timers[timer->next].prev = id;
+    wheel->heads[timer->bucket] = id;
+    timer->active = true;
+    wheel->active++;
+}
+
+rtp_wheel_t* rtp_createWheel(uint32_t capacity, uint64_t tick_us, uint64_t now_us){
+    rtp_wheel_t* wheel = malloc(sizeof(rtp_wheel_t));
+    wheel->tick_us = tick_us;
+    wheel->now = now_us / tick_us;
+    wheel->capacity = capacity;
+    wheel->active = 0;
+    wheel->timers = calloc(capacity, sizeof(rtp_timer_t));
+    for(int i = 0; i < RTP_WHEEL_LEVELS * RTP_WHEEL_SLOTS; i++)
+        wheel->heads[i] = RTP_WHEEL_NONE;
+    return wheel;
+}
+
+void rtp_freeWheel(rtp_wheel_t* wheel){
+    if(!wheel)
+        return;
+    free(wheel->timers);
+    free(wheel);
+}
+
+void rtp_wheelSchedule(rtp_wheel_t* wheel, uint32_t id, uint64_t expire_us){
+    if(wheel->timers[id].active)
+        unlink_timer(wheel, id);
+    // Round up so a timer never fires early.
+    uint64_t expire = (expire_us + wheel->tick_us - 1) / wheel->tick_us;
+    wheel->timers[id].expire = expire > wheel->now ? expire : wheel->now + 1;
+    link_timer(wheel, id);
+}
+
+void rtp_wheelCancel(rtp_wheel_t* wheel, uint32_t id){
+    if(wheel->timers[id].active)
+        unlink_timer(wheel, id);
+}
+
+void rtp_wheelAdvance(rtp_wheel_t* wheel, uint64_t now_us, rtp_timer_cb cb, void* arg){
+    uint64_t target = now_us / wheel->tick_us;
+    while(wheel->now < target){
+        if(wheel->active == 0){
+            wheel->now = target;
+            break;
+        }
+        wheel->now++;
+
+        // Move timers of higher levels down when their slot comes around.
+        for(int level = RTP_WHEEL_LEVELS - 1; level > 0; level--){
+            int shift = level * RTP_WHEEL_BITS;
+            if(wheel->now & (((uint64_t)1 << shift) - 1))
+                continue;
+            uint32_t bucket = level * RTP_WHEEL_SLOTS + ((wheel->now >> shift) & WHEEL_MASK);
+            while(wheel->heads[bucket] != RTP_WHEEL_NONE){
+                uint32_t id = wheel->heads[bucket];
+                unlink_timer(wheel, id);
+                link_timer(wheel, id);
+            }
+        }
+
+        // Fire timers of this tick one by one, callbacks may rearm or cancel others.
+        uint32_t bucket = wheel->now & WHEEL_MASK;
+        while(wheel->heads[bucket] != RTP_WHEEL_NONE){
+            uint32_t id = wheel->heads[bucket];
+            unlink_timer(wheel, id);
+            cb(id, arg);
+        }
+    }
+}
+
+uint64_t rtp_wheelTimeout(rtp_wheel_t* wheel, uint64_t now_us){
+    if(wheel->active == 0)
+        return UINT64_MAX;
+    uint64_t tick = wheel->now + 1;
+    for(int i = 0; i < RTP_WHEEL_SLOTS; i++, tick++){
+        // A cascade may bring timers down at a slot boundary.
+        if(wheel->heads[tick & WHEEL_MASK] != RTP_WHEEL_NONE || (tick & WHEEL_MASK) == 0)
+            break;
+    }
+    uint64_t expire_us = tick * wheel->tick_us;
+    return expire_us > now_us ? expire_us - now_us : 0;
+}
@@ -0,0 +1,92 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RTP_WHEEL_LEVELS 4  // Levels of the hierarchy
+#define RTP_WHEEL_BITS   8  // log2 of slots per level
+#define RTP_WHEEL_SLOTS  (1 << RTP_WHEEL_BITS)
+#define RTP_WHEEL_NONE   UINT32_MAX
+
+// One timer, linked into the slot it expires in.
+typedef struct RTP_timer{
+    uint64_t expire;       // Expiry tick
+    uint32_t prev;         // Neighbours in slot list, RTP_WHEEL_NONE at the ends
+    uint32_t next;
+    uint16_t bucket;       // level * RTP_WHEEL_SLOTS + slot
+    bool active;
+} rtp_timer_t;
+
+// Hierarchical timing wheel: level l slot i holds timers whose expiry tick
+// differs from now only in bits of level l and above, with those bits equal to i.
+// Timers are identified by index, so a window slot owns timer slot.
+typedef struct RTP_wheel{
+    uint64_t now;          // Current tick
+    uint64_t tick_us;      // Microseconds per tick
+    uint32_t capacity;     // Number of timers
+    uint32_t active;       // Number of scheduled timers
+    rtp_timer_t* timers;
+    uint32_t heads[RTP_WHEEL_LEVELS * RTP_WHEEL_SLOTS]; // First timer of each slot
+} rtp_wheel_t;
+
+typedef void (*rtp_timer_cb)(uint32_t id, void* arg);
+
+/**
+ * @brief Create a timing wheel
+ * @param capacity Number of timers, identified by 0 .. capacity - 1
+ * @param tick_us Resolution in microseconds
+ * @param now_us Current time in microseconds
+ * @return A pointer to the wheel
+*/
+rtp_wheel_t* rtp_createWheel(uint32_t capacity, uint64_t tick_us, uint64_t now_us);
+
+/**
+ * @brief Free a timing wheel
+ * @param wheel Wheel to be freed
+*/
+void rtp_freeWheel(rtp_wheel_t* wheel);
+
+/**
+ * @brief Arm timer id to expire at expire_us, rearming it if already armed
+ * @param wheel Timing wheel
+ * @param id Timer index
+ * @param expire_us Absolute expiry time in microseconds
+*/
+void rtp_wheelSchedule(rtp_wheel_t* wheel, uint32_t id, uint64_t expire_us);
+
+/**
+ * @brief Disarm timer id, nothing happens if it is not armed
+ * @param wheel Timing wheel
+ * @param id Timer index
+*/
+void rtp_wheelCancel(rtp_wheel_t* wheel, uint32_t id);
+
+/**
+ * @brief Advance the wheel to now_us and call cb for every timer expired on the way.
+ * Timers are disarmed before cb runs, so cb may rearm them.
+ * @param wheel Timing wheel
+ * @param now_us Current time in microseconds
+ * @param cb Callback for expired timers
+ * @param arg Passed to cb
+*/
+void rtp_wheelAdvance(rtp_wheel_t* wheel, uint64_t now_us, rtp_timer_cb cb, void* arg);
+
+/**
+ * @brief Time until the wheel next needs advancing.
+ * Timers in higher levels only report when they cascade, so this may be early but never late.
+ * @param wheel Timing wheel
+ * @param now_us Current time in microseconds
+ * @return Microseconds to wait, UINT64_MAX if no timer is armed
+*/
+uint64_t rtp_wheelTimeout(rtp_wheel_t* wheel, uint64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif